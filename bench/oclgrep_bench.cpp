@@ -0,0 +1,307 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <boost/locale.hpp>
+#include <boost/program_options.hpp>
+
+#include "chunker.hpp"
+#include "common.hpp"
+#include "cpuengine.hpp"
+#include "engine.hpp"
+#include "regex_parser.hpp"
+#include "runner.hpp"
+
+namespace po = boost::program_options;
+
+// synthetic input, all generators are deterministic so numbers are comparable across runs and versions
+struct corpus {
+    std::string name;
+    std::function<std::string(std::size_t)> generate; // returns (at least) the requested number of bytes
+};
+
+// log lines with timestamps, levels, ids and IPs, rare ERROR lines
+std::string generate_ascii_log(std::size_t size) {
+    static const char* levels[] = {"DEBUG", "INFO", "INFO", "INFO", "WARN"};
+    static const char* words[] = {"request", "served", "cache", "miss", "worker", "connection", "closed", "timeout", "retry", "user"};
+    std::mt19937 rng(1);
+    std::string result;
+    result.reserve(size + 256);
+    while (result.size() < size) {
+        result += "2017-0" + std::to_string(1 + rng() % 9) + "-1" + std::to_string(rng() % 10) + " ";
+        result += std::to_string(10 + rng() % 14) + ":" + std::to_string(10 + rng() % 50) + ":" + std::to_string(10 + rng() % 50) + " ";
+        result += (rng() % 100 == 0) ? "ERROR" : levels[rng() % 5];
+        result += " worker-" + std::to_string(rng() % 64) + ":";
+        for (std::size_t i = 0, n = 3 + rng() % 8; i < n; ++i) {
+            result += " ";
+            result += words[rng() % 10];
+        }
+        result += " from 10." + std::to_string(rng() % 256) + "." + std::to_string(rng() % 256) + "." + std::to_string(rng() % 256) + "\n";
+    }
+    return result;
+}
+
+// CJK ideographs with some punctuation and line breaks, 3 bytes per codepoint in UTF8
+std::string generate_cjk(std::size_t size) {
+    std::mt19937 rng(2);
+    std::u32string text;
+    while (text.size() * 3 < size) {
+        auto r = rng() % 100;
+        if (r == 0) {
+            text.push_back(U'\n');
+        } else if (r < 5) {
+            text.push_back(U'。');
+        } else if (r < 10) {
+            // frequent pair, so literal searches have something to find
+            text += U"日本";
+        } else {
+            text.push_back(static_cast<char32_t>(0x4e00 + rng() % (0x9fff - 0x4e00)));
+        }
+    }
+    return boost::locale::conv::utf_to_utf<char>(text);
+}
+
+// uniformly distributed bytes (mostly invalid UTF8, the UTF32 conversion skips those)
+std::string generate_random_bytes(std::size_t size) {
+    std::mt19937 rng(3);
+    std::string result(size, '\0');
+    for (auto& c : result) {
+        c = static_cast<char>(rng() & 0xff);
+    }
+    return result;
+}
+
+// long runs of 'a' that almost match the "nested" patterns, so every start position walks far into the automaton
+std::string generate_adversarial(std::size_t size) {
+    std::mt19937 rng(4);
+    std::string result;
+    result.reserve(size + 4096);
+    while (result.size() < size) {
+        result.append(64 + rng() % 2048, 'a');
+        result += (rng() % 4 == 0) ? "b" : "c";
+        result += "ERRO";
+    }
+    return result;
+}
+
+// pattern matrix: literals, classes and chains of multipliers
+const std::vector<std::pair<std::string, std::string>> patterns = {
+    {"literal",          "ERROR"},
+    {"literal-cjk",      "日本"},
+    {"class",            "[0-9]{2}:[0-9]{2}:[0-9]{2}"},
+    {"class-wide",       "[a-z]{4,8} [a-z]{4}"},
+    {"multipliers",      "[abcdefg]{1,3}[aijklmop]{1,5}[abcdefjijklmnop]{0,2}[qrstu]{4,10}[abc]{2}"},
+    {"multipliers-runs", "a{1,32}[ab]{1,32}b"},
+};
+
+const std::vector<corpus> corpora = {
+    {"ascii-log",    generate_ascii_log},
+    {"cjk",          generate_cjk},
+    {"random-bytes", generate_random_bytes},
+    {"adversarial",  generate_adversarial},
+};
+
+int main(int argc, char** argv) {
+    try {
+        boost::locale::generator gen;
+        std::locale loc = gen("");
+        if (!std::use_facet<boost::locale::info>(loc).utf8()) {
+            throw user_error("sorry, this program only works on UTF8 systems");
+        }
+
+        // parse command line argument
+        std::string backend;
+        std::size_t corpus_size_mb;
+        std::uint32_t max_chunk_size;
+        std::size_t pipeline_depth;
+        std::size_t threads;
+        std::size_t repeat;
+        std::size_t platform_idx;
+        std::size_t device_idx;
+        std::string corpus_filter;
+        std::string pattern_filter;
+        std::string write_corpus;
+
+        po::options_description desc("Allowed options");
+        desc.add_options()
+            ("backend", po::value(&backend)->default_value("opencl"), "matching backend, either \"opencl\" or \"cpu\"")
+            ("corpus-size", po::value(&corpus_size_mb)->default_value(64), "size of every generated corpus in MB")
+            ("corpus", po::value(&corpus_filter)->default_value(""), "only run the corpus with this name")
+            ("pattern", po::value(&pattern_filter)->default_value(""), "only run the pattern with this name")
+            ("write-corpus", po::value(&write_corpus), "write all generated corpora to files with this prefix and exit")
+            ("utf8", "match directly on the UTF8 bytes instead of converting to UTF32")
+            ("no-dfa", "do not compile the regexes to DFAs")
+            ("no-prefilter", "do not use the literal prefilter")
+            ("no-alphabet", "do not compress the alphabet to character classes")
+            ("no-bitparallel", "do not use the bit-parallel engine")
+            ("max-chunk-size", po::value(&max_chunk_size)->default_value(16 * 1024 * 1024), "max number of elements per chunk")
+            ("pipeline-depth", po::value(&pipeline_depth)->default_value(2), "number of chunks the OpenCL backend processes at the same time")
+            ("threads", po::value(&threads)->default_value(std::max(1u, std::thread::hardware_concurrency())), "number of threads used by the CPU backend")
+            ("platform", po::value(&platform_idx)->default_value(0), "index of the OpenCL platform")
+            ("device", po::value(&device_idx)->default_value(0), "index of the OpenCL device within the platform")
+            ("repeat", po::value(&repeat)->default_value(3), "runs per (corpus, pattern), the fastest one is reported")
+            ("help", "produce help message")
+        ;
+
+        po::variables_map vm;
+        try {
+            po::store(po::parse_command_line(argc, argv, desc), vm);
+            po::notify(vm);
+        } catch(std::exception& e) {
+            throw user_error(e.what());
+        }
+
+        if (vm.count("help")) {
+            std::cout << "oclgrep_bench [OPTIONS]" << std::endl
+                << desc << std::endl;
+            return 1;
+        }
+        if (backend != "opencl" && backend != "cpu") {
+            throw user_error("unknown backend, use \"opencl\" or \"cpu\"!");
+        }
+        if (repeat == 0 || threads == 0 || pipeline_depth == 0) {
+            throw user_error("repeat, threads and pipeline-depth must be at least 1!");
+        }
+
+        // generate corpora
+        std::vector<std::pair<const corpus*, std::string>> data;
+        for (const auto& c : corpora) {
+            if (corpus_filter.empty() || corpus_filter == c.name) {
+                data.emplace_back(&c, c.generate(corpus_size_mb * 1024 * 1024));
+            }
+        }
+        if (data.empty()) {
+            throw user_error("no corpus with that name!");
+        }
+        if (vm.count("write-corpus")) {
+            for (const auto& d : data) {
+                std::string fname = write_corpus + d.first->name + ".txt";
+                std::ofstream out(fname, std::ios::binary);
+                out.write(d.second.data(), static_cast<std::streamsize>(d.second.size()));
+                if (!out) {
+                    throw user_error("cannot write " + fname);
+                }
+                std::cout << fname << std::endl;
+            }
+            return EXIT_SUCCESS;
+        }
+
+        std::shared_ptr<cpuengine> cpu_eng;
+        std::shared_ptr<oclengine> ocl_eng;
+        if (backend == "cpu") {
+            cpu_eng = std::make_shared<cpuengine>(threads);
+        } else {
+            ocl_eng = std::make_shared<oclengine>(platform_idx, device_idx);
+        }
+
+        std::cout << std::left
+            << std::setw(14) << "corpus" << std::setw(18) << "pattern" << std::right
+            << std::setw(12) << "matches" << std::setw(12) << "time[ms]" << std::setw(10) << "GB/s" << std::endl;
+
+        for (const auto& d : data) {
+            // conversion is not part of the measurement
+            std::u32string text_utf32;
+            if (!vm.count("utf8")) {
+                text_utf32 = boost::locale::conv::utf_to_utf<char32_t>(d.second);
+            }
+
+            for (const auto& p : patterns) {
+                if (!pattern_filter.empty() && pattern_filter != p.first) {
+                    continue;
+                }
+
+                graph_options gopts;
+                gopts.determinize = !vm.count("no-dfa");
+                gopts.encoding = vm.count("utf8") ? serial::encoding::utf8 : serial::encoding::utf32;
+                gopts.prefilter = !vm.count("no-prefilter");
+                gopts.alphabet = !vm.count("no-alphabet");
+                gopts.bitparallel = !vm.count("no-bitparallel");
+                serial::graph graph(0, 0);
+                try {
+                    graph = string_to_graph(boost::locale::conv::utf_to_utf<char32_t>(p.second), gopts);
+                } catch (user_error& e) {
+                    // report and keep going, so one pattern does not hide the numbers of all others
+                    std::string error = e.what();
+                    std::cout << std::left << std::setw(14) << d.first->name << std::setw(18) << p.first << std::right << "  " << error.substr(0, error.find('\n')) << std::endl;
+                    continue;
+                }
+
+                std::size_t overlap = 0;
+                try {
+                    overlap = overlap_for(graph, max_chunk_size);
+                } catch (user_error&) {
+                    throw user_error("max-chunk-size is too small for pattern " + p.first);
+                }
+
+                std::unique_ptr<runner> r;
+                if (cpu_eng) {
+                    r.reset(new cpurunner(cpu_eng, max_chunk_size, graph, false));
+                } else {
+                    r.reset(new oclrunner(ocl_eng, max_chunk_size, graph, false, pipeline_depth));
+                }
+                auto stages_setup = r->stages();
+
+                float best_ms = 0.f;
+                std::size_t n_matches = 0;
+                for (std::size_t i = 0; i < repeat; ++i) {
+                    // pushed through the runner like oclgrep does (pipelined, overlapping chunks)
+                    auto t_start = std::chrono::steady_clock::now();
+                    n_matches = 0;
+                    chunker chunks(*r, max_chunk_size, overlap);
+                    auto count = [&n_matches](std::size_t /*offset*/, std::size_t owned, const std::vector<match>& matches) {
+                        for (const auto& m : matches) {
+                            if (m.offset < owned) {
+                                n_matches += 1;
+                            }
+                        }
+                    };
+                    if (vm.count("utf8")) {
+                        chunks.run(d.second, count);
+                    } else {
+                        chunks.run(text_utf32, count);
+                    }
+                    auto t_end = std::chrono::steady_clock::now();
+                    float t_ms = std::chrono::duration<float, std::milli>(t_end - t_start).count();
+                    if (i == 0 || t_ms < best_ms) {
+                        best_ms = t_ms;
+                    }
+                }
+
+                float gbps = static_cast<float>(d.second.size()) / (best_ms * 1000.f * 1000.f);
+                std::cout << std::left
+                    << std::setw(14) << d.first->name << std::setw(18) << p.first << std::right
+                    << std::setw(12) << n_matches << std::setw(12) << std::fixed << std::setprecision(2) << best_ms
+                    << std::setw(10) << std::setprecision(3) << gbps << std::endl;
+
+                // per-stage device/host times, averaged over all runs
+                for (const auto& kv : r->stages()) {
+                    float t_stage = kv.second - stages_setup[kv.first];
+                    if (t_stage > 0.f) {
+                        std::cout << "    " << std::left << std::setw(18) << kv.first << std::right
+                            << std::setw(10) << std::setprecision(2) << (t_stage / static_cast<float>(repeat)) << "ms" << std::endl;
+                    }
+                }
+                std::cout.unsetf(std::ios::floatfield);
+            }
+        }
+    } catch (user_error& e) {
+        std::cerr << e.what() << std::endl;
+        return EXIT_FAILURE;
+    } catch (std::exception& e) {
+        std::cerr << "internal error: " << e.what() << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "common.hpp"
+
+// maps every element of text to its class id (see serial::alphabet), out must hold size bytes
+void map_to_classes(const serial::alphabet& classes, const char32_t* text, std::size_t size, std::uint8_t* out);
+void map_to_classes(const serial::alphabet& classes, const char* text, std::size_t size, std::uint8_t* out);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <vector>
+
+#include "common.hpp"
+#include "runner.hpp"
+
+// scans text[begin, end) backwards, starting with state d, and returns the state at begin (see serial::bitparallel)
+// text holds class ids of bp.classes, matches are appended in descending order
+// inject = false only follows the paths that are already in d and stops as soon as none is left
+std::uint64_t bp_scan(const serial::bitparallel& bp, const std::uint8_t* text, std::size_t begin, std::size_t end, std::uint64_t d, bool inject, std::vector<match>& result);
+
+// text was split into segments of segment_size elements that were scanned independently, starting with an empty state at
+// their end, seg_state holds the state at the begin of every segment
+// follows all paths that cross segment borders and appends the matches that were missed that way (usually no duplicates of the
+// segment scans, callers still have to remove them)
+void bp_fixup(const serial::bitparallel& bp, const std::uint8_t* text, std::size_t size, std::size_t segment_size, const std::vector<std::uint64_t>& seg_state, std::vector<match>& result);
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+
+#include <deque>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "runner.hpp"
+
+// number of lookahead elements every chunk needs for graph, so matches do not get lost at chunk borders
+// device_decode: chunks are UTF8 bytes that the runner decodes itself, while the graph counts codepoints
+std::size_t overlap_for(const serial::graph& graph, std::size_t max_chunk_size, bool device_decode = false);
+
+// splits a stream into chunks of at most max_chunk_size elements and keeps the runner pipeline full
+// every chunk (except the last one) ends with `overlap` elements of lookahead that are repeated at the beginning of the
+// next chunk, matches that start within the lookahead are dropped since the next chunk finds them as well
+class chunker {
+    public:
+        // gets the stream offset of a chunk, the number of elements it owns (no lookahead) and its matches, the ones
+        // after the owned elements are left to the caller
+        using handler = std::function<void(std::size_t offset, std::size_t owned, const std::vector<match>& matches)>;
+
+        chunker(runner& r, std::size_t max_chunk_size, std::size_t overlap);
+
+        // chunks that are still in flight are waited for, so the runner can be reused
+        ~chunker();
+
+        chunker(const chunker&) = delete;
+        chunker& operator=(const chunker&) = delete;
+
+        // number of elements of the next chunk of a text with size elements that are not lookahead
+        // last: nothing follows the text
+        std::size_t owned(std::size_t size, bool last) const;
+
+        // submits the first chunk of pending, which starts at the stream offset offset, returns the number of elements
+        // that are done with it (see owned), done gets called once its results are collected
+        std::size_t submit(const std::string& pending, std::size_t offset, bool last, handler done);
+        std::size_t submit(const std::u32string& pending, std::size_t offset, bool last, handler done);
+
+        // submits a whole stream and collects all results
+        void run(const std::string& text, handler done);
+        void run(const std::u32string& text, handler done);
+
+        // collects all chunks in flight
+        void drain();
+
+    private:
+        struct submission {
+            std::size_t offset;
+            std::size_t owned;
+            handler done;
+        };
+
+        runner& r;
+        std::size_t max_chunk_size;
+        std::size_t overlap;
+        std::deque<submission> submitted;
+
+        void collect();
+
+        template <typename S>
+        std::size_t submit_at(const S& text, std::size_t begin, std::size_t offset, bool last, handler done);
+
+        template <typename S>
+        void run_all(const S& text, handler done);
+};
@@ -2,6 +2,7 @@
 
 #include <cstdint>
 
+#include <algorithm>
 #include <exception>
 #include <sstream>
 #include <string>
@@ -55,12 +56,124 @@ namespace serial {
     static_assert(sizeof(character) == sizeof(word), "that won't serialize very well!");
     static_assert(sizeof(id) == sizeof(word), "that won't serialize very well!");
 
+    // text elements the graph transitions on
+    enum class encoding {
+        utf32, // one element per codepoint
+        utf8   // one element per byte
+    };
+
+    // what gets reported about every match
+    enum class match_mode : std::uint32_t {
+        starts,         // start position only, engines stop at the first accept
+        earliest,       // start and the earliest end
+        longest,        // start and the longest end
+        non_overlapping // leftmost-longest matches, a match is dropped if it starts within the previously reported one
+    };
+
+    // end the engines have to find, non-overlapping matches get picked from the longest ones afterwards
+    constexpr match_mode engine_mode(match_mode mode) {
+        return (mode == match_mode::non_overlapping) ? match_mode::longest : mode;
+    }
+
+    constexpr std::size_t unbounded = ~static_cast<std::size_t>(0);
+
+    constexpr id id_fail = 0;
+    constexpr id id_ok = 1;
+    constexpr id id_begin = 2;
+
+    // every node starts with a header word: (number of range boundaries << node_kind_bits) | lookup strategy
+    constexpr word node_kind_bits = 2;
+    constexpr word node_kind_mask = (1 << node_kind_bits) - 1;
+    constexpr word node_linear = 0;          // few ranges, scan the boundaries
+    constexpr word node_binary = 1;          // binary search over the boundaries
+    constexpr word node_ascii = 2;           // direct table for elements < ascii_table_size, binary search for the rest
+    constexpr word node_dense = 3;           // one list offset per class of the alphabet (the text holds class ids then)
+    constexpr std::size_t ascii_table_size = 128;
+    constexpr std::size_t class_table_size = 0x10000;
+
+    // partition of all elements into classes that no node can tell apart, the text gets mapped to class ids once
+    // elements in [bounds[i], bounds[i+1]) belong to class ids[i], everything else to class 0 (which never has a transition)
+    struct alphabet {
+        std::size_t n_classes;              // 0 = no compression, nodes transition on raw elements
+        std::vector<character> bounds;
+        std::vector<std::uint8_t> ids;
+        std::vector<std::uint8_t> table;    // class of every element < table.size(), saves the search for common elements
+
+        alphabet() : n_classes(0) {}
+
+        alphabet(std::size_t n_classes, const std::vector<character>& bounds, const std::vector<std::uint8_t>& ids) : n_classes(n_classes), bounds(bounds), ids(ids) {
+            std::size_t table_size = bounds.empty() ? 0 : std::min<std::size_t>(bounds.back(), class_table_size);
+            table.reserve(table_size);
+            for (std::size_t c = 0; c < table_size; ++c) {
+                table.push_back(lookup(static_cast<character>(c)));
+            }
+        }
+
+        std::uint8_t class_of(character c) const {
+            return c < table.size() ? table[c] : lookup(c);
+        }
+
+        private:
+            std::uint8_t lookup(character c) const {
+                if (bounds.empty() || c >= bounds.back()) {
+                    return 0;
+                }
+                auto it = std::upper_bound(bounds.begin(), bounds.end(), c);
+                if (it == bounds.begin()) {
+                    return 0;
+                }
+                return ids[static_cast<std::size_t>(it - bounds.begin()) - 1];
+            }
+    };
+
+    // bit-parallel simulation of the reversed automaton for graphs with at most 64 positions, text is scanned backwards
+    // a position is a node together with the classes of one of its edges (and the patterns that edge can lead to), the
+    // state has a bit per position whose edge can be taken next, so that the rest of the path matches the text
+    // per element: d = (first | follow(d)) & masks[class], a match of pattern i starts here if d & last[i]
+    struct bitparallel {
+        std::size_t n_positions;                // 0 = not available
+        alphabet classes;                       // text has to be mapped to these class ids
+        std::uint64_t first;                    // positions with an edge into an accept node
+        std::vector<std::uint64_t> tables;      // follow(d), one table of 256 entries per byte of d
+        std::vector<std::uint64_t> masks;       // positions that can be taken on every class
+        std::vector<std::uint64_t> last;        // positions of BEGIN, per pattern
+
+        bitparallel() : n_positions(0), first(0) {}
+
+        std::size_t n_tables() const {
+            return (n_positions + 7) / 8;
+        }
+    };
+
+    // literal that every match contains, starting min_offset to max_offset (can be unbounded) elements after the match start
+    struct literal {
+        std::u32string elements; // empty = no prefilter, for UTF8 graphs every element is a byte
+        std::size_t min_offset;
+        std::size_t max_offset;
+
+        literal() : min_offset(0), max_offset(0) {}
+    };
+
     struct graph {
         std::size_t n;                  // number of nodes
-        std::size_t o;                  // maximum cardinality of multi-edges
-        buffer data; // size = n * m * (sizeof(character) + o * sizeof(id))
-
-        graph(std::size_t n, std::size_t o) : n(n), o(o), data(n, 0) {} // 0 is also the id of fail, so good for unused space
+        std::size_t o;                  // maximum number of targets of a single transition
+        encoding enc;                   // what elements of the input text are
+        std::size_t max_length;         // maximum number of elements a match can span (or unbounded)
+        literal prefilter;              // required literal to skip hopeless start positions
+        id accept_base;                 // reaching node accept_base + i means that pattern i matches
+        std::size_t n_patterns;         // number of patterns (and therefore accept nodes)
+        alphabet classes;               // if set, all nodes are dense and the text has to be mapped to class ids
+        bitparallel bp;                 // alternative to data for small graphs (only finds start positions)
+        match_mode mode;                // what the engines report, see match_mode
+        // dispatch table (node id -> word offset of the node), then for every node:
+        //   [header, boundaries c_0..c_m-1, list offsets l_0..l_m-2, (ascii: ascii_table_size list offsets)]
+        //   or (dense) [header, list offsets l_0..l_n_classes-1]
+        // range i covers [c_i, c_i+1), then all target lists [k, id_1..id_k] (shared between nodes)
+        // list offsets are word offsets into data, 0 means no transition
+        // (stored as is in graph files, see graph_file_version)
+        buffer data;
+
+        graph(std::size_t n, std::size_t o) : n(n), o(o), enc(encoding::utf32), max_length(unbounded), accept_base(id_ok), n_patterns(1), mode(match_mode::starts), data(n, 0) {} // 0 is also the id of fail, so good for unused space
 
         std::size_t size() const {
             return data.size();
@@ -71,9 +184,6 @@ namespace serial {
         }
     };
 
-    constexpr id id_fail = 0;
-    constexpr id id_ok = 1;
-    constexpr id id_begin = 2;
 }
 
 
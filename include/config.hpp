@@ -5,4 +5,13 @@
 namespace cfg {
     constexpr std::size_t max_multiplier = 128;
     constexpr std::size_t max_ranges     = 64;
+    constexpr std::size_t max_dfa_states = 1024;
+    constexpr std::size_t max_overlap    = 4096; // chunk lookahead for patterns without maximum match length
+    constexpr std::size_t min_selectivity = 4;   // prefilter is only used if it keeps at most 1/min_selectivity of all start positions
+    constexpr std::size_t max_linear_ranges = 8;   // nodes with more ranges use a binary search
+    constexpr std::size_t min_ascii_ranges = 16;   // nodes with at least that many ranges below 128 get a direct ASCII table
+    constexpr std::size_t max_classes = 256;       // class ids of a compressed alphabet are single bytes
+    constexpr std::size_t max_dense_growth = 4;    // dense nodes may make the nodes of a graph at most that much bigger
+    constexpr std::size_t max_line_length = 1024 * 1024;     // elements of a line without a match kept for --lines, longer lines lose their beginning
+    constexpr std::size_t transcode_block_size = 1024 * 1024; // bytes of UTF8 input per thread, smaller inputs are decoded by one thread
 }
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "runner.hpp"
+#include "threadpool.hpp"
+
+class cpurunner;
+
+// checks only the given start positions of text, without the stack and iteration limits of the OpenCL kernel
+// (used to finish start positions the kernel had to give up on), result is sorted
+// if the graph has a compressed alphabet, text must already hold the class ids
+std::vector<match> match_positions(const serial::graph& graph, const std::u32string& text, const std::vector<std::uint32_t>& positions);
+std::vector<match> match_positions(const serial::graph& graph, const std::string& text, const std::vector<std::uint32_t>& positions);
+
+class cpuengine {
+    friend cpurunner;
+
+    public:
+        // config
+        static constexpr std::uint32_t block_size = 4096; // number of start positions a single task works on
+
+        explicit cpuengine(std::size_t n_threads);
+
+    private:
+        threadpool pool;
+};
+
+class cpurunner : public runner {
+    public:
+        cpurunner(const std::shared_ptr<cpuengine>& eng, std::uint32_t max_chunk_size, const serial::graph& graph, bool printProfile);
+
+        std::vector<match> run(const std::u32string& chunk) override;
+        std::vector<match> run(const std::string& chunk) override;
+
+    private:
+        std::shared_ptr<cpuengine> eng;
+        std::uint32_t max_chunk_size;
+        serial::graph graph;
+        bool printProfile;
+
+        template <typename S>
+        std::vector<match> run_elements(const S& chunk);
+
+        template <typename S>
+        std::vector<match> run_bitparallel(const S& chunk);
+};
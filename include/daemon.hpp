@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+
+#include "searcher.hpp"
+
+// answers requests on a UNIX stream socket at path until the process gets terminated, one thread per connection
+// if accepting connections fails, the open ones are shut down and their threads finished before the error is thrown
+// every request is a line, replies start with "ok" or "error <message>":
+//   compile <n> [utf8|no-dfa|no-prefilter|no-alphabet|no-bitparallel|match-end=<mode>]...
+//       followed by n lines with one UTF8 regex each, reply: ok <handle>
+//   search <handle> <size>
+//       followed by size bytes of UTF8 text, reply: ok <n>, followed by n lines "<offset> <end> <pattern>" (byte
+//       offsets, end is 0 unless the patterns were compiled with match-end)
+//   release <handle>
+//       reply: ok
+// texts and pattern sets larger than 256 MiB (or with more than 2^20 regexes) are answered with an error and the
+// connection gets closed
+void serve(searcher& s, const std::string& path);
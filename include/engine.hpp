@@ -2,8 +2,11 @@
 
 #include <cstdint>
 
+#include <deque>
 #include <memory>
+#include <ostream>
 #include <string>
+#include <utility>
 #include <vector>
 
 #define CL_HPP_ENABLE_EXCEPTIONS
@@ -12,6 +15,7 @@
 #include <CL/cl2.hpp>
 
 #include "common.hpp"
+#include "runner.hpp"
 
 class oclrunner;
 
@@ -20,10 +24,14 @@ class oclengine {
 
     public:
         // config
+        static constexpr std::uint32_t bp_segment_size = 256;                     // elements every work-item of the bit-parallel kernel scans
         static constexpr std::uint32_t cache_mask      = calc_alignement_mask(7); // sets cache alignement of local text cache base 32
+        static constexpr std::uint32_t compact_items   = 16;                      // elements per thread during result compaction, tile=group_size*compact_items
+        static constexpr std::uint32_t decode_segment_size = 256;                 // bytes every work-item of the UTF8 decoder handles
         static constexpr std::uint32_t flag_iter_max   = 1;                       // index of "we've reached too many iteratios"-flag
+        static constexpr std::uint32_t flag_matches_full = 2;                     // index of "match buffer of a pattern set was too small"-flag
         static constexpr std::uint32_t flag_stack_full = 0;                       // index of "thread-local stack was too small"-flag
-        static constexpr std::uint32_t flags_n         = 2;                       // number of flags
+        static constexpr std::uint32_t flags_n         = 3;                       // number of flags
         static constexpr std::uint32_t group_size      = 64;                      // OpenCL group size
         static constexpr std::uint32_t max_iter_count  = 2048;                    // limits number of iterations to prevent timeouts
         static constexpr std::uint32_t max_stack_size  = 128;                     // limits thread-local stack
@@ -33,7 +41,13 @@ class oclengine {
         static constexpr std::uint32_t sync_count      = 128;                     // controls after how many iterations group threads sync
         static constexpr std::uint32_t use_cache       = 0;                       // controls if kernels use local memory cache
 
-        oclengine();
+        // every engine drives a single device, built programs are cached in $XDG_CACHE_HOME/oclgrep (or ~/.cache/oclgrep),
+        // keyed by devices, sources and defines
+        explicit oclengine(std::size_t platform_idx = 0, std::size_t device_idx = 0, bool use_program_cache = true);
+
+        // (platform, device) indices of all devices of all platforms
+        static std::vector<std::pair<std::size_t, std::size_t>> available_devices();
+        static void print_devices(std::ostream& out);
 
     private:
         cl::Platform platform;
@@ -42,30 +56,115 @@ class oclengine {
         cl::CommandQueue queue;
 
         cl::Program programAutomaton;
+        cl::Program programBitparallel;
         cl::Program programCollector;
+        cl::Program programDecoder;
 
         cl::Kernel kernelAutomaton;
-        cl::Kernel kernelTransform;
-        cl::Kernel kernelScan;
-        cl::Kernel kernelMove;
+        cl::Kernel kernelBitparallel;
+        cl::Kernel kernelCount;
+        cl::Kernel kernelScanTiles;
+        cl::Kernel kernelCompact;
+        cl::Kernel kernelDecodeCount;
+        cl::Kernel kernelDecodeWrite;
+        cl::Kernel kernelToBytes;
 };
 
-class oclrunner {
+class oclrunner : public runner {
     public:
-        oclrunner(const std::shared_ptr<oclengine>& eng, std::uint32_t max_chunk_size, const serial::graph& graph, bool printProfile);
+        // pipeline_depth is the number of buffer sets, so up to this many chunks can be in flight at the same time
+        oclrunner(const std::shared_ptr<oclengine>& eng, std::uint32_t max_chunk_size, const serial::graph& graph, bool printProfile, std::size_t pipeline_depth = 1);
+
+        std::vector<match> run(const std::u32string& chunk) override;
+        std::vector<match> run(const std::string& chunk) override;
 
-        std::vector<std::uint32_t> run(const std::u32string& chunk);
+        // with a UTF32 graph, byte chunks are UTF8 that gets decoded on the device (see decoder.cl), offsets of their
+        // matches are byte offsets then
+        void enqueue(const std::u32string& chunk) override;
+        void enqueue(const std::string& chunk) override;
+        std::vector<match> wait() override;
+        std::size_t pending() const override;
+        std::size_t depth() const override;
 
     private:
+        // everything a chunk in flight needs, every slot has its own in-order queue
+        struct slot {
+            cl::CommandQueue queue;
+
+            cl::Buffer pText;         // pinned chunk (or its class ids) the host writes into, read directly on zero-copy devices
+            cl::Buffer dText;         // device copy of pText, decoded text with decode
+            cl::Buffer dOutput;
+            cl::Buffer dEnds;         // end of the match at every start position, only used if the graph reports ends
+            cl::Buffer dFlags;
+            cl::Buffer dCompacted;
+            cl::Buffer dCompactedEnds;
+            cl::Buffer dTileCounts;
+            cl::Buffer dStarts;
+            cl::Buffer dMatches;      // (startpos, pattern) pairs, only used for pattern sets
+            cl::Buffer dMatchesN;
+            cl::Buffer dUnfinished;   // start positions the kernel gave up on (stack or iteration limit)
+            cl::Buffer dUnfinishedN;
+            cl::Buffer dSegState;     // bit-parallel state at the begin of every segment
+            cl::Buffer dBytes;        // device copy of the UTF8 chunk that gets decoded into dText, allocated on first use
+            cl::Buffer dIndex;        // byte offset of every decoded codepoint
+            cl::Buffer dDecodeCounts; // codepoints per decoder segment, scanned to their offsets
+
+            std::vector<char> hFlags;
+            std::vector<std::uint32_t> hStarts; // prefiltered start positions, only used if use_starts is set
+            std::uint32_t hOutputSize;
+            std::uint32_t hMatchesN;
+            std::uint32_t hUnfinishedN;
+            std::vector<std::uint64_t> hSegState;
+            std::uint32_t hDecodedN;  // number of decoded codepoints
+            std::size_t text_bytes;   // size of the chunk in pText
+            std::size_t size;
+            std::size_t n_slots;      // number of start positions the automaton checks
+            bool use_starts;
+            bool use_bp;              // scanned by the bit-parallel kernel instead of the automaton
+            bool compressed;          // pText holds class ids (see serial::alphabet) instead of raw elements (the device text with decode)
+            bool decode;              // pText holds UTF8 that the device decodes
+            float map_ms;             // host time spent mapping the chunk to class ids
+
+            cl::Event evtUploadText;
+            cl::Event evtUploadFlags;
+            cl::Event evtUploadStarts;
+            cl::Event evtUploadMatchesN;
+            cl::Event evtUploadUnfinishedN;
+            cl::Event evtKernelAutomaton;
+            cl::Event evtKernelBitparallel;
+            cl::Event evtKernelCount;
+            cl::Event evtKernelScanTiles;
+            cl::Event evtKernelCompact;
+            cl::Event evtKernelCompactEnds;
+            cl::Event evtDownloadOutputSize;
+            cl::Event evtDownloadMatchesN;
+            cl::Event evtDownloadUnfinishedN;
+            cl::Event evtDownloadSegState;
+            cl::Event evtKernelDecodeCount;
+            cl::Event evtKernelDecodeScan;
+            cl::Event evtKernelDecodeWrite;
+            cl::Event evtDownloadDecodedN;
+            cl::Event evtDownloadFlags;
+        };
+
         std::shared_ptr<oclengine> eng;
         std::uint32_t max_chunk_size;
         serial::graph graph;
         bool printProfile;
 
         cl::Buffer dAutomatonData;
-        cl::Buffer dText;
-        cl::Buffer dOutput;
-        cl::Buffer dFlags;
-        cl::Buffer dScanbuffer0;
-        cl::Buffer dScanbuffer1;
+        cl::Buffer dBitparallel;   // tables, masks and last of graph.bp, only if it is available
+        cl::Buffer dAlphabet;      // bounds and ids of graph.classes for the decoder, only for compressed UTF32 graphs
+        std::uint32_t max_matches; // capacity of the match buffer, in entries
+        std::uint32_t match_words; // words per entry of the match buffer, (startpos, pattern[, end])
+        bool zero_copy;            // devices share the host memory, so kernels read pText instead of a copy
+
+        std::vector<slot> slots;
+        std::size_t next_slot;
+        std::deque<std::size_t> inflight;                 // slot indices, oldest first
+        std::deque<std::vector<match>> finished;          // results that had to be collected early to free a slot
+        std::vector<std::uint32_t> candidates;            // prefilter output of the chunk that is currently enqueued
+
+        void enqueue_elements(const void* text, std::size_t size, std::uint32_t width, bool use_starts, bool decode);
+        std::vector<match> complete(slot& s);
 };
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstdint>
+
+#include <string>
+
+#include "common.hpp"
+
+// compiled graphs on disk, so large pattern sets are parsed and lowered only once
+// layout (native little endian, every field is 8-byte aligned):
+//   header:  magic "OCLGRAPH", u32 version, u32 reserved (0), u64 payload size, u64 FNV-1a hash of the payload
+//   payload: u64 scalars and arrays (u64 element count, elements, zero padding) in this order:
+//     n, o, enc, max_length, accept_base, n_patterns, mode,
+//     prefilter: elements (u32), min_offset, max_offset,
+//     classes:   n_classes, bounds (u32), ids (u8),
+//     bp:        n_positions, classes (like above), first, tables (u64), masks (u64), last (u64),
+//     data (u32)
+// files of other versions are rejected, there is no migration
+// bump the version whenever this list or the layout of serial::graph::data (see serialize) changes
+constexpr std::uint32_t graph_file_version = 1;
+
+void save_graph(const serial::graph& graph, const std::string& fname);
+
+// maps the file and checks its structure (every node, list offset and target id), throws user_error for files that are
+// no (intact) graphs of this version
+serial::graph load_graph(const std::string& fname);
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// replaces directories by all files within them (recursively, sorted by name) and expands glob patterns
+// everything else (including "-" and paths that do not exist) is kept as-is, so opening them reports the error
+std::vector<std::string> expand_paths(const std::vector<std::string>& paths);
+
+// true if fname is a regular file, size is set to its size in bytes then
+bool regular_file_size(const std::string& fname, std::size_t& size);
+
+// reads a file (or stdin for "-") piece by piece with constant memory
+// regular files get mmap'ed, everything else (pipes, terminals) is read via a bounded buffer
+class input_file {
+    public:
+        using piece = std::pair<const char*, std::size_t>;
+
+        explicit input_file(const std::string& fname);
+        ~input_file();
+
+        input_file(const input_file&) = delete;
+        input_file& operator=(const input_file&) = delete;
+
+        // returns the next piece of at most max_bytes bytes which never splits an UTF8 codepoint
+        // (size 0 means EOF), data stays valid until the next call
+        // streams return whatever a single read delivered, so the piece can be smaller before EOF
+        piece next(std::size_t max_bytes);
+
+        // true if next() returns without waiting for more input
+        bool ready() const;
+
+    private:
+        int fd;
+        bool owns_fd;
+
+        // mmap mode
+        const char* map;
+        std::size_t map_size;
+        std::size_t map_pos;
+
+        // stream mode
+        std::string buffer;
+        std::string carry; // incomplete codepoint from the last read
+        bool eof;
+
+        piece next_mapped(std::size_t max_bytes);
+        piece next_stream(std::size_t max_bytes);
+};
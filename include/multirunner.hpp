@@ -0,0 +1,54 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "runner.hpp"
+
+// distributes chunks over multiple runners (e.g. one per OpenCL device), results are returned in submission order
+// every chunk goes to the runner that is expected to finish it first, based on the throughput measured so far
+class multirunner : public runner {
+    public:
+        explicit multirunner(std::vector<std::unique_ptr<runner>> runners, bool printProfile);
+        ~multirunner();
+
+        std::vector<match> run(const std::u32string& chunk) override;
+        std::vector<match> run(const std::string& chunk) override;
+
+        void enqueue(const std::u32string& chunk) override;
+        void enqueue(const std::string& chunk) override;
+        std::vector<match> wait() override;
+        std::size_t pending() const override;
+        std::size_t depth() const override;
+        stage_times stages() const override;
+
+    private:
+        using clock = std::chrono::steady_clock;
+
+        struct worker {
+            std::unique_ptr<runner> r;
+            std::size_t queued_elements;   // elements of chunks that were submitted but not collected
+            double throughput;             // elements per second, 0 = not measured yet
+            clock::time_point busy_until;  // completion of the last collected chunk
+            std::size_t n_chunks;
+            std::size_t n_elements;
+        };
+
+        struct submission {
+            std::size_t worker;
+            std::size_t size;
+            clock::time_point t_enqueue;
+        };
+
+        std::vector<worker> workers;
+        std::deque<submission> inflight;
+        bool printProfile;
+
+        std::size_t pick(std::size_t size) const;
+        void submitted(std::size_t idx, std::size_t size);
+};
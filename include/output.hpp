@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "runner.hpp"
+#include "transcode.hpp"
+
+// separates files within the searched stream, 0xffffffff is no codepoint and 0xff never occurs in UTF8,
+// so graphs have no transitions for it
+template <typename S>
+constexpr typename S::value_type stream_separator() {
+    return static_cast<typename S::value_type>(-1);
+}
+
+enum class output_mode {
+    offsets, // offset of every match within its file
+    lines,   // every line that contains a match (once)
+    count,   // number of matching lines per file
+    files    // names of all files with at least one match
+};
+
+struct output_options {
+    output_mode mode = output_mode::offsets;
+    bool print_output = true;        // print anything at all
+    bool print_pattern = false;      // offsets mode: append the index of the pattern that matched
+    bool print_ends = false;         // offsets mode: append the end offset of every match (exclusive)
+    bool non_overlapping = false;    // offsets mode: the longest match at a start wins, matches that start within it are dropped
+    bool byte_offsets = false;       // offsets mode: report byte offsets of the UTF8 input (requires an offset_map)
+    bool print_names = false;        // prefix the file name
+    bool print_line_numbers = false; // lines mode: prefix the line number
+};
+
+// turns the matches of consecutive stream regions into buffered output (no flush per match)
+template <typename S>
+class output_writer {
+    public:
+        // bytes maps stream offsets to byte offsets, only used (and pruned) with byte_offsets
+        output_writer(const std::vector<std::string>& files, const output_options& opts, offset_map* bytes = nullptr);
+
+        // file idx starts at this stream offset (right after a separator, unless it's the first one) and that byte offset
+        void begin_file(std::size_t offset, std::size_t idx, std::size_t byte = 0);
+
+        // true if process() requires the text of the regions and their line breaks
+        bool needs_text() const;
+
+        // positions of all newlines and file separators within the first size elements of text
+        static std::vector<std::uint32_t> index_lines(const S& text, std::size_t size);
+
+        // handles all matches that start within [offset, offset + size), regions have to be passed in stream order
+        // text and breaks are only used if needs_text() is set
+        void process(std::size_t offset, std::size_t size, const S& text, const std::vector<std::uint32_t>& breaks, const std::vector<match>& matches);
+
+        // ends the last line and file and writes everything out
+        void finish();
+
+        // writes out everything that is complete so far (a matching line might still be missing its end)
+        void flush();
+
+    private:
+        struct file_start {
+            std::size_t offset; // first stream offset
+            std::size_t byte;   // first byte offset
+            std::size_t idx;
+        };
+
+        const std::vector<std::string>& files;
+        output_options opts;
+        offset_map* bytes;
+
+        std::deque<file_start> boundaries; // every file that has not ended yet
+        std::size_t next_free;     // stream offset where the last reported match ends (non-overlapping)
+
+        // state of the current line and file (line modes)
+        S line;                    // text of the current line seen so far while it has no match (lines mode)
+        bool line_matched;         // the line is written out already, its remaining text follows directly
+        bool line_cut;             // the beginning of line got dropped to bound the memory
+        std::size_t line_number;   // 1-based, within the current file
+        std::size_t matched_lines; // within the current file
+
+        std::string buffer;
+
+        void match_line();
+        void append_line(const S& text, std::size_t begin, std::size_t end);
+        void end_line();
+        void end_file();
+        std::size_t file_offset(std::size_t global) const; // of a stream offset within the current file
+        void write_prefix();
+        void flush_if_full();
+};
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <cstdint>
+
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+
+// collects all start positions that can be the beginning of a match (sorted), based on the required literal of the graph
+// returns false if there is no literal or it is not selective enough (see cfg::min_selectivity), so all positions must be checked
+bool find_candidates(const serial::graph& graph, const std::u32string& text, std::vector<std::uint32_t>& candidates);
+bool find_candidates(const serial::graph& graph, const std::string& text, std::vector<std::uint32_t>& candidates);
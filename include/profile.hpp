@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstddef>
+
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// every stage the backends report, in pipeline order (CSV columns), the last one also defines n_profile_stages
+enum class profile_stage {
+    prefilter,
+    map_classes,
+    upload_text,
+    upload_flags,
+    kernel_decode_count,
+    kernel_decode_scan,
+    kernel_decode_write,
+    upload_unfinished_n,
+    upload_starts,
+    upload_matches_n,
+    kernel_automaton,
+    kernel_bitparallel,
+    kernel_count,
+    kernel_scan_tiles,
+    kernel_compact,
+    kernel_compact_ends,
+    kernel_to_bytes,
+    kernel_to_bytes_ends,
+    match_text,
+    match_bitparallel,
+    download_output_size,
+    download_matches_n,
+    download_output,
+    download_ends,
+    download_unfinished_n,
+    download_unfinished,
+    download_seg_state,
+    download_flags,
+    retry_host,
+    fixup_host,
+};
+constexpr std::size_t n_profile_stages = static_cast<std::size_t>(profile_stage::fixup_host) + 1;
+
+// name of the stage in all profiling output
+const char* stage_name(profile_stage s);
+
+// everything that is known about a single processed chunk
+struct chunk_profile {
+    std::string runner;                              // which runner/device processed the chunk
+    std::size_t elements = 0;                        // size of the chunk
+    std::size_t candidates = 0;                      // start positions the automaton had to check
+    std::size_t matches = 0;                         // including the ones within the lookahead
+    std::size_t retried = 0;                         // start positions the device gave up on, finished by the host
+    std::size_t bytes_up = 0;                        // host -> device
+    std::size_t bytes_down = 0;                      // device -> host
+    bool flag_iter_max = false;
+    bool flag_stack_full = false;
+    bool flag_matches_full = false;
+    std::vector<std::pair<std::string, float>> stages; // time per stage in ms, in execution order
+
+    void add_stage(profile_stage s, float ms) {
+        stages.emplace_back(stage_name(s), ms);
+    }
+};
+
+// machine-readable profiling output, one record per chunk and an aggregate at the end of the run
+// records can come from multiple runners, so the sink serializes them
+class profile_sink {
+    public:
+        virtual ~profile_sink() = default;
+
+        void record(const chunk_profile& p);
+
+        // writes the aggregate, t_ms is the wall time of the whole search and n_bytes its input size
+        void finish(float t_ms, std::size_t n_bytes);
+
+    protected:
+        std::size_t n_chunks = 0;
+        chunk_profile total;
+        bool finished = false; // finish() was called
+
+        virtual void write_chunk(std::size_t idx, const chunk_profile& p) = 0;
+        virtual void write_total(float t_ms, std::size_t n_bytes) = 0;
+
+    private:
+        std::mutex m;
+};
+
+// format is "json" (one document with a list of chunks and the aggregate) or "csv" (one row per chunk and a final
+// "total" row), output goes to fname
+// if the search fails before finish(), the JSON document gets "total":null and the CSV has no total row
+std::unique_ptr<profile_sink> make_profile_sink(const std::string& format, const std::string& fname);
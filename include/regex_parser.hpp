@@ -1,7 +1,20 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 #include "common.hpp"
 
-serial::graph string_to_graph(const std::u32string& input);
+struct graph_options {
+    bool determinize = true;                              // compile NFA to DFA if it stays below cfg::max_dfa_states
+    serial::encoding encoding = serial::encoding::utf32;  // transition on codepoints or on UTF-8 bytes
+    bool prefilter = true;                                // extract required literal for candidate prefiltering
+    bool alphabet = true;                                 // map text to equivalence classes and use dense nodes
+    bool bitparallel = true;                              // build a bit-parallel program if the pattern is small enough
+    serial::match_mode mode = serial::match_mode::starts; // what the engines report (the bit-parallel program only finds starts)
+};
+
+serial::graph string_to_graph(const std::u32string& input, const graph_options& opts = graph_options());
+
+// compiles all patterns into a single graph, pattern i accepts at node accept_base + i
+serial::graph string_to_graph(const std::vector<std::u32string>& inputs, const graph_options& opts = graph_options());
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "profile.hpp"
+
+struct match {
+    std::uint32_t offset;  // start position within the chunk
+    std::uint32_t pattern; // index of the regex that matched (see serial::graph::n_patterns)
+    std::uint32_t end;     // end position within the chunk (exclusive), only set if the graph reports ends (see serial::match_mode)
+
+    // ends do not take part in comparisons, merge_matches picks one per (offset, pattern)
+    bool operator<(const match& other) const {
+        return offset < other.offset || (offset == other.offset && pattern < other.pattern);
+    }
+
+    bool operator==(const match& other) const {
+        return offset == other.offset && pattern == other.pattern;
+    }
+};
+
+// sorts matches by start position and pattern and merges duplicates, keeping the earliest or longest end of mode
+void merge_matches(std::vector<match>& matches, serial::match_mode mode);
+
+// non-overlapping selection (see serial::match_mode::non_overlapping) over the sorted matches of consecutive regions
+// of a stream: of the matches that start within the first size elements of the region at stream offset offset, the
+// longest one at a start wins (lowest pattern on ties) and matches that start before next_free (where the last picked
+// one ends) are dropped, report gets every picked match
+template <typename Report>
+void pick_non_overlapping(const std::vector<match>& matches, std::size_t offset, std::size_t size, std::size_t& next_free, Report report) {
+    for (std::size_t i = 0; i < matches.size() && matches[i].offset < size; ++i) {
+        if (offset + matches[i].offset < next_free) {
+            continue;
+        }
+        std::size_t pick = i;
+        for (; i + 1 < matches.size() && matches[i + 1].offset == matches[pick].offset; ++i) {
+            if (matches[i + 1].end > matches[pick].end) {
+                pick = i + 1;
+            }
+        }
+        next_free = offset + matches[pick].end;
+        report(matches[pick]);
+    }
+}
+
+// accumulated time in ms per pipeline stage (e.g. "kernelAutomaton"), over all chunks a runner has processed
+using stage_times = std::map<std::string, float>;
+
+class runner {
+    public:
+        virtual ~runner() = default;
+
+        // returns all matches within the chunk, sorted by start position and pattern
+        // the UTF32 version requires a graph with serial::encoding::utf32, the byte version one with serial::encoding::utf8
+        // (unless the runner decodes UTF8 itself, see oclrunner)
+        virtual std::vector<match> run(const std::u32string& chunk) = 0;
+        virtual std::vector<match> run(const std::string& chunk) = 0;
+
+        // asynchronous interface: submit chunks and collect their results in submission order
+        // runners that cannot overlap work just run the chunk during enqueue
+        virtual void enqueue(const std::u32string& chunk);
+        virtual void enqueue(const std::string& chunk);
+        virtual std::vector<match> wait();
+
+        // number of submitted chunks that were not collected yet
+        virtual std::size_t pending() const;
+
+        // number of chunks that can be processed at the same time
+        virtual std::size_t depth() const;
+
+        // time spent per stage so far, chunks count once they were collected
+        virtual stage_times stages() const;
+
+        // reports every collected chunk to sink, name identifies this runner within the records
+        void set_profile_sink(const std::shared_ptr<profile_sink>& sink, const std::string& name);
+
+    protected:
+        stage_times stage_ms;
+
+        // adds the stage times of a collected chunk to the totals and forwards it to the sink (if any)
+        void record(chunk_profile p);
+
+    private:
+        std::deque<std::vector<match>> finished;
+        std::shared_ptr<profile_sink> sink;
+        std::string sink_name;
+};
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common.hpp"
+#include "regex_parser.hpp"
+#include "runner.hpp"
+#include "threadpool.hpp"
+
+class cpuengine;
+class oclengine;
+
+struct searcher_options {
+    std::string backend = "opencl";                   // "opencl" or "cpu"
+    std::size_t platform = 0;                         // OpenCL platform and device index (see oclengine::available_devices)
+    std::size_t device = 0;
+    bool program_cache = true;                        // use the on-disk cache of built OpenCL programs
+    std::size_t threads = 1;                          // CPU backend workers and UTF8 decoding
+    std::uint32_t max_chunk_size = 16 * 1024 * 1024;  // elements per chunk
+    std::size_t pipeline_depth = 2;                   // chunks the OpenCL backend processes at the same time
+};
+
+struct search_match {
+    std::size_t offset;    // byte offset of the match within the buffer
+    std::size_t end;       // byte offset where the match ends (exclusive), only set if the patterns report ends
+    std::uint32_t pattern; // index of the regex that matched
+};
+
+// long-lived search service: the engine (context, built programs) is set up once, patterns are compiled and uploaded once
+// per handle and every buffer is searched with the warm automaton
+// all methods are thread-safe, buffers are searched one after another by a single worker that owns all runners, so a
+// search keeps the whole pipeline of the device busy
+class searcher {
+    public:
+        using handle = std::uint64_t;
+
+        explicit searcher(const searcher_options& opts);
+        ~searcher();
+
+        searcher(const searcher&) = delete;
+        searcher& operator=(const searcher&) = delete;
+
+        // compiles the (UTF8) regexes into one graph and sets up a runner for it, throws user_error for invalid patterns
+        handle compile(const std::vector<std::string>& regexes, const graph_options& gopts = graph_options());
+
+        // frees the runner of h, searches that were already submitted still finish
+        void release(handle h);
+
+        // searches a whole UTF8 buffer (any size, it is split into overlapping chunks), matches are sorted by offset and
+        // pattern and reported as byte offsets, errors are rethrown by the future
+        // ends of unbounded patterns are only searched up to the capped chunk lookahead (see "Match Ends" in the README)
+        std::future<std::vector<search_match>> submit(handle h, std::string buffer);
+
+    private:
+        struct compiled {
+            serial::graph graph;
+            std::unique_ptr<runner> r;
+            std::size_t overlap; // lookahead of every chunk, see overlap_for
+        };
+
+        searcher_options opts;
+        std::shared_ptr<cpuengine> cpu_eng;
+        std::shared_ptr<oclengine> ocl_eng;
+        threadpool pool;
+
+        // protected by mutex
+        std::mutex mutex;
+        std::condition_variable cv_jobs;
+        std::deque<std::function<void()>> jobs;
+        std::map<handle, std::shared_ptr<compiled>> patterns;
+        handle next_handle;
+        bool shutdown;
+
+        std::thread worker;
+
+        void worker_loop();
+        void post(std::function<void()> job);
+
+        std::shared_ptr<compiled> lookup(handle h);
+        std::vector<search_match> search(compiled& c, const std::string& buffer);
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class threadpool {
+    public:
+        explicit threadpool(std::size_t n_threads);
+        ~threadpool();
+
+        threadpool(const threadpool&) = delete;
+        threadpool& operator=(const threadpool&) = delete;
+
+        std::size_t size() const;
+
+        // runs f(0), ..., f(n - 1) on all workers, blocks until all tasks are done
+        // the first exception thrown by a task gets rethrown here
+        void parallel_for(std::size_t n, const std::function<void(std::size_t)>& f);
+
+    private:
+        std::vector<std::thread> workers;
+
+        std::mutex mutex;
+        std::condition_variable cv_work;
+        std::condition_variable cv_done;
+
+        // current job, protected by mutex
+        const std::function<void(std::size_t)>* job;
+        std::size_t job_n;
+        std::size_t job_next;
+        std::size_t job_running;
+        std::size_t generation;
+        std::exception_ptr job_error;
+        bool shutdown;
+
+        void worker_loop();
+        void work_on_job(std::unique_lock<std::mutex>& lock);
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+
+#include <deque>
+#include <string>
+
+#include "threadpool.hpp"
+
+// maps codepoint offsets of a decoded stream back to byte offsets of its UTF8 input
+// stored as runs of codepoints with the same width, so ASCII text only needs a single run, bytes the decoder skipped
+// (invalid sequences) start a new run
+class offset_map {
+    public:
+        struct run {
+            std::size_t codepoint; // first codepoint of the run
+            std::size_t byte;      // its byte offset
+            std::size_t width;     // bytes per codepoint (0 for elements that have no bytes, e.g. file separators)
+        };
+
+        // codepoint starts at byte and takes width bytes, codepoints have to be pushed in order
+        void push(std::size_t codepoint, std::size_t byte, std::size_t width);
+
+        // appends all runs of other, shifted by the given offsets
+        void append(const offset_map& other, std::size_t codepoint, std::size_t byte);
+
+        // byte offset of codepoint, which must not be before the first run
+        std::size_t byte_offset(std::size_t codepoint) const;
+
+        // forgets everything that is only required for codepoints before codepoint
+        void drop_before(std::size_t codepoint);
+
+    private:
+        std::deque<run> runs;
+};
+
+// decodes UTF8 exactly like boost::locale::conv::utf_to_utf (illegal and incomplete sequences are skipped), long ASCII
+// runs are widened with SSE2/AVX2 if the CPU supports it
+// out must have room for end - begin elements, returns the number of codepoints written
+// map (optional) gets the byte offsets of all codepoints, relative to begin
+std::size_t utf8_to_utf32(const char* begin, const char* end, char32_t* out, offset_map* map = nullptr);
+
+// same, but the input is split into blocks at codepoint boundaries that are decoded by all threads of pool
+std::size_t utf8_to_utf32(const char* begin, const char* end, char32_t* out, threadpool& pool, offset_map* map = nullptr);
+
+// appends the decoded [begin, end) to text, with all threads of pool if it is set, map gets offsets relative to begin
+void append_utf32(std::u32string& text, const char* begin, const char* end, threadpool* pool = nullptr, offset_map* map = nullptr);
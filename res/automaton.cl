@@ -1,13 +1,22 @@
 /* defines (see host code for documentation):
+    - ASCII_TABLE_SIZE
     - CACHE_MASK
     - FLAG_ITER_MAX
+    - FLAG_MATCHES_FULL
     - FLAG_STACK_FULL
     - GROUP_SIZE
     - ID_BEGIN
     - ID_FAIL
-    - ID_OK
     - MAX_ITER_COUNT
     - MAX_STACK_SIZE
+    - MODE_EARLIEST
+    - MODE_LONGEST
+    - MODE_STARTS
+    - NODE_ASCII
+    - NODE_DENSE
+    - NODE_KIND_BITS
+    - NODE_KIND_MASK
+    - NODE_LINEAR
     - OVERSIZE_CACHE
     - RESULT_FAIL
     - SYNC_COUNT
@@ -18,48 +27,56 @@ bool is_master() {
     return get_local_id(0) == 0;
 }
 
-__constant uint* find_next_slot(uint state, uint element, uint n, uint o, __constant uint* automatonData) {
+// returns the target list [k, id_1..id_k] for element or 0 if there is no transition, every node picks its own lookup
+// strategy (see host code for the layout)
+__constant uint* find_next_list(uint state, uint element, __constant uint* automatonData) {
     const uint base_node = automatonData[state];
-    __constant uint* pNode = automatonData + base_node;
-    const uint m = pNode[0];
-    __constant uint* pNodeBody = pNode + 1;
-
-    if (m == 0) {
+    const uint header = automatonData[base_node];
+    const uint kind = header & NODE_KIND_MASK;
+    const uint m = header >> NODE_KIND_BITS;
+    __constant uint* pBounds = automatonData + base_node + 1;
+    __constant uint* pLists = pBounds + m;
+
+    uint offset;
+    if (kind == NODE_DENSE) {
+        // element is a class id
+        offset = (element < m) ? pBounds[element] : 0;
+    } else if (m < 2 || element < pBounds[0] || element >= pBounds[m - 1]) {
         return 0;
-    }
-
-    bool searching = true;
-
-    __constant uint* pNext = pNodeBody;
-    uint x_next = pNodeBody[0];
-
-    // exception for first round
-    __constant uint* pCurrent = pNext;
-    uint x_current = x_next;
-
-    __constant uint* pPreEnd = pNodeBody + (m - 1) * (1 + o);
-
-    while (pNext < pPreEnd && searching) {
-        pCurrent = pNext;
-        x_current = x_next;
-
-        pNext += (1 + o);
-        x_next = *pNext;
-
-        if (element >= x_current && element < x_next) {
-            searching = false;
+    } else if (kind == NODE_ASCII && element < ASCII_TABLE_SIZE) {
+        // one read, no search
+        offset = pLists[m - 1 + element];
+    } else if (kind == NODE_LINEAR) {
+        // few boundaries, walk them
+        uint i = 0;
+        while (i + 2 < m && element >= pBounds[i + 1]) {
+            i += 1;
         }
+        offset = pLists[i];
+    } else {
+        // find last boundary <= element (never the last one, it only marks the end of the previous range)
+        uint lo = 0;
+        uint hi = m - 1;
+        while (hi - lo > 1) {
+            uint mid = lo + (hi - lo) / 2;
+            if (pBounds[mid] <= element) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        offset = pLists[lo];
     }
 
-    if (searching) {
+    if (offset == 0) {
         return 0;
     } else {
-        return pCurrent + 1;
+        return automatonData + offset;
     }
 }
 
-uint state_from_slot(uint idx, __constant uint* pSlot, uint n) {
-    uint next_state = pSlot[idx];
+uint state_from_list(uint idx, __constant uint* pList, uint n) {
+    uint next_state = pList[1 + idx];
     if (next_state < n) {
         return next_state;
     } else {
@@ -67,6 +84,19 @@ uint state_from_slot(uint idx, __constant uint* pSlot, uint n) {
     }
 }
 
+// start positions whose tasks were not fully explored (stack overflow or iteration limit), the host re-runs them
+void report_unfinished(uint startpos, __global uint* unfinished, __global uint* unfinished_n) {
+    unfinished[atomic_inc(unfinished_n)] = startpos;
+}
+
+// end modes write the result of a start position once all of its tasks are done
+void write_end(uint slot, uint startpos, uint best_end, uint n_slots, __global uint* output, __global uint* ends) {
+    if (slot < n_slots && best_end != RESULT_FAIL) {
+        output[slot] = startpos;
+        ends[slot] = best_end;
+    }
+}
+
 struct stack_entry {
     uint pos;
     uint state;
@@ -114,7 +144,12 @@ bool sync(__local uint* active_count, uint iter_count, uint pos, __local uint* c
 }
 #endif
 
-uint get_element(uint pos, __local uint* cache, __local uint* cache_base, __global const uint* text) {
+uint get_element(uint pos, uint text_width, __local uint* cache, __local uint* cache_base, __global const uint* text) {
+    // UTF8 input, one byte per element (never cached)
+    if (text_width == 1) {
+        return ((__global const uchar*)text)[pos];
+    }
+
 #if USE_CACHE == 0
     return text[pos];
 #else
@@ -127,24 +162,39 @@ uint get_element(uint pos, __local uint* cache, __local uint* cache_base, __glob
 }
 
 __kernel void automaton(uint n,
-                        uint o,
                         uint size,
+                        uint text_width,
                         uint multi_input_n,
+                        uint accept_base,
+                        uint n_patterns,
+                        uint n_slots,
+                        uint use_starts,
+                        uint end_mode,
+                        __global const uint* starts,
                         __constant uint* automatonData,
                         __global const uint* text,
                         __global uint* output,
+                        __global uint* ends,
                         __global char* flags,
+                        __global uint* matches,
+                        __global uint* matches_n,
+                        uint max_matches,
+                        __global uint* unfinished,
+                        __global uint* unfinished_n,
                         __local uint* cache) {
     // constants
     const uint base_group = get_group_id(0) * multi_input_n * GROUP_SIZE;
 
     // private thread-local state
     // WARNING: the stack is only supposed to hold valid tasks!
-    //          (no ID_OK or ID_FAIL, only valid pos and startpos)
+    //          (no accept states or ID_FAIL, only valid pos and startpos)
     __private struct stack_entry stack[MAX_STACK_SIZE];
     uint stack_size = 0;
     uint iter_count = 0;
     uint input_round = 0;
+    bool dropped = false; // tasks of the current start position got lost because the stack was full
+    uint best_end = RESULT_FAIL; // earliest or longest end of the current start position so far (single pattern, end modes)
+    const uint match_words = (end_mode == MODE_STARTS) ? 2 : 3; // (startpos, pattern[, end]) for pattern sets
 
     // cache preparation
     __local uint active_count;
@@ -158,6 +208,7 @@ __kernel void automaton(uint n,
     bool work_left = true;
     uint pos_for_cache = 0xffffffff; // that's ok because cache loader does bounds checking and priorities small inputs
     uint startpos = 0xffffffff; // will never be used
+    uint slot = 0xffffffff; // output index of startpos
     while (work_left && iter_count < MAX_ITER_COUNT) {
         // 1. refill
         if (stack_size == 0 && input_round < multi_input_n) {
@@ -165,9 +216,20 @@ __kernel void automaton(uint n,
             //   [group_0: [rnd_0: [thread_0|...|thread_z] | ... | [rnd_y: thread_0|...|thread_z]]]
             //   | ... |
             //   [group_x: [rnd_0: [thread_0|...|thread_z] | ... | [rnd_y: thread_0|...|thread_z]]]
-            startpos = base_group + input_round * GROUP_SIZE + get_local_id(0);
+            // slots are either text positions or indices into the prefiltered start positions
+            if (dropped) {
+                report_unfinished(startpos, unfinished, unfinished_n);
+                dropped = false;
+            }
+            if (end_mode != MODE_STARTS && n_patterns == 1) {
+                write_end(slot, startpos, best_end, n_slots, output, ends);
+                best_end = RESULT_FAIL;
+            }
+            slot = base_group + input_round * GROUP_SIZE + get_local_id(0);
+
+            if (slot < n_slots) {
+                startpos = use_starts ? starts[slot] : slot;
 
-            if (startpos < size) {
                 // push to stack
                 stack[0].pos = startpos;
                 stack[0].state = ID_BEGIN;
@@ -175,7 +237,10 @@ __kernel void automaton(uint n,
                 pos_for_cache = startpos;
 
                 // write failed state, in case no task will finish
-                output[startpos] = RESULT_FAIL;
+                output[slot] = RESULT_FAIL;
+                if (end_mode != MODE_STARTS) {
+                    ends[slot] = RESULT_FAIL;
+                }
             }
 
             input_round += 1;
@@ -202,28 +267,58 @@ __kernel void automaton(uint n,
             uint pos = stack[stack_size].pos;
             uint state = stack[stack_size].state;
 
-            // run automaton one step
-            uint element = get_element(pos, cache, &base_cache, text);
-            __constant uint* pSlot = find_next_slot(state, element, n, o, automatonData);
+            // run automaton one step (unless the task cannot end any earlier than what we have already)
+            __constant uint* pList = 0;
+            if (end_mode != MODE_EARLIEST || pos + 1 < best_end) {
+                uint element = get_element(pos, text_width, cache, &base_cache, text);
+                pList = find_next_list(state, element, automatonData);
+            }
 
             // decide what to do next
-            if (pSlot) {
+            if (pList) {
                 // new data for stack
                 bool not_finished = true;
-                for (uint i = 0; i < o && not_finished; ++i) {
-                    uint state_for_stack = state_from_slot(i, pSlot, n);
+                const uint k = pList[0];
+                for (uint i = 0; i < k && not_finished; ++i) {
+                    uint state_for_stack = state_from_list(i, pList, n);
                     uint new_pos = pos + 1;
 
                     // finished?
-                    if (state_for_stack == ID_OK) {
-                        // write output
-                        output[startpos] = startpos;
-
-                        // prune remaining data
-                        stack_size = 0;
-
-                        // remaining slot entries are not required
-                        not_finished = false;
+                    uint pattern = state_for_stack - accept_base;
+                    if (state_for_stack >= accept_base && pattern < n_patterns) {
+                        if (n_patterns == 1 && end_mode != MODE_STARTS) {
+                            // other paths might end earlier or later, so keep going
+                            if (best_end == RESULT_FAIL) {
+                                best_end = new_pos;
+                            } else if (end_mode == MODE_EARLIEST) {
+                                best_end = min(best_end, new_pos);
+                            } else {
+                                best_end = max(best_end, new_pos);
+                            }
+                        } else if (n_patterns == 1) {
+                            // write output
+                            output[slot] = startpos;
+
+                            // prune remaining data, lost tasks do not matter anymore
+                            stack_size = 0;
+                            dropped = false;
+
+                            // remaining slot entries are not required
+                            not_finished = false;
+                        } else {
+                            // other patterns might still match, so append (startpos, pattern[, end]) and keep going
+                            // the host removes duplicates (and picks the earliest or longest end)
+                            uint idx = atomic_inc(matches_n);
+                            if (idx < max_matches) {
+                                matches[match_words * idx] = startpos;
+                                matches[match_words * idx + 1] = pattern;
+                                if (end_mode != MODE_STARTS) {
+                                    matches[match_words * idx + 2] = new_pos;
+                                }
+                            } else {
+                                flags[FLAG_MATCHES_FULL] = 1;
+                            }
+                        }
                     } else if (state_for_stack != ID_FAIL && new_pos < size) {
                         if (stack_size < MAX_STACK_SIZE) {
                             // push state to stack
@@ -235,6 +330,7 @@ __kernel void automaton(uint n,
                             pos_for_cache = new_pos;
                         } else {
                             flags[FLAG_STACK_FULL] = 1;
+                            dropped = true;
                         }
                     }
                 }
@@ -245,8 +341,27 @@ __kernel void automaton(uint n,
         iter_count += 1;
     }
 
-    // write global error state
+    // write global error state and hand everything that was not finished to the host
+    if (dropped || stack_size > 0) {
+        report_unfinished(startpos, unfinished, unfinished_n);
+    }
+    if (end_mode != MODE_STARTS && n_patterns == 1) {
+        // might be incomplete, but the host merges it with the result of the retry
+        write_end(slot, startpos, best_end, n_slots, output, ends);
+    }
     if (iter_count >= MAX_ITER_COUNT) {
         flags[FLAG_ITER_MAX] = 1;
+
+        // remaining rounds never started
+        for (; input_round < multi_input_n; ++input_round) {
+            uint rest = base_group + input_round * GROUP_SIZE + get_local_id(0);
+            if (rest < n_slots) {
+                output[rest] = RESULT_FAIL;
+                if (end_mode != MODE_STARTS) {
+                    ends[rest] = RESULT_FAIL;
+                }
+                report_unfinished(use_starts ? starts[rest] : rest, unfinished, unfinished_n);
+            }
+        }
     }
 }
@@ -0,0 +1,72 @@
+/* defines (see host code for documentation):
+    - FLAG_MATCHES_FULL
+    - RESULT_FAIL
+*/
+
+/* Bit-parallel simulation of the reversed automaton for small patterns (see serial::bitparallel on the host):
+    - every work-item scans one contiguous segment of class ids backwards, starting with an empty state at its end
+    - the state at the begin of every segment goes back to the host, which follows the paths that cross segment borders
+   Unlike the automaton kernel there are no stacks and no limits, every element costs a few table reads.
+   program layout: [tables (n_tables * 256) | masks (n_classes) | last (n_patterns)]
+*/
+
+__kernel void bitparallel(uint size,
+                          uint segment_size,
+                          uint n_tables,
+                          uint n_classes,
+                          uint n_patterns,
+                          ulong first,
+                          __constant ulong* program,
+                          __global const uchar* text,
+                          __global uint* output,
+                          __global ulong* seg_state,
+                          __global char* flags,
+                          __global uint* matches,
+                          __global uint* matches_n,
+                          uint max_matches) {
+    const uint seg = get_global_id(0);
+    const uint begin = seg * segment_size;
+    if (begin >= size) {
+        return;
+    }
+    const uint end = min(begin + segment_size, size);
+
+    __constant ulong* tables = program;
+    __constant ulong* masks = tables + n_tables * 256;
+    __constant ulong* last = masks + n_classes;
+
+    ulong any_last = 0;
+    for (uint i = 0; i < n_patterns; ++i) {
+        any_last |= last[i];
+    }
+
+    ulong d = 0;
+    for (uint pos = end; pos > begin; --pos) {
+        const uint p = pos - 1;
+
+        ulong t = first;
+        for (uint k = 0; k < n_tables; ++k) {
+            t |= tables[k * 256 + (uint)((d >> (8 * k)) & 0xff)];
+        }
+        d = t & masks[text[p]];
+
+        if (n_patterns == 1) {
+            // same output format as the automaton kernel, so the collector can compact it
+            output[p] = (d & any_last) ? p : RESULT_FAIL;
+        } else if (d & any_last) {
+            for (uint i = 0; i < n_patterns; ++i) {
+                if (d & last[i]) {
+                    uint idx = atomic_inc(matches_n);
+                    if (idx < max_matches) {
+                        matches[2 * idx] = p;
+                        matches[2 * idx + 1] = i;
+                    } else {
+                        flags[FLAG_MATCHES_FULL] = 1;
+                    }
+                }
+            }
+        }
+    }
+
+    seg_state[seg] = d;
+}
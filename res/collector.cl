@@ -1,40 +1,128 @@
 /* defines (see host code for documentation):
+    - COMPACT_ITEMS
+    - GROUP_SIZE
     - RESULT_FAIL
 */
 
-__kernel void transform(__global const uint* in, __global uint* out, uint size) {
-    uint idx = get_global_id(0);
-    if (idx < size) {
-        uint x = in[idx];
-        if (x != RESULT_FAIL) {
-            out[idx] = 1;
-        } else {
-            out[idx] = 0;
+/* Compaction of automaton results in 3 passes, every work-group handles one tile of GROUP_SIZE * COMPACT_ITEMS elements:
+    1. count:      number of results per tile
+    2. scan_tiles: exclusive prefix sum over all tile counts (single work-group), total gets appended
+    3. compact:    every tile scans its elements in local memory and writes them to the tile offset
+   Results stay in order, every pass touches the data only once.
+*/
+
+// Blelloch scan over GROUP_SIZE elements, turns buf into its exclusive prefix sum and returns the total
+uint scan_exclusive(__local uint* buf) {
+    uint lid = get_local_id(0);
+
+    // up-sweep
+    for (uint d = 1; d < GROUP_SIZE; d <<= 1) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        uint i = (lid + 1) * (d << 1) - 1;
+        if (i < GROUP_SIZE) {
+            buf[i] += buf[i - d];
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    uint total = buf[GROUP_SIZE - 1];
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid == 0) {
+        buf[GROUP_SIZE - 1] = 0;
+    }
+
+    // down-sweep
+    for (uint d = GROUP_SIZE >> 1; d > 0; d >>= 1) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        uint i = (lid + 1) * (d << 1) - 1;
+        if (i < GROUP_SIZE) {
+            uint t = buf[i - d];
+            buf[i - d] = buf[i];
+            buf[i] += t;
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    return total;
+}
+
+__kernel void count(__global const uint* in, __global uint* counts, uint size) {
+    __local uint sums[GROUP_SIZE];
+    uint lid = get_local_id(0);
+    uint base = get_group_id(0) * GROUP_SIZE * COMPACT_ITEMS;
+
+    // coalesced loads
+    uint sum = 0;
+    for (uint i = 0; i < COMPACT_ITEMS; ++i) {
+        uint idx = base + i * GROUP_SIZE + lid;
+        if (idx < size && in[idx] != RESULT_FAIL) {
+            sum += 1;
         }
     }
+    sums[lid] = sum;
+
+    // tree reduction
+    for (uint stride = GROUP_SIZE >> 1; stride > 0; stride >>= 1) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid < stride) {
+            sums[lid] += sums[lid + stride];
+        }
+    }
+
+    if (lid == 0) {
+        counts[get_group_id(0)] = sums[0];
+    }
 }
 
-__kernel void scan(const __global uint* in, __global uint* out, uint size, uint offset) {
-    uint idx_right = get_global_id(0);
-    if (idx_right < size) {
-        uint right = in[idx_right];
-        uint left = 0;
-        if (idx_right >= offset) {
-            uint idx_left = idx_right - offset;
-            left = in[idx_left];
+__kernel void scan_tiles(__global uint* counts, uint n_tiles) {
+    __local uint buf[GROUP_SIZE];
+    uint lid = get_local_id(0);
+
+    uint carry = 0;
+    for (uint base = 0; base < n_tiles; base += GROUP_SIZE) {
+        uint idx = base + lid;
+        buf[lid] = (idx < n_tiles) ? counts[idx] : 0;
+        uint total = scan_exclusive(buf);
+        if (idx < n_tiles) {
+            counts[idx] = carry + buf[lid];
         }
-        out[idx_right] = left + right;
+        carry += total;
+    }
+
+    if (lid == 0) {
+        counts[n_tiles] = carry;
     }
 }
 
-__kernel void move(__global const uint* in_rank, __global const uint* in_data, __global uint* out, uint size) {
-    uint idx_source = get_global_id(0);
-    if (idx_source < size) {
-        uint rank = in_rank[idx_source];
-        uint x = in_data[idx_source];
+__kernel void compact(__global const uint* in, __global const uint* offsets, __global uint* out, uint size) {
+    __local uint tile[GROUP_SIZE * COMPACT_ITEMS];
+    __local uint buf[GROUP_SIZE];
+    uint lid = get_local_id(0);
+    uint base = get_group_id(0) * GROUP_SIZE * COMPACT_ITEMS;
+
+    // coalesced loads into local memory
+    for (uint i = 0; i < COMPACT_ITEMS; ++i) {
+        uint idx = base + i * GROUP_SIZE + lid;
+        tile[i * GROUP_SIZE + lid] = (idx < size) ? in[idx] : RESULT_FAIL;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // every thread owns COMPACT_ITEMS consecutive elements, so order is preserved
+    __local const uint* mine = tile + lid * COMPACT_ITEMS;
+    uint n = 0;
+    for (uint i = 0; i < COMPACT_ITEMS; ++i) {
+        if (mine[i] != RESULT_FAIL) {
+            n += 1;
+        }
+    }
+    buf[lid] = n;
+    scan_exclusive(buf);
+
+    uint target = offsets[get_group_id(0)] + buf[lid];
+    for (uint i = 0; i < COMPACT_ITEMS; ++i) {
+        uint x = mine[i];
         if (x != RESULT_FAIL) {
-            uint idx_target = rank - 1; // inclusive to exclusive
-            out[idx_target] = x;
+            out[target] = x;
+            target += 1;
         }
     }
 }
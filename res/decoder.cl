@@ -0,0 +1,202 @@
+/* defines (see host code for documentation):
+    - RESULT_FAIL
+*/
+
+/* Decoding of UTF8 chunks into the UTF32 text (or its class ids) of the automaton kernel, in 3 passes:
+    1. decode_count: every work-item decodes one segment of bytes and counts its codepoints
+    2. scan_tiles:   exclusive prefix sum over the segment counts (see collector.cl), total gets appended
+    3. decode_write: every work-item decodes its segment again and writes its codepoints and their byte offsets
+   Segments have the same number of bytes, so non-latin text is balanced as well as ASCII. A segment starts at the first
+   byte its predecessor cannot reach (at most 3 bytes later), so every segment decodes exactly like the whole chunk.
+   Illegal and incomplete sequences are skipped like on the host. 0xff (the separator of byte streams) becomes the
+   separator 0xffffffff, class 0 with a compressed alphabet, which never has a transition.
+   The rest of the text (up to the number of bytes) is filled with separators, so the automaton can run on all bytes
+   without knowing the number of codepoints. The index maps every codepoint to its first byte, everything from the number
+   of codepoints up to (and including) the number of bytes maps to the number of bytes.
+   With a text width of 1 the text holds class ids of the alphabet: [bounds (n_bounds) | ids (n_bounds - 1)]
+*/
+
+// number of trail bytes of a lead byte, -1 if it cannot start a sequence
+int trail_length(uchar c) {
+    if (c < 0x80) {
+        return 0;
+    } else if (c < 0xc2) {
+        return -1;
+    } else if (c < 0xe0) {
+        return 1;
+    } else if (c < 0xf0) {
+        return 2;
+    } else if (c <= 0xf4) {
+        return 3;
+    } else {
+        return -1;
+    }
+}
+
+bool is_trail(uchar c) {
+    return (c & 0xc0) == 0x80;
+}
+
+// first position at or after p that no sequence that starts before it reaches
+uint segment_begin(uint p, uint size, __global const uchar* bytes) {
+    for (; p < size; ++p) {
+        // only the closest byte that is no trail byte can start a sequence that still reaches p
+        bool safe = true;
+        for (uint k = 1; k <= 3 && k <= p; ++k) {
+            const uchar c = bytes[p - k];
+            if (!is_trail(c)) {
+                safe = trail_length(c) < (int)k;
+                break;
+            }
+        }
+        if (safe) {
+            return p;
+        }
+    }
+    return size;
+}
+
+// decodes the sequence at *pos and advances *pos (a byte that should have been a trail byte is consumed as well, unless
+// it is a separator), returns false for illegal and incomplete sequences
+bool decode_next(uint* pos, uint size, __global const uchar* bytes, uint* codepoint) {
+    const uchar lead = bytes[*pos];
+    *pos += 1;
+    if (lead == 0xff) {
+        *codepoint = 0xffffffff;
+        return true;
+    }
+    const int n = trail_length(lead);
+    if (n < 0) {
+        return false;
+    } else if (n == 0) {
+        *codepoint = lead;
+        return true;
+    }
+
+    uint x = lead & ((1u << (6 - n)) - 1);
+    for (int i = 0; i < n; ++i) {
+        if (*pos == size) {
+            return false;
+        }
+        const uchar t = bytes[*pos];
+        if (!is_trail(t)) {
+            // separators are never swallowed, so matches cannot cross files
+            if (t != 0xff) {
+                *pos += 1;
+            }
+            return false;
+        }
+        *pos += 1;
+        x = (x << 6) | (t & 0x3f);
+    }
+
+    // no surrogates, nothing beyond the last codepoint and no overlong encodings
+    const int width = (x < 0x80) ? 1 : (x < 0x800) ? 2 : (x < 0x10000) ? 3 : 4;
+    if (x > 0x10ffff || (x >= 0xd800 && x <= 0xdfff) || width != n + 1) {
+        return false;
+    }
+    *codepoint = x;
+    return true;
+}
+
+// class id of a codepoint, class 0 for everything outside of the bounds
+uint class_of(uint c, uint n_bounds, __global const uint* alphabet) {
+    __global const uint* bounds = alphabet;
+    __global const uint* ids = alphabet + n_bounds;
+    if (n_bounds == 0 || c < bounds[0] || c >= bounds[n_bounds - 1]) {
+        return 0;
+    }
+
+    // last bound <= c
+    uint lo = 0;
+    uint hi = n_bounds - 1;
+    while (hi - lo > 1) {
+        const uint mid = (lo + hi) / 2;
+        if (c >= bounds[mid]) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return ids[lo];
+}
+
+__kernel void decode_count(uint size, uint segment_size, __global const uchar* bytes, __global uint* counts) {
+    const uint seg = get_global_id(0);
+    const uint begin = seg * segment_size;
+    if (begin > size) {
+        return;
+    }
+
+    uint pos = segment_begin(begin, size, bytes);
+    const uint end = segment_begin(min(begin + segment_size, size), size, bytes);
+    uint n = 0;
+    uint c;
+    while (pos < end) {
+        if (decode_next(&pos, size, bytes, &c)) {
+            n += 1;
+        }
+    }
+    counts[seg] = n;
+}
+
+__kernel void decode_write(uint size,
+                           uint segment_size,
+                           uint n_segments,
+                           uint text_width,
+                           uint n_bounds,
+                           __global const uchar* bytes,
+                           __global const uint* offsets,
+                           __global const uint* alphabet,
+                           __global uchar* text,
+                           __global uint* index) {
+    const uint seg = get_global_id(0);
+    const uint begin = seg * segment_size;
+    if (seg >= n_segments) {
+        return;
+    }
+
+    uint pos = segment_begin(begin, size, bytes);
+    const uint end = segment_begin(min(begin + segment_size, size), size, bytes);
+    uint out = offsets[seg];
+    while (pos < end) {
+        const uint first = pos;
+        uint c;
+        if (decode_next(&pos, size, bytes, &c)) {
+            if (text_width == 1) {
+                text[out] = (uchar)class_of(c, n_bounds, alphabet);
+            } else {
+                ((__global uint*)text)[out] = c;
+            }
+            index[out] = first;
+            out += 1;
+        }
+    }
+
+    // every segment fills its share of [n, size]
+    const uint n = offsets[n_segments];
+    for (uint i = max(begin, n); i < min(begin + segment_size, size + 1); ++i) {
+        if (i < size) {
+            if (text_width == 1) {
+                text[i] = 0;
+            } else {
+                ((__global uint*)text)[i] = 0xffffffff;
+            }
+        }
+        index[i] = size;
+    }
+}
+
+// replaces the codepoint offsets within values by byte offsets, values consists of entries of stride words and
+// offset_words has a bit for every word of an entry that is an offset (the others, e.g. pattern indices, are kept)
+__kernel void to_bytes(uint size, uint stride, uint offset_words, __global const uint* index, __global uint* values) {
+    const uint i = get_global_id(0);
+    if (i >= size || ((offset_words >> (i % stride)) & 1) == 0) {
+        return;
+    }
+
+    const uint x = values[i];
+    if (x != RESULT_FAIL) {
+        values[i] = index[x];
+    }
+}
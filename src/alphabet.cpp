@@ -0,0 +1,19 @@
+#include "alphabet.hpp"
+
+void map_to_classes(const serial::alphabet& classes, const char32_t* text, std::size_t size, std::uint8_t* out) {
+    const std::uint8_t* table = classes.table.data();
+    const std::size_t table_size = classes.table.size();
+    for (std::size_t i = 0; i < size; ++i) {
+        char32_t c = text[i];
+        out[i] = (c < table_size) ? table[c] : classes.class_of(c);
+    }
+}
+
+void map_to_classes(const serial::alphabet& classes, const char* text, std::size_t size, std::uint8_t* out) {
+    const std::uint8_t* table = classes.table.data();
+    const std::size_t table_size = classes.table.size();
+    for (std::size_t i = 0; i < size; ++i) {
+        auto c = static_cast<unsigned char>(text[i]);
+        out[i] = (c < table_size) ? table[c] : classes.class_of(c);
+    }
+}
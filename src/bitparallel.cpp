@@ -0,0 +1,76 @@
+#include <algorithm>
+
+#include "bitparallel.hpp"
+
+std::uint64_t bp_scan(const serial::bitparallel& bp, const std::uint8_t* text, std::size_t begin, std::size_t end, std::uint64_t d, bool inject, std::vector<match>& result) {
+    const std::uint64_t* tables = bp.tables.data();
+    const std::uint64_t* masks = bp.masks.data();
+    const std::size_t n_tables = bp.n_tables();
+    const std::uint64_t first = inject ? bp.first : 0;
+
+    std::uint64_t any_last = 0;
+    for (auto l : bp.last) {
+        any_last |= l;
+    }
+
+    for (std::size_t pos = end; pos > begin; --pos) {
+        if (!inject && d == 0) {
+            break;
+        }
+
+        std::uint64_t t = first;
+        for (std::size_t k = 0; k < n_tables; ++k) {
+            t |= tables[k * 256 + ((d >> (8 * k)) & 0xff)];
+        }
+        d = t & masks[text[pos - 1]];
+
+        if (d & any_last) {
+            for (std::size_t i = 0; i < bp.last.size(); ++i) {
+                if (d & bp.last[i]) {
+                    result.push_back(match{static_cast<std::uint32_t>(pos - 1), static_cast<std::uint32_t>(i), 0});
+                }
+            }
+        }
+    }
+
+    return d;
+}
+
+void bp_fixup(const serial::bitparallel& bp, const std::uint8_t* text, std::size_t size, std::size_t segment_size, const std::vector<std::uint64_t>& seg_state, std::vector<match>& result) {
+    // the step is linear in d (apart from first), so the real state is the state of the segment scan plus the paths that
+    // come from the segments to its right, the segment scan is repeated next to them to only report what it missed and to
+    // stop as soon as they do not add anything anymore
+    const std::uint64_t* tables = bp.tables.data();
+    const std::uint64_t* masks = bp.masks.data();
+    const std::size_t n_tables = bp.n_tables();
+
+    auto step = [&](std::uint64_t d, std::uint64_t first, std::uint8_t element) {
+        std::uint64_t t = first;
+        for (std::size_t k = 0; k < n_tables; ++k) {
+            t |= tables[k * 256 + ((d >> (8 * k)) & 0xff)];
+        }
+        return t & masks[element];
+    };
+
+    std::uint64_t d = 0;
+    for (std::size_t i_seg = seg_state.size(); i_seg > 0; --i_seg) {
+        std::size_t begin = (i_seg - 1) * segment_size;
+        std::size_t end = std::min(begin + segment_size, size);
+
+        std::uint64_t carry = d;
+        std::uint64_t local = 0;
+        for (std::size_t pos = end; pos > begin && (carry & ~local) != 0; --pos) {
+            carry = step(carry, 0, text[pos - 1]);
+            local = step(local, bp.first, text[pos - 1]);
+
+            std::uint64_t added = carry & ~local;
+            for (std::size_t i = 0; i < bp.last.size(); ++i) {
+                if (added & bp.last[i]) {
+                    result.push_back(match{static_cast<std::uint32_t>(pos - 1), static_cast<std::uint32_t>(i), 0});
+                }
+            }
+        }
+
+        d = seg_state[i_seg - 1] | (carry & ~local);
+    }
+}
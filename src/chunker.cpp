@@ -0,0 +1,98 @@
+#include <algorithm>
+#include <utility>
+
+#include "chunker.hpp"
+#include "config.hpp"
+
+std::size_t overlap_for(const serial::graph& graph, std::size_t max_chunk_size, bool device_decode) {
+    // patterns without maximum length get a fixed lookahead, longer matches at the border cannot be found (or get a
+    // shorter end with --match-end, see README)
+    std::size_t overlap = graph.max_length;
+    if (overlap == serial::unbounded) {
+        overlap = std::min<std::size_t>(cfg::max_overlap, max_chunk_size / 2);
+    } else if (device_decode) {
+        // up to 4 bytes per codepoint
+        overlap *= 4;
+    }
+    if (overlap + 4 > max_chunk_size) {
+        throw user_error("max-chunk-size is too small for this regex!");
+    }
+    return overlap;
+}
+
+chunker::chunker(runner& r, std::size_t max_chunk_size, std::size_t overlap) : r(r), max_chunk_size(max_chunk_size), overlap(overlap) {
+}
+
+chunker::~chunker() {
+    // only left over if a search failed, its results do not matter anymore
+    while (r.pending() > 0) {
+        try {
+            r.wait();
+        } catch (...) {
+        }
+    }
+}
+
+std::size_t chunker::owned(std::size_t size, bool last) const {
+    std::size_t chunk_size = std::min(size, max_chunk_size);
+    std::size_t result = (last && chunk_size == size) ? chunk_size : chunk_size - overlap;
+    sanity_assert(chunk_size > overlap || result == chunk_size, "chunk is not longer than its lookahead");
+    return result;
+}
+
+std::size_t chunker::submit(const std::string& pending, std::size_t offset, bool last, handler done) {
+    return submit_at(pending, 0, offset, last, std::move(done));
+}
+
+std::size_t chunker::submit(const std::u32string& pending, std::size_t offset, bool last, handler done) {
+    return submit_at(pending, 0, offset, last, std::move(done));
+}
+
+void chunker::run(const std::string& text, handler done) {
+    run_all(text, std::move(done));
+}
+
+void chunker::run(const std::u32string& text, handler done) {
+    run_all(text, std::move(done));
+}
+
+void chunker::drain() {
+    while (!submitted.empty()) {
+        collect();
+    }
+}
+
+void chunker::collect() {
+    auto matches = r.wait();
+    auto s = std::move(submitted.front());
+    submitted.pop_front();
+    s.done(s.offset, s.owned, matches);
+}
+
+template <typename S>
+std::size_t chunker::submit_at(const S& text, std::size_t begin, std::size_t offset, bool last, handler done) {
+    std::size_t size = text.size() - begin;
+    std::size_t chunk_size = std::min(size, max_chunk_size);
+    std::size_t n = owned(size, last);
+    if (begin == 0 && chunk_size == text.size()) {
+        r.enqueue(text);
+    } else {
+        r.enqueue(text.substr(begin, chunk_size));
+    }
+    submitted.push_back(submission{offset, n, std::move(done)});
+
+    // collect results as soon as the pipeline is full
+    while (r.pending() >= r.depth()) {
+        collect();
+    }
+    return n;
+}
+
+template <typename S>
+void chunker::run_all(const S& text, handler done) {
+    // positions instead of erasing the front, so long texts are not copied over and over
+    for (std::size_t pos = 0; pos < text.size();) {
+        pos += submit_at(text, pos, pos, true, done);
+    }
+    drain();
+}
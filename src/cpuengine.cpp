@@ -0,0 +1,311 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <type_traits>
+
+#include "alphabet.hpp"
+#include "bitparallel.hpp"
+#include "cpuengine.hpp"
+#include "prefilter.hpp"
+
+// host-side twin of find_next_list (see automaton.cl), returns the target list [k, id_1..id_k] or nullptr
+const serial::word* find_next_list(const serial::graph& graph, serial::id state, serial::character element) {
+    const serial::word* pNode = graph.data.data() + graph.data[state];
+    const serial::word kind = pNode[0] & serial::node_kind_mask;
+    const std::size_t m = pNode[0] >> serial::node_kind_bits;
+    const serial::word* pBounds = pNode + 1;
+    const serial::word* pLists = pBounds + m;
+
+    serial::word offset;
+    if (kind == serial::node_dense) {
+        // element is a class id
+        offset = (element < m) ? pNode[1 + element] : 0;
+    } else if (m < 2 || element < pBounds[0] || element >= pBounds[m - 1]) {
+        return nullptr;
+    } else if (kind == serial::node_ascii && element < serial::ascii_table_size) {
+        offset = pLists[m - 1 + element];
+    } else if (kind == serial::node_linear) {
+        std::size_t i = 0;
+        while (i + 2 < m && element >= pBounds[i + 1]) {
+            i += 1;
+        }
+        offset = pLists[i];
+    } else {
+        // find last boundary <= element (never the last one, it only marks the end of the previous range)
+        std::size_t lo = 0;
+        std::size_t hi = m - 1;
+        while (hi - lo > 1) {
+            std::size_t mid = lo + (hi - lo) / 2;
+            if (pBounds[mid] <= element) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        offset = pLists[lo];
+    }
+
+    return offset ? graph.data.data() + offset : nullptr;
+}
+
+// simulates all possible paths starting at startpos at once, so unlike the OpenCL kernel there are no stack or iteration limits
+// paths advance in lockstep, so the first accept of a pattern is its earliest end and the last one its longest
+class matcher {
+    public:
+        // map_classes: the graph has a compressed alphabet but the text still holds raw elements
+        matcher(const serial::graph& graph, bool map_classes = false) : graph(graph), map_classes(map_classes), longest(serial::engine_mode(graph.mode) == serial::match_mode::longest), marks(graph.n, 0), stamp(0), matched(graph.n_patterns, 0), found(graph.n_patterns, 0), stamp_start(0) {}
+
+        // appends all patterns that match at startpos to result (sorted), with the end the graph asks for
+        template <typename S>
+        void match_at(const S& text, std::size_t startpos, std::vector<match>& result) {
+            std::size_t result_begin = result.size();
+            std::size_t n_missing = graph.n_patterns;
+            stamp_start += 1;
+            current.assign(1, serial::id_begin);
+
+            for (std::size_t pos = startpos; pos < text.size() && !current.empty(); ++pos) {
+                next.clear();
+                stamp += 1;
+                serial::character element = static_cast<std::make_unsigned_t<typename S::value_type>>(text[pos]);
+                if (map_classes) {
+                    element = graph.classes.class_of(element);
+                }
+
+                for (serial::id state : current) {
+                    const serial::word* pList = find_next_list(graph, state, element);
+                    if (!pList) {
+                        continue;
+                    }
+
+                    for (std::size_t i = 1; i <= pList[0]; ++i) {
+                        serial::id next_state = pList[i];
+                        std::size_t pattern = next_state - graph.accept_base;
+                        if (next_state >= graph.accept_base && pattern < graph.n_patterns) {
+                            if (matched[pattern] != stamp_start) {
+                                matched[pattern] = stamp_start;
+                                found[pattern] = result.size();
+                                result.push_back(match{static_cast<std::uint32_t>(startpos), static_cast<std::uint32_t>(pattern), static_cast<std::uint32_t>(pos + 1)});
+                                n_missing -= 1;
+                            } else if (longest) {
+                                result[found[pattern]].end = static_cast<std::uint32_t>(pos + 1);
+                            }
+                            if (n_missing == 0 && !longest) {
+                                // nothing left to find
+                                std::sort(result.begin() + static_cast<std::ptrdiff_t>(result_begin), result.end());
+                                return;
+                            }
+                        } else if (next_state != serial::id_fail && next_state < graph.n && marks[next_state] != stamp) {
+                            marks[next_state] = stamp;
+                            next.push_back(next_state);
+                        }
+                    }
+                }
+
+                std::swap(current, next);
+            }
+
+            std::sort(result.begin() + static_cast<std::ptrdiff_t>(result_begin), result.end());
+        }
+
+    private:
+        const serial::graph& graph;
+        bool map_classes;
+        bool longest;                     // keep going after the first accept
+        std::vector<serial::id> current;
+        std::vector<serial::id> next;
+        std::vector<std::size_t> marks;
+        std::size_t stamp;
+        std::vector<std::size_t> matched; // patterns that already matched at the current start position
+        std::vector<std::size_t> found;   // index of their match within result
+        std::size_t stamp_start;
+};
+
+template <typename S>
+std::vector<match> match_positions_elements(const serial::graph& graph, const S& text, const std::vector<std::uint32_t>& positions) {
+    matcher m(graph);
+    std::vector<match> result;
+    for (auto startpos : positions) {
+        m.match_at(text, startpos, result);
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+std::vector<match> match_positions(const serial::graph& graph, const std::u32string& text, const std::vector<std::uint32_t>& positions) {
+    return match_positions_elements(graph, text, positions);
+}
+
+std::vector<match> match_positions(const serial::graph& graph, const std::string& text, const std::vector<std::uint32_t>& positions) {
+    return match_positions_elements(graph, text, positions);
+}
+
+cpuengine::cpuengine(std::size_t n_threads) : pool(n_threads) {}
+
+cpurunner::cpurunner(const std::shared_ptr<cpuengine>& eng, std::uint32_t max_chunk_size, const serial::graph& graph, bool printProfile) : eng(eng), max_chunk_size(max_chunk_size), graph(graph), printProfile(printProfile) {}
+
+std::vector<match> cpurunner::run(const std::u32string& chunk) {
+    sanity_assert(graph.enc == serial::encoding::utf32, "graph was not compiled for UTF32 input");
+    return run_elements(chunk);
+}
+
+std::vector<match> cpurunner::run(const std::string& chunk) {
+    sanity_assert(graph.enc == serial::encoding::utf8, "graph was not compiled for UTF8 input");
+    return run_elements(chunk);
+}
+
+template <typename S>
+std::vector<match> cpurunner::run_elements(const S& chunk) {
+    sanity_assert(chunk.size() > 0, "chunk must contain content");
+    sanity_assert(chunk.size() <= max_chunk_size, "chunk is too big for this config");
+
+    auto t_start = std::chrono::steady_clock::now();
+
+    // only check positions that the prefilter did not rule out
+    std::vector<std::uint32_t> candidates;
+    bool use_starts = find_candidates(graph, chunk, candidates);
+    std::size_t n_slots = use_starts ? candidates.size() : chunk.size();
+
+    // small patterns scan the whole chunk once instead of checking every start position on its own
+    if (graph.bp.n_positions > 0 && !use_starts) {
+        return run_bitparallel(chunk);
+    }
+
+    auto t_prefilter = std::chrono::steady_clock::now();
+
+    // with a compressed alphabet every element is looked up once instead of once per start position that reaches it,
+    // prefiltered chunks only visit a few positions, so they get mapped on the fly
+    bool compressed = graph.classes.n_classes > 0 && !use_starts;
+    bool map_on_the_fly = graph.classes.n_classes > 0 && use_starts;
+    std::string classes;
+    if (compressed && n_slots > 0) {
+        classes.resize(chunk.size());
+        std::size_t n_map_blocks = (chunk.size() + eng->block_size - 1) / eng->block_size;
+        eng->pool.parallel_for(n_map_blocks, [&](std::size_t i_block) {
+            std::size_t begin = i_block * eng->block_size;
+            std::size_t end = std::min<std::size_t>(begin + eng->block_size, chunk.size());
+            map_to_classes(graph.classes, chunk.data() + begin, end - begin, reinterpret_cast<std::uint8_t*>(&classes[begin]));
+        });
+    }
+
+    auto t_map = std::chrono::steady_clock::now();
+
+    // every block collects its own results, so we can concat them in order afterwards
+    std::size_t n_blocks = n_slots / eng->block_size;
+    if (n_slots % eng->block_size != 0) {
+        n_blocks += 1;
+    }
+    std::vector<std::vector<match>> block_results(n_blocks);
+
+    eng->pool.parallel_for(n_blocks, [&](std::size_t i_block) {
+        matcher m(graph, map_on_the_fly);
+        std::size_t begin = i_block * eng->block_size;
+        std::size_t end = std::min(begin + eng->block_size, n_slots);
+        auto& result = block_results[i_block];
+        for (std::size_t slot = begin; slot < end; ++slot) {
+            std::size_t startpos = use_starts ? candidates[slot] : slot;
+            if (compressed) {
+                m.match_at(classes, startpos, result);
+            } else {
+                m.match_at(chunk, startpos, result);
+            }
+        }
+    });
+
+    std::vector<match> output;
+    for (const auto& r : block_results) {
+        output.insert(output.end(), r.begin(), r.end());
+    }
+
+    auto t_end = std::chrono::steady_clock::now();
+
+    float t_prefilter_ms = std::chrono::duration<float, std::milli>(t_prefilter - t_start).count();
+    float t_map_ms = std::chrono::duration<float, std::milli>(t_map - t_prefilter).count();
+    float t_match_ms = std::chrono::duration<float, std::milli>(t_end - t_map).count();
+    chunk_profile prof;
+    prof.elements = chunk.size();
+    prof.candidates = n_slots;
+    prof.matches = output.size();
+    if (use_starts) {
+        prof.add_stage(profile_stage::prefilter, t_prefilter_ms);
+    }
+    if (compressed) {
+        prof.add_stage(profile_stage::map_classes, t_map_ms);
+    }
+    prof.add_stage(profile_stage::match_text, t_match_ms);
+    record(prof);
+
+    if (printProfile) {
+        std::cout << "Profiling data:" << std::endl;
+        if (use_starts) {
+            std::cout
+                << "  prefilter          = " << t_prefilter_ms << "ms" << std::endl
+                << "  candidates         = " << n_slots << std::endl;
+        }
+        if (compressed) {
+            std::cout
+                << "  mapClasses         = " << t_map_ms << "ms" << std::endl;
+        }
+        std::cout
+            << "  matchText          = " << t_match_ms << "ms" << std::endl;
+    }
+
+    return output;
+}
+
+template <typename S>
+std::vector<match> cpurunner::run_bitparallel(const S& chunk) {
+    auto t_start = std::chrono::steady_clock::now();
+
+    // every block gets mapped and scanned on its own, paths that cross block borders are followed up afterwards
+    std::size_t n_blocks = (chunk.size() + eng->block_size - 1) / eng->block_size;
+    std::vector<std::uint8_t> classes(chunk.size());
+    std::vector<std::uint64_t> block_state(n_blocks, 0);
+    std::vector<std::vector<match>> block_results(n_blocks);
+    eng->pool.parallel_for(n_blocks, [&](std::size_t i_block) {
+        std::size_t begin = i_block * eng->block_size;
+        std::size_t end = std::min<std::size_t>(begin + eng->block_size, chunk.size());
+        map_to_classes(graph.bp.classes, chunk.data() + begin, end - begin, classes.data() + begin);
+        block_state[i_block] = bp_scan(graph.bp, classes.data(), begin, end, 0, true, block_results[i_block]);
+
+        // blocks report backwards
+        std::sort(block_results[i_block].begin(), block_results[i_block].end());
+    });
+
+    auto t_scan = std::chrono::steady_clock::now();
+
+    std::vector<match> output;
+    for (const auto& r : block_results) {
+        output.insert(output.end(), r.begin(), r.end());
+    }
+
+    // blocks do not overlap, so only the (few) matches of the fixup have to be merged in, they might be known already
+    std::vector<match> fixed;
+    bp_fixup(graph.bp, classes.data(), chunk.size(), eng->block_size, block_state, fixed);
+    if (!fixed.empty()) {
+        std::sort(fixed.begin(), fixed.end());
+        std::size_t mid = output.size();
+        output.insert(output.end(), fixed.begin(), fixed.end());
+        std::inplace_merge(output.begin(), output.begin() + static_cast<std::ptrdiff_t>(mid), output.end());
+        output.erase(std::unique(output.begin(), output.end()), output.end());
+    }
+
+    auto t_end = std::chrono::steady_clock::now();
+
+    float t_scan_ms = std::chrono::duration<float, std::milli>(t_scan - t_start).count();
+    float t_fixup_ms = std::chrono::duration<float, std::milli>(t_end - t_scan).count();
+    chunk_profile prof;
+    prof.elements = chunk.size();
+    prof.candidates = chunk.size();
+    prof.matches = output.size();
+    prof.add_stage(profile_stage::match_bitparallel, t_scan_ms);
+    prof.add_stage(profile_stage::fixup_host, t_fixup_ms);
+    record(prof);
+
+    if (printProfile) {
+        std::cout << "Profiling data:" << std::endl
+            << "  matchBitparallel   = " << t_scan_ms << "ms" << std::endl
+            << "  fixupHost          = " << t_fixup_ms << "ms" << std::endl;
+    }
+
+    return output;
+}
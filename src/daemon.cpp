@@ -0,0 +1,298 @@
+#include <cerrno>
+#include <cstring>
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "daemon.hpp"
+
+namespace {
+
+// limits of a single request, so a broken client cannot exhaust the memory with a line that never ends (or a huge payload)
+constexpr std::size_t max_line_size = 1024 * 1024;
+constexpr std::size_t max_payload_size = 256 * 1024 * 1024; // text of a search, all regexes of a compile (with their overhead)
+constexpr std::size_t max_patterns = 1024 * 1024;           // regexes of a compile
+
+// buffered reading and writing of a connected socket, all methods return false once the peer is gone
+class peer {
+    public:
+        explicit peer(int fd) : fd(fd), pos(0) {}
+
+        bool read_line(std::string& line) {
+            while (true) {
+                auto nl = buffer.find('\n', pos);
+                if (nl != std::string::npos) {
+                    line.assign(buffer, pos, nl - pos);
+                    pos = nl + 1;
+                    return true;
+                }
+                if (buffer.size() - pos > max_line_size || !fill()) {
+                    return false;
+                }
+            }
+        }
+
+        bool read_bytes(std::size_t n, std::string& data) {
+            data.assign(buffer, pos, std::min(n, buffer.size() - pos));
+            pos += data.size();
+            while (data.size() < n) {
+                char tmp[64 * 1024];
+                ssize_t got = ::read(fd, tmp, std::min(sizeof(tmp), n - data.size()));
+                if (got < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (got <= 0) {
+                    return false;
+                }
+                data.append(tmp, static_cast<std::size_t>(got));
+            }
+            return true;
+        }
+
+        bool write(const std::string& data) {
+            std::size_t done = 0;
+            while (done < data.size()) {
+                // no SIGPIPE if the client is gone already
+                ssize_t sent = ::send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+                if (sent < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (sent <= 0) {
+                    return false;
+                }
+                done += static_cast<std::size_t>(sent);
+            }
+            return true;
+        }
+
+    private:
+        int fd;
+        std::string buffer;
+        std::size_t pos; // first unread byte of buffer
+
+        bool fill() {
+            buffer.erase(0, pos);
+            pos = 0;
+            char tmp[64 * 1024];
+            while (true) {
+                ssize_t got = ::read(fd, tmp, sizeof(tmp));
+                if (got < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (got <= 0) {
+                    return false;
+                }
+                buffer.append(tmp, static_cast<std::size_t>(got));
+                return true;
+            }
+        }
+};
+
+std::size_t parse_number(const std::string& word) {
+    if (word.empty() || word.find_first_not_of("0123456789") != std::string::npos || word.size() > 18) {
+        throw user_error("expected a number, got \"" + word + "\"");
+    }
+    return std::stoull(word);
+}
+
+graph_options parse_graph_options(const std::vector<std::string>& words) {
+    graph_options gopts;
+    for (const auto& w : words) {
+        if (w == "utf8") {
+            gopts.encoding = serial::encoding::utf8;
+        } else if (w == "no-dfa") {
+            gopts.determinize = false;
+        } else if (w == "no-prefilter") {
+            gopts.prefilter = false;
+        } else if (w == "no-alphabet") {
+            gopts.alphabet = false;
+        } else if (w == "no-bitparallel") {
+            gopts.bitparallel = false;
+        } else if (w == "match-end=earliest") {
+            gopts.mode = serial::match_mode::earliest;
+        } else if (w == "match-end=longest") {
+            gopts.mode = serial::match_mode::longest;
+        } else if (w == "match-end=non-overlapping") {
+            gopts.mode = serial::match_mode::non_overlapping;
+        } else {
+            throw user_error("unknown compile option \"" + w + "\"");
+        }
+    }
+    return gopts;
+}
+
+// answers requests until the client disconnects or breaks the protocol
+void handle_client(searcher& s, int fd) {
+    peer p(fd);
+    std::string line;
+    while (p.read_line(line)) {
+        std::istringstream in(line);
+        std::vector<std::string> words;
+        for (std::string w; in >> w;) {
+            words.push_back(w);
+        }
+        if (words.empty()) {
+            continue;
+        }
+
+        std::string reply;
+        try {
+            const auto& cmd = words[0];
+            if (cmd == "compile" && words.size() >= 2) {
+                // payload is read before anything can fail, so the stream stays in sync
+                std::size_t n = parse_number(words[1]);
+                if (n > max_patterns) {
+                    p.write("error pattern set exceeds " + std::to_string(max_patterns) + " regexes\n");
+                    return;
+                }
+                std::vector<std::string> regexes;
+                std::size_t size = 0;
+                for (std::string r; regexes.size() < n; regexes.push_back(r)) {
+                    if (!p.read_line(r)) {
+                        return;
+                    }
+                    size += r.size() + sizeof(std::string);
+                    if (size > max_payload_size) {
+                        p.write("error pattern set exceeds " + std::to_string(max_payload_size) + " bytes\n");
+                        return;
+                    }
+                }
+                auto gopts = parse_graph_options(std::vector<std::string>(words.begin() + 2, words.end()));
+                reply = "ok " + std::to_string(s.compile(regexes, gopts)) + "\n";
+            } else if (cmd == "search" && words.size() == 3) {
+                std::size_t h = parse_number(words[1]);
+                std::size_t size = parse_number(words[2]);
+                if (size > max_payload_size) {
+                    // the payload cannot be skipped without reading it, so the connection ends here
+                    p.write("error text exceeds " + std::to_string(max_payload_size) + " bytes\n");
+                    return;
+                }
+                std::string data;
+                if (!p.read_bytes(size, data)) {
+                    return;
+                }
+                auto matches = s.submit(h, std::move(data)).get();
+                reply = "ok " + std::to_string(matches.size()) + "\n";
+                for (const auto& m : matches) {
+                    reply += std::to_string(m.offset);
+                    reply += ' ';
+                    reply += std::to_string(m.end);
+                    reply += ' ';
+                    reply += std::to_string(m.pattern);
+                    reply += '\n';
+                }
+            } else if (cmd == "release" && words.size() == 2) {
+                s.release(parse_number(words[1]));
+                reply = "ok\n";
+            } else {
+                reply = "error unknown request \"" + line + "\"\n";
+            }
+        } catch (std::exception& e) {
+            // errors never end the connection, messages are kept on a single line
+            std::string msg = e.what();
+            std::replace(msg.begin(), msg.end(), '\n', ' ');
+            reply = "error " + msg + "\n";
+        }
+        if (!p.write(reply)) {
+            return;
+        }
+    }
+}
+
+// open client connections, their threads use the searcher, so it has to outlive all of them
+class connections {
+    public:
+        connections() = default;
+        connections(const connections&) = delete;
+        connections& operator=(const connections&) = delete;
+
+        // unblocks the reads of all clients and waits until their threads are done
+        ~connections() {
+            std::unique_lock<std::mutex> lock(m);
+            for (int fd : fds) {
+                ::shutdown(fd, SHUT_RDWR);
+            }
+            cv_done.wait(lock, [this]() {
+                return fds.empty();
+            });
+        }
+
+        void start(searcher& s, int fd) {
+            std::lock_guard<std::mutex> lock(m);
+            std::thread([this, &s, fd]() {
+                handle_client(s, fd);
+                std::lock_guard<std::mutex> lock(m);
+                ::close(fd);
+                fds.erase(fd);
+                cv_done.notify_all();
+            }).detach();
+            fds.insert(fd);
+        }
+
+    private:
+        std::mutex m;
+        std::condition_variable cv_done;
+        std::set<int> fds;
+};
+
+} // namespace
+
+void serve(searcher& s, const std::string& path) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        throw user_error("invalid socket path \"" + path + "\"!");
+    }
+    std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        throw user_error(std::string("cannot create socket: ") + std::strerror(errno));
+    }
+
+    // the socket of an earlier run is replaced, anything else at that path is kept
+    struct stat st;
+    if (::lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        ::unlink(path.c_str());
+    }
+    if (::bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(fd, SOMAXCONN) != 0) {
+        std::string error = std::strerror(errno);
+        ::close(fd);
+        throw user_error("cannot listen on \"" + path + "\": " + error);
+    }
+
+    connections clients;
+    while (true) {
+        int client = ::accept(fd, nullptr, nullptr);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            std::string error = std::strerror(errno);
+            ::close(fd);
+            throw user_error("cannot accept connections: " + error);
+        }
+
+        try {
+            clients.start(s, client);
+        } catch (...) {
+            ::close(client);
+            ::close(fd);
+            throw;
+        }
+    }
+}
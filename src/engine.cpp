@@ -1,22 +1,40 @@
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 
+#include <algorithm>
+#include <chrono>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <numeric>
 #include <sstream>
+#include <string>
 #include <vector>
 #include <utility>
 
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "alphabet.hpp"
+#include "bitparallel.hpp"
 #include "common.hpp"
+#include "cpuengine.hpp"
 #include "engine.hpp"
+#include "prefilter.hpp"
 
 // resource data
 // http://www.burtonini.com/blog/computers/ld-blobs-2007-07-13-15-50
 extern char _binary_automaton_cl_start[];
 extern char _binary_automaton_cl_end[];
+extern char _binary_bitparallel_cl_start[];
+extern char _binary_bitparallel_cl_end[];
 extern char _binary_collector_cl_start[];
 extern char _binary_collector_cl_end[];
+extern char _binary_decoder_cl_start[];
+extern char _binary_decoder_cl_end[];
 
 
 static_assert(sizeof(std::uint32_t) == sizeof(cl_uint), "OpenCL uint has to be 32bit");
@@ -24,7 +42,115 @@ static_assert(sizeof(char32_t) == sizeof(std::uint32_t), "uint32 and char32_t ha
 static_assert(sizeof(char) == sizeof(cl_char), "OpenCL char has not the same size as host char");
 
 
-cl::Program buildProgramFromPtr(const char* begin, const char* end, const cl::Context& context, const std::vector<cl::Device>& devices, const std::map<std::string, std::string>& defines) {
+// directory of the program binary cache, empty if there is no suitable location
+std::string programCacheDir() {
+    const char* xdg = std::getenv("XDG_CACHE_HOME");
+    const char* home = std::getenv("HOME");
+    if (xdg && *xdg) {
+        return std::string(xdg) + "/oclgrep";
+    } else if (home && *home) {
+        return std::string(home) + "/.cache/oclgrep";
+    } else {
+        return "";
+    }
+}
+
+// FNV-1a, only used to get short file names, the full key is stored within the file
+std::uint64_t hashString(const std::string& data) {
+    std::uint64_t h = 0xcbf29ce484222325ull;
+    for (char c : data) {
+        h ^= static_cast<unsigned char>(c);
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+// everything that influences the program binary
+std::string programCacheKey(const std::string& sourceCode, const std::string& buildOptions, const std::vector<cl::Device>& devices) {
+    std::stringstream ss;
+    ss << "oclgrep program cache v1" << std::endl;
+    for (const auto& dev : devices) {
+        ss << "device=" << dev.getInfo<CL_DEVICE_NAME>() << "|" << dev.getInfo<CL_DEVICE_VENDOR>() << "|" << dev.getInfo<CL_DEVICE_VERSION>() << "|" << dev.getInfo<CL_DRIVER_VERSION>() << std::endl;
+    }
+    ss << "options=" << buildOptions << std::endl;
+    ss << "source=" << std::hex << hashString(sourceCode) << std::dec << "/" << sourceCode.size() << std::endl;
+    return ss.str();
+}
+
+template <typename T>
+bool readValue(std::istream& in, T& x) {
+    return static_cast<bool>(in.read(reinterpret_cast<char*>(&x), sizeof(T)));
+}
+
+template <typename T>
+void writeValue(std::ostream& out, const T& x) {
+    out.write(reinterpret_cast<const char*>(&x), sizeof(T));
+}
+
+// file layout: key size, key, number of binaries, (binary size, binary) * n
+bool loadProgramBinaries(const std::string& fname, const std::string& key, cl::Program::Binaries& binaries) {
+    std::ifstream in(fname, std::ios::binary);
+    std::uint64_t keySize;
+    if (!in || !readValue(in, keySize) || keySize != key.size()) {
+        return false;
+    }
+    std::string keyStored(keySize, '\0');
+    if (!in.read(&keyStored[0], static_cast<std::streamsize>(keySize)) || keyStored != key) {
+        return false;
+    }
+
+    std::uint64_t n;
+    if (!readValue(in, n)) {
+        return false;
+    }
+    binaries.clear();
+    for (std::uint64_t i = 0; i < n; ++i) {
+        std::uint64_t size;
+        if (!readValue(in, size) || size == 0 || size > (1ull << 30)) {
+            return false;
+        }
+        std::vector<unsigned char> binary(size);
+        if (!in.read(reinterpret_cast<char*>(binary.data()), static_cast<std::streamsize>(size))) {
+            return false;
+        }
+        binaries.push_back(std::move(binary));
+    }
+    return true;
+}
+
+// best effort, a failing write only means that the next start builds the program again
+void storeProgramBinaries(const std::string& dir, const std::string& fname, const std::string& key, const cl::Program::Binaries& binaries) {
+    // create directory (including ~/.cache), errors show up when opening the file
+    for (std::size_t pos = dir.find('/', 1); ; pos = dir.find('/', pos + 1)) {
+        mkdir(dir.substr(0, pos).c_str(), 0755);
+        if (pos == std::string::npos) {
+            break;
+        }
+    }
+
+    // write to a private file first and rename it afterwards, so concurrent runs never see half-written files
+    std::string fnameTmp = fname + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream out(fnameTmp, std::ios::binary | std::ios::trunc);
+        writeValue(out, static_cast<std::uint64_t>(key.size()));
+        out.write(key.data(), static_cast<std::streamsize>(key.size()));
+        writeValue(out, static_cast<std::uint64_t>(binaries.size()));
+        for (const auto& binary : binaries) {
+            writeValue(out, static_cast<std::uint64_t>(binary.size()));
+            out.write(reinterpret_cast<const char*>(binary.data()), static_cast<std::streamsize>(binary.size()));
+        }
+        if (!out) {
+            out.close();
+            unlink(fnameTmp.c_str());
+            return;
+        }
+    }
+    if (rename(fnameTmp.c_str(), fname.c_str()) != 0) {
+        unlink(fnameTmp.c_str());
+    }
+}
+
+cl::Program buildProgramFromPtr(const char* begin, const char* end, const cl::Context& context, const std::vector<cl::Device>& devices, const std::map<std::string, std::string>& defines, bool useCache) {
     // dump data to string
     std::string sourceCode(begin, end);
 
@@ -36,6 +162,28 @@ cl::Program buildProgramFromPtr(const char* begin, const char* end, const cl::Co
     }
     auto buildOptions = buildOptionsSS.str();
 
+    // try cached binaries first, everything that goes wrong here just leads to a normal build
+    std::string cacheDir = useCache ? programCacheDir() : "";
+    std::string cacheKey;
+    std::string cacheFile;
+    if (!cacheDir.empty()) {
+        cacheKey = programCacheKey(sourceCode, buildOptions, devices);
+        std::stringstream ss;
+        ss << cacheDir << "/" << std::hex << hashString(cacheKey) << ".bin";
+        cacheFile = ss.str();
+
+        cl::Program::Binaries binaries;
+        if (loadProgramBinaries(cacheFile, cacheKey, binaries) && binaries.size() == devices.size()) {
+            try {
+                cl::Program program(context, devices, binaries);
+                program.build(devices, buildOptions.c_str());
+                return program;
+            } catch (const cl::Error& /*e*/) {
+                // outdated or broken, gets replaced below
+            }
+        }
+    }
+
     // create and build program
     cl::Program program(context, sourceCode);
     try {
@@ -53,6 +201,17 @@ cl::Program buildProgramFromPtr(const char* begin, const char* end, const cl::Co
         throw internal_exception(ss.str());
     }
 
+    if (!cacheFile.empty()) {
+        auto binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+        bool complete = binaries.size() == devices.size();
+        for (const auto& binary : binaries) {
+            complete = complete && !binary.empty();
+        }
+        if (complete) {
+            storeProgramBinaries(cacheDir, cacheFile, cacheKey, binaries);
+        }
+    }
+
     // everything went fine, return final program
     return program;
 }
@@ -71,21 +230,62 @@ constexpr std::size_t adjust_globalsize(std::size_t globalsize, std::size_t loca
     return globalsize;
 }
 
-oclengine::oclengine() {
+// number of compaction tiles (see collector.cl) for the given number of elements
+constexpr std::size_t n_tiles(std::size_t size) {
+    return (size + oclengine::group_size * oclengine::compact_items - 1) / (oclengine::group_size * oclengine::compact_items);
+}
+
+std::vector<std::pair<std::size_t, std::size_t>> oclengine::available_devices() {
+    std::vector<std::pair<std::size_t, std::size_t>> result;
+    std::vector<cl::Platform> pool_platforms;
+    cl::Platform::get(&pool_platforms);
+    for (std::size_t i_platform = 0; i_platform < pool_platforms.size(); ++i_platform) {
+        std::vector<cl::Device> pool_devices;
+        pool_platforms[i_platform].getDevices(CL_DEVICE_TYPE_ALL, &pool_devices);
+        for (std::size_t i_device = 0; i_device < pool_devices.size(); ++i_device) {
+            result.push_back(std::make_pair(i_platform, i_device));
+        }
+    }
+    return result;
+}
+
+void oclengine::print_devices(std::ostream& out) {
+    std::vector<cl::Platform> pool_platforms;
+    cl::Platform::get(&pool_platforms);
+    for (std::size_t i_platform = 0; i_platform < pool_platforms.size(); ++i_platform) {
+        const auto& platform = pool_platforms[i_platform];
+        out << "platform " << i_platform << ": " << platform.getInfo<CL_PLATFORM_NAME>() << " (" << platform.getInfo<CL_PLATFORM_VERSION>() << ")" << std::endl;
+
+        std::vector<cl::Device> pool_devices;
+        platform.getDevices(CL_DEVICE_TYPE_ALL, &pool_devices);
+        for (std::size_t i_device = 0; i_device < pool_devices.size(); ++i_device) {
+            const auto& dev = pool_devices[i_device];
+            out << "  device " << i_device << ": " << dev.getInfo<CL_DEVICE_NAME>() << " (" << dev.getInfo<CL_DEVICE_VERSION>() << ", driver " << dev.getInfo<CL_DRIVER_VERSION>() << ")" << std::endl;
+        }
+    }
+}
+
+oclengine::oclengine(std::size_t platform_idx, std::size_t device_idx, bool use_program_cache) {
     // set up OpenCL
     std::vector<cl::Platform> pool_platforms;
     cl::Platform::get(&pool_platforms);
     if (pool_platforms.empty()) {
         throw user_error("no OpenCL platforms found!");
     }
-    platform = pool_platforms[0]; // XXX: make this selectable!
+    if (platform_idx >= pool_platforms.size()) {
+        throw user_error("OpenCL platform " + std::to_string(platform_idx) + " does not exist (see --list-devices)!");
+    }
+    platform = pool_platforms[platform_idx];
 
     std::vector<cl::Device> pool_devices;
     platform.getDevices(CL_DEVICE_TYPE_ALL, &pool_devices);
     if (pool_devices.empty()) {
         throw user_error("no OpenCL devices found!");
     }
-    devices = {pool_devices[0]}; // XXX: make this a user choice!
+    if (device_idx >= pool_devices.size()) {
+        throw user_error("OpenCL device " + std::to_string(device_idx) + " does not exist on platform " + std::to_string(platform_idx) + " (see --list-devices)!");
+    }
+    devices = {pool_devices[device_idx]};
     for (const auto& dev : devices) {
         if (!dev.getInfo<CL_DEVICE_ENDIAN_LITTLE>()) {
             throw user_error("not all selected devices are little endian!");
@@ -97,35 +297,74 @@ oclengine::oclengine() {
 
     // build kernel
     std::map<std::string, std::string> buildDefines{
+        {"ASCII_TABLE_SIZE", std::to_string(serial::ascii_table_size)},
         {"CACHE_MASK",      std::to_string(cache_mask)},
+        {"COMPACT_ITEMS",   std::to_string(compact_items)},
         {"FLAG_ITER_MAX",   std::to_string(flag_iter_max)},
+        {"FLAG_MATCHES_FULL", std::to_string(flag_matches_full)},
         {"FLAG_STACK_FULL", std::to_string(flag_stack_full)},
         {"GROUP_SIZE",      std::to_string(group_size)},
         {"ID_BEGIN",        std::to_string(serial::id_begin)},
         {"ID_FAIL",         std::to_string(serial::id_fail)},
-        {"ID_OK",           std::to_string(serial::id_ok)},
         {"MAX_ITER_COUNT",  std::to_string(max_iter_count)},
         {"MAX_STACK_SIZE",  std::to_string(max_stack_size)},
+        {"MODE_EARLIEST",   std::to_string(static_cast<std::uint32_t>(serial::match_mode::earliest))},
+        {"MODE_LONGEST",    std::to_string(static_cast<std::uint32_t>(serial::match_mode::longest))},
+        {"MODE_STARTS",     std::to_string(static_cast<std::uint32_t>(serial::match_mode::starts))},
+        {"NODE_ASCII",      std::to_string(serial::node_ascii)},
+        {"NODE_DENSE",      std::to_string(serial::node_dense)},
+        {"NODE_KIND_BITS",  std::to_string(serial::node_kind_bits)},
+        {"NODE_KIND_MASK",  std::to_string(serial::node_kind_mask)},
+        {"NODE_LINEAR",     std::to_string(serial::node_linear)},
         {"OVERSIZE_CACHE",  std::to_string(oversize_cache)},
         {"RESULT_FAIL",     std::to_string(result_fail)},
         {"SYNC_COUNT",      std::to_string(sync_count)},
         {"USE_CACHE",       std::to_string(use_cache)},
     };
 
-    programAutomaton = buildProgramFromPtr(_binary_automaton_cl_start, _binary_automaton_cl_end, context, devices, buildDefines);
-    programCollector = buildProgramFromPtr(_binary_collector_cl_start, _binary_collector_cl_end, context, devices, buildDefines);
+    programAutomaton = buildProgramFromPtr(_binary_automaton_cl_start, _binary_automaton_cl_end, context, devices, buildDefines, use_program_cache);
+    programBitparallel = buildProgramFromPtr(_binary_bitparallel_cl_start, _binary_bitparallel_cl_end, context, devices, buildDefines, use_program_cache);
+    programCollector = buildProgramFromPtr(_binary_collector_cl_start, _binary_collector_cl_end, context, devices, buildDefines, use_program_cache);
+    programDecoder = buildProgramFromPtr(_binary_decoder_cl_start, _binary_decoder_cl_end, context, devices, buildDefines, use_program_cache);
     kernelAutomaton = cl::Kernel(programAutomaton, "automaton");
-    kernelTransform = cl::Kernel(programCollector, "transform");
-    kernelScan = cl::Kernel(programCollector, "scan");
-    kernelMove = cl::Kernel(programCollector, "move");
+    kernelBitparallel = cl::Kernel(programBitparallel, "bitparallel");
+    kernelCount = cl::Kernel(programCollector, "count");
+    kernelScanTiles = cl::Kernel(programCollector, "scan_tiles");
+    kernelCompact = cl::Kernel(programCollector, "compact");
+    kernelDecodeCount = cl::Kernel(programDecoder, "decode_count");
+    kernelDecodeWrite = cl::Kernel(programDecoder, "decode_write");
+    kernelToBytes = cl::Kernel(programDecoder, "to_bytes");
 }
 
-oclrunner::oclrunner(const std::shared_ptr<oclengine>& eng, std::uint32_t max_chunk_size, const serial::graph& graph, bool printProfile) : eng(eng), max_chunk_size(max_chunk_size), graph(graph), printProfile(printProfile) {
+oclrunner::oclrunner(const std::shared_ptr<oclengine>& eng, std::uint32_t max_chunk_size, const serial::graph& graph, bool printProfile, std::size_t pipeline_depth) : eng(eng), max_chunk_size(max_chunk_size), graph(graph), printProfile(printProfile), max_matches(1), match_words(graph.mode == serial::match_mode::starts ? 2 : 3), zero_copy(true), slots(pipeline_depth), next_slot(0) {
     // basic checks
+    sanity_assert(pipeline_depth > 0, "at least one buffer set is required");
     for (const auto& dev : eng->devices) {
-        if (dev.getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>() < graph.size()) {
+        if (dev.getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>() < graph.size() * sizeof(serial::word)) {
             throw user_error("compiled automaton is too large for the OpenCL device!");
         }
+        zero_copy = zero_copy && (dev.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU || dev.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>());
+    }
+
+    // bit-parallel program as one constant buffer, see bitparallel.cl
+    std::vector<std::uint64_t> hBitparallel;
+    if (graph.bp.n_positions > 0) {
+        hBitparallel.insert(hBitparallel.end(), graph.bp.tables.begin(), graph.bp.tables.end());
+        hBitparallel.insert(hBitparallel.end(), graph.bp.masks.begin(), graph.bp.masks.end());
+        hBitparallel.insert(hBitparallel.end(), graph.bp.last.begin(), graph.bp.last.end());
+        for (const auto& dev : eng->devices) {
+            if (dev.getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>() < hBitparallel.size() * sizeof(cl_ulong)) {
+                // the automaton still works
+                hBitparallel.clear();
+                this->graph.bp = serial::bitparallel();
+            }
+        }
+    }
+
+    // pattern sets report (startpos, pattern[, end]) entries, one per start position on average, chunks with more matches
+    // get redone on the host (see complete)
+    if (graph.n_patterns > 1) {
+        max_matches = max_chunk_size;
     }
 
     // OpenCL events
@@ -140,164 +379,683 @@ oclrunner::oclrunner(const std::shared_ptr<oclengine>& eng, std::uint32_t max_ch
         nullptr
     );
 
-    dText = cl::Buffer(
-        eng->context,
-        CL_MEM_READ_ONLY,
-        max_chunk_size * sizeof(char32_t),
-        nullptr
-    );
+    for (auto& s : slots) {
+        s.queue = cl::CommandQueue(eng->context, eng->devices[0], cl::QueueProperties::Profiling);
 
-    dOutput = cl::Buffer(
-        eng->context,
-        CL_MEM_READ_WRITE,
-        max_chunk_size * sizeof(cl_uint),
-        nullptr
-    );
+        // chunks are written straight into pinned memory, devices that share the host memory read it from there
+        s.pText = cl::Buffer(
+            eng->context,
+            CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
+            max_chunk_size * sizeof(char32_t),
+            nullptr
+        );
 
-    dFlags = cl::Buffer(
-        eng->context,
-        CL_MEM_READ_WRITE,
-        eng->flags_n * sizeof(char),
-        nullptr
-    );
+        if (!zero_copy) {
+            s.dText = cl::Buffer(
+                eng->context,
+                CL_MEM_READ_WRITE,
+                max_chunk_size * sizeof(char32_t),
+                nullptr
+            );
+        }
 
-    dScanbuffer0 = cl::Buffer(
-        eng->context,
-        CL_MEM_READ_WRITE,
-        max_chunk_size * sizeof(cl_uint),
-        nullptr
-    );
+        s.dOutput = cl::Buffer(
+            eng->context,
+            CL_MEM_READ_WRITE,
+            max_chunk_size * sizeof(cl_uint),
+            nullptr
+        );
 
-    dScanbuffer1 = cl::Buffer(
-        eng->context,
-        CL_MEM_READ_WRITE,
-        max_chunk_size * sizeof(cl_uint),
-        nullptr
-    );
+        s.dFlags = cl::Buffer(
+            eng->context,
+            CL_MEM_READ_WRITE,
+            eng->flags_n * sizeof(char),
+            nullptr
+        );
+
+        // results are mapped for the download
+        s.dCompacted = cl::Buffer(
+            eng->context,
+            CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+            max_chunk_size * sizeof(cl_uint),
+            nullptr
+        );
+
+        if (graph.mode != serial::match_mode::starts) {
+            s.dEnds = cl::Buffer(
+                eng->context,
+                CL_MEM_READ_WRITE,
+                max_chunk_size * sizeof(cl_uint),
+                nullptr
+            );
+
+            s.dCompactedEnds = cl::Buffer(
+                eng->context,
+                CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                max_chunk_size * sizeof(cl_uint),
+                nullptr
+            );
+        }
+
+        s.dTileCounts = cl::Buffer(
+            eng->context,
+            CL_MEM_READ_WRITE,
+            (n_tiles(max_chunk_size) + 1) * sizeof(cl_uint),
+            nullptr
+        );
+
+        s.dStarts = cl::Buffer(
+            eng->context,
+            CL_MEM_READ_ONLY,
+            max_chunk_size * sizeof(cl_uint),
+            nullptr
+        );
+
+        s.dMatches = cl::Buffer(
+            eng->context,
+            CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+            match_words * max_matches * sizeof(cl_uint),
+            nullptr
+        );
+
+        s.dMatchesN = cl::Buffer(
+            eng->context,
+            CL_MEM_READ_WRITE,
+            1 * sizeof(cl_uint),
+            nullptr
+        );
+
+        s.dUnfinished = cl::Buffer(
+            eng->context,
+            CL_MEM_READ_WRITE,
+            max_chunk_size * sizeof(cl_uint),
+            nullptr
+        );
+
+        s.dUnfinishedN = cl::Buffer(
+            eng->context,
+            CL_MEM_READ_WRITE,
+            1 * sizeof(cl_uint),
+            nullptr
+        );
+
+        if (!hBitparallel.empty()) {
+            s.dSegState = cl::Buffer(
+                eng->context,
+                CL_MEM_READ_WRITE,
+                (max_chunk_size / eng->bp_segment_size + 1) * sizeof(cl_ulong),
+                nullptr
+            );
+        }
+    }
 
     // upload some data
     eng->queue.enqueueWriteBuffer(dAutomatonData, false, 0, graph.size()  * sizeof(std::uint32_t), graph.data.data(), nullptr, &evtUploadAutomaton);
+    if (!hBitparallel.empty()) {
+        dBitparallel = cl::Buffer(
+            eng->context,
+            CL_MEM_READ_ONLY,
+            hBitparallel.size() * sizeof(cl_ulong),
+            nullptr
+        );
+        eng->queue.enqueueWriteBuffer(dBitparallel, false, 0, hBitparallel.size() * sizeof(cl_ulong), hBitparallel.data());
+    }
+
+    // decoded UTF8 gets mapped to class ids on the device, see decoder.cl
+    std::vector<std::uint32_t> hAlphabet;
+    if (graph.enc == serial::encoding::utf32 && graph.classes.n_classes > 0) {
+        hAlphabet.assign(graph.classes.bounds.begin(), graph.classes.bounds.end());
+        hAlphabet.insert(hAlphabet.end(), graph.classes.ids.begin(), graph.classes.ids.end());
+        dAlphabet = cl::Buffer(
+            eng->context,
+            CL_MEM_READ_ONLY,
+            hAlphabet.size() * sizeof(cl_uint),
+            nullptr
+        );
+        eng->queue.enqueueWriteBuffer(dAlphabet, false, 0, hAlphabet.size() * sizeof(cl_uint), hAlphabet.data());
+    }
 
     eng->queue.finish();
 
+    float t_upload_ms = getEventTimeMS(evtUploadAutomaton);
+    stage_ms["uploadAutomaton"] += t_upload_ms;
     if (printProfile) {
         std::cout << "Profiling data:" << std::endl
-            << "  uploadAutomaton    = " << getEventTimeMS(evtUploadAutomaton) << "ms" << std::endl;
+            << "  uploadAutomaton    = " << t_upload_ms << "ms" << std::endl;
     }
 }
 
-std::vector<std::uint32_t> oclrunner::run(const std::u32string& chunk) {
-    sanity_assert(chunk.size() > 0, "chunk must contain content");
-    sanity_assert(chunk.size() <= max_chunk_size, "chunk is too big for this config");
+std::vector<match> oclrunner::run(const std::u32string& chunk) {
+    sanity_assert(pending() == 0, "cannot mix run and enqueue");
+    enqueue(chunk);
+    return wait();
+}
 
-    // OpenCL events
-    cl::Event evtUploadText;
-    cl::Event evtUploadFlags;
-    cl::Event evtKernelAutomaton;
-    cl::Event evtKernelTransform;
-    std::vector<cl::Event> evtsKernelScan;
-    cl::Event evtKernelMove;
-    cl::Event evtDownloadOutputSize;
+std::vector<match> oclrunner::run(const std::string& chunk) {
+    sanity_assert(pending() == 0, "cannot mix run and enqueue");
+    enqueue(chunk);
+    return wait();
+}
+
+void oclrunner::enqueue(const std::u32string& chunk) {
+    sanity_assert(graph.enc == serial::encoding::utf32, "graph was not compiled for UTF32 input");
+    bool use_starts = find_candidates(graph, chunk, candidates);
+    enqueue_elements(chunk.data(), chunk.size(), sizeof(char32_t), use_starts, false);
+}
+
+void oclrunner::enqueue(const std::string& chunk) {
+    if (graph.enc == serial::encoding::utf32) {
+        // the prefilter works on codepoints, which only exist on the device
+        enqueue_elements(chunk.data(), chunk.size(), sizeof(char), false, true);
+        return;
+    }
+    bool use_starts = find_candidates(graph, chunk, candidates);
+    enqueue_elements(chunk.data(), chunk.size(), sizeof(char), use_starts, false);
+}
+
+std::vector<match> oclrunner::wait() {
+    if (!finished.empty()) {
+        auto result = std::move(finished.front());
+        finished.pop_front();
+        return result;
+    }
+
+    sanity_assert(!inflight.empty(), "no chunk was submitted");
+    auto idx = inflight.front();
+    inflight.pop_front();
+    return complete(slots[idx]);
+}
+
+std::size_t oclrunner::pending() const {
+    return inflight.size() + finished.size();
+}
+
+std::size_t oclrunner::depth() const {
+    return slots.size();
+}
+
+void oclrunner::enqueue_elements(const void* text, std::size_t size, std::uint32_t width, bool use_starts, bool decode) {
+    sanity_assert(size > 0, "chunk must contain content");
+    sanity_assert(size <= max_chunk_size, "chunk is too big for this config");
+
+    // free slot if all of them are busy
+    if (inflight.size() == slots.size()) {
+        auto idx = inflight.front();
+        inflight.pop_front();
+        finished.push_back(complete(slots[idx]));
+    }
+
+    auto& s = slots[next_slot];
+    inflight.push_back(next_slot);
+    next_slot = (next_slot + 1) % slots.size();
+
+    s.size = size;
+    s.use_starts = use_starts;
+    s.decode = decode;
+    s.use_bp = graph.bp.n_positions > 0 && !use_starts && !decode; // the host fixup needs the class ids
+    bool ends = graph.mode != serial::match_mode::starts;
+    if (use_starts) {
+        s.hStarts.swap(candidates);
+        s.n_slots = s.hStarts.size();
+    } else {
+        s.n_slots = size;
+    }
+
+    // prefilter rejected every position, so there is nothing to do on the device
+    if (s.n_slots == 0) {
+        return;
+    }
+
+    if (decode && s.dIndex() == nullptr) {
+        // zero-copy devices read the bytes from pText, but still need room for the decoded text
+        if (zero_copy) {
+            s.dText = cl::Buffer(
+                eng->context,
+                CL_MEM_READ_WRITE,
+                max_chunk_size * sizeof(char32_t),
+                nullptr
+            );
+        } else {
+            s.dBytes = cl::Buffer(
+                eng->context,
+                CL_MEM_READ_ONLY,
+                max_chunk_size * sizeof(char),
+                nullptr
+            );
+        }
+
+        s.dIndex = cl::Buffer(
+            eng->context,
+            CL_MEM_READ_WRITE,
+            (max_chunk_size + 1) * sizeof(cl_uint),
+            nullptr
+        );
+
+        s.dDecodeCounts = cl::Buffer(
+            eng->context,
+            CL_MEM_READ_WRITE,
+            (max_chunk_size / eng->decode_segment_size + 2) * sizeof(cl_uint),
+            nullptr
+        );
+    }
+
+    // write the chunk into pinned memory, with a compressed alphabet the device only sees one class id byte per element
+    const auto& classes = s.use_bp ? graph.bp.classes : graph.classes;
+    s.compressed = classes.n_classes > 0;
+    s.text_bytes = (decode || s.compressed) ? size : size * width;
+    auto hText = static_cast<char*>(s.queue.enqueueMapBuffer(s.pText, true, CL_MAP_WRITE_INVALIDATE_REGION, 0, s.text_bytes));
+    if (decode) {
+        // the device decodes the bytes into dText, one class id or codepoint per element
+        std::memcpy(hText, text, size);
+        width = s.compressed ? 1 : sizeof(char32_t);
+    } else if (s.compressed) {
+        auto t_start = std::chrono::steady_clock::now();
+        auto out = reinterpret_cast<std::uint8_t*>(hText);
+        if (width == sizeof(char32_t)) {
+            map_to_classes(classes, static_cast<const char32_t*>(text), size, out);
+        } else {
+            map_to_classes(classes, static_cast<const char*>(text), size, out);
+        }
+        width = 1;
+        s.map_ms = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+    } else {
+        std::memcpy(hText, text, size * width);
+    }
+    s.hFlags.assign(eng->flags_n, 0);
+
+    // zero-copy devices are done once the memory is handed back, the others copy it (in-order, so before the unmap)
+    if (zero_copy) {
+        s.queue.enqueueUnmapMemObject(s.pText, hText, nullptr, &s.evtUploadText);
+    } else {
+        s.queue.enqueueWriteBuffer(decode ? s.dBytes : s.dText, false, 0, s.text_bytes, hText, nullptr, &s.evtUploadText);
+        s.queue.enqueueUnmapMemObject(s.pText, hText);
+    }
+    const cl::Buffer& dUpload = zero_copy ? s.pText : (decode ? s.dBytes : s.dText);
+    const cl::Buffer& dInput = decode ? s.dText : dUpload;
+    s.queue.enqueueWriteBuffer(s.dFlags, false, 0, s.hFlags.size() * sizeof(char), s.hFlags.data(), nullptr, &s.evtUploadFlags);
+    if (use_starts) {
+        s.queue.enqueueWriteBuffer(s.dStarts, false, 0, s.hStarts.size() * sizeof(cl_uint), s.hStarts.data(), nullptr, &s.evtUploadStarts);
+    }
+    s.hUnfinishedN = 0;
+    s.queue.enqueueWriteBuffer(s.dUnfinishedN, false, 0, 1 * sizeof(cl_uint), &s.hUnfinishedN, nullptr, &s.evtUploadUnfinishedN);
+    if (graph.n_patterns > 1) {
+        s.hMatchesN = 0;
+        s.queue.enqueueWriteBuffer(s.dMatchesN, false, 0, 1 * sizeof(cl_uint), &s.hMatchesN, nullptr, &s.evtUploadMatchesN);
+    }
+
+    if (decode) {
+        // count codepoints per segment, scan the counts to offsets and write the codepoints there, the automaton runs
+        // on all size elements (the rest is filled with separators)
+        std::size_t n_segments = size / eng->decode_segment_size + 1;
+        std::size_t totalSize = adjust_globalsize(n_segments, eng->group_size);
+        eng->kernelDecodeCount.setArg(0, static_cast<cl_uint>(size));
+        eng->kernelDecodeCount.setArg(1, static_cast<cl_uint>(eng->decode_segment_size));
+        eng->kernelDecodeCount.setArg(2, dUpload);
+        eng->kernelDecodeCount.setArg(3, s.dDecodeCounts);
+        s.queue.enqueueNDRangeKernel(eng->kernelDecodeCount, cl::NullRange, cl::NDRange(totalSize), cl::NDRange(eng->group_size), nullptr, &s.evtKernelDecodeCount);
+
+        eng->kernelScanTiles.setArg(0, s.dDecodeCounts);
+        eng->kernelScanTiles.setArg(1, static_cast<cl_uint>(n_segments));
+        s.queue.enqueueNDRangeKernel(eng->kernelScanTiles, cl::NullRange, cl::NDRange(eng->group_size), cl::NDRange(eng->group_size), nullptr, &s.evtKernelDecodeScan);
+
+        eng->kernelDecodeWrite.setArg(0, static_cast<cl_uint>(size));
+        eng->kernelDecodeWrite.setArg(1, static_cast<cl_uint>(eng->decode_segment_size));
+        eng->kernelDecodeWrite.setArg(2, static_cast<cl_uint>(n_segments));
+        eng->kernelDecodeWrite.setArg(3, static_cast<cl_uint>(width));
+        eng->kernelDecodeWrite.setArg(4, static_cast<cl_uint>(s.compressed ? graph.classes.bounds.size() : 0));
+        eng->kernelDecodeWrite.setArg(5, dUpload);
+        eng->kernelDecodeWrite.setArg(6, s.dDecodeCounts);
+        eng->kernelDecodeWrite.setArg(7, s.compressed ? dAlphabet : s.dIndex); // never touched without class ids
+        eng->kernelDecodeWrite.setArg(8, s.dText);
+        eng->kernelDecodeWrite.setArg(9, s.dIndex);
+        s.queue.enqueueNDRangeKernel(eng->kernelDecodeWrite, cl::NullRange, cl::NDRange(totalSize), cl::NDRange(eng->group_size), nullptr, &s.evtKernelDecodeWrite);
+
+        // only required if the host has to retry start positions
+        s.queue.enqueueReadBuffer(s.dDecodeCounts, false, n_segments * sizeof(cl_uint), 1 * sizeof(cl_uint), &s.hDecodedN, nullptr, &s.evtDownloadDecodedN);
+    }
+
+    if (s.use_bp) {
+        // every work-item scans one segment, the host follows up on paths that cross segment borders
+        std::size_t n_segments = (size + eng->bp_segment_size - 1) / eng->bp_segment_size;
+        s.hSegState.resize(n_segments);
+        eng->kernelBitparallel.setArg(0, static_cast<cl_uint>(size));
+        eng->kernelBitparallel.setArg(1, static_cast<cl_uint>(eng->bp_segment_size));
+        eng->kernelBitparallel.setArg(2, static_cast<cl_uint>(graph.bp.n_tables()));
+        eng->kernelBitparallel.setArg(3, static_cast<cl_uint>(graph.bp.classes.n_classes));
+        eng->kernelBitparallel.setArg(4, static_cast<cl_uint>(graph.n_patterns));
+        eng->kernelBitparallel.setArg(5, static_cast<cl_ulong>(graph.bp.first));
+        eng->kernelBitparallel.setArg(6, dBitparallel);
+        eng->kernelBitparallel.setArg(7, dInput);
+        eng->kernelBitparallel.setArg(8, s.dOutput);
+        eng->kernelBitparallel.setArg(9, s.dSegState);
+        eng->kernelBitparallel.setArg(10, s.dFlags);
+        eng->kernelBitparallel.setArg(11, s.dMatches);
+        eng->kernelBitparallel.setArg(12, s.dMatchesN);
+        eng->kernelBitparallel.setArg(13, static_cast<cl_uint>(max_matches));
+
+        std::size_t totalSize = adjust_globalsize(n_segments, eng->group_size);
+        s.queue.enqueueNDRangeKernel(eng->kernelBitparallel, cl::NullRange, cl::NDRange(totalSize), cl::NDRange(eng->group_size), nullptr, &s.evtKernelBitparallel);
+        s.queue.enqueueReadBuffer(s.dSegState, false, 0, n_segments * sizeof(cl_ulong), s.hSegState.data(), nullptr, &s.evtDownloadSegState);
+    } else {
+        // run automaton kernel
+        eng->kernelAutomaton.setArg(0, static_cast<cl_uint>(graph.n));
+        eng->kernelAutomaton.setArg(1, static_cast<cl_uint>(size));
+        eng->kernelAutomaton.setArg(2, static_cast<cl_uint>(width));
+        eng->kernelAutomaton.setArg(3, static_cast<cl_uint>(eng->multi_input_n));
+        eng->kernelAutomaton.setArg(4, static_cast<cl_uint>(graph.accept_base));
+        eng->kernelAutomaton.setArg(5, static_cast<cl_uint>(graph.n_patterns));
+        eng->kernelAutomaton.setArg(6, static_cast<cl_uint>(s.n_slots));
+        eng->kernelAutomaton.setArg(7, static_cast<cl_uint>(use_starts));
+        eng->kernelAutomaton.setArg(8, static_cast<cl_uint>(serial::engine_mode(graph.mode)));
+        eng->kernelAutomaton.setArg(9, s.dStarts);
+        eng->kernelAutomaton.setArg(10, dAutomatonData);
+        eng->kernelAutomaton.setArg(11, dInput);
+        eng->kernelAutomaton.setArg(12, s.dOutput);
+        eng->kernelAutomaton.setArg(13, ends ? s.dEnds : s.dOutput); // never touched without ends
+        eng->kernelAutomaton.setArg(14, s.dFlags);
+        eng->kernelAutomaton.setArg(15, s.dMatches);
+        eng->kernelAutomaton.setArg(16, s.dMatchesN);
+        eng->kernelAutomaton.setArg(17, static_cast<cl_uint>(max_matches));
+        eng->kernelAutomaton.setArg(18, s.dUnfinished);
+        eng->kernelAutomaton.setArg(19, s.dUnfinishedN);
+        eng->kernelAutomaton.setArg(20, eng->oversize_cache * eng->group_size * sizeof(char32_t), nullptr);
+
+        std::size_t totalSize = s.n_slots / eng->multi_input_n;
+        if (s.n_slots % eng->multi_input_n != 0) {
+            totalSize += 1;
+        }
+        totalSize = adjust_globalsize(totalSize, eng->group_size);
+        s.queue.enqueueNDRangeKernel(eng->kernelAutomaton, cl::NullRange, cl::NDRange(totalSize), cl::NDRange(eng->group_size), nullptr, &s.evtKernelAutomaton);
+    }
+    s.queue.enqueueReadBuffer(s.dUnfinishedN, false, 0, 1 * sizeof(cl_uint), &s.hUnfinishedN, nullptr, &s.evtDownloadUnfinishedN);
+
+    if (graph.n_patterns > 1) {
+        // pattern sets append their matches directly, so there is nothing to compact
+        s.queue.enqueueReadBuffer(s.dMatchesN, false, 0, 1 * sizeof(cl_uint), &s.hMatchesN, nullptr, &s.evtDownloadMatchesN);
+        s.queue.enqueueReadBuffer(s.dFlags, false, 0, s.hFlags.size() * sizeof(char), s.hFlags.data(), nullptr, &s.evtDownloadFlags);
+        s.queue.flush();
+        return;
+    }
+
+    // compact results: count per tile, scan tile counts, move results to their final position
+    std::size_t tiles = n_tiles(s.n_slots);
+    eng->kernelCount.setArg(0, s.dOutput);
+    eng->kernelCount.setArg(1, s.dTileCounts);
+    eng->kernelCount.setArg(2, static_cast<cl_uint>(s.n_slots));
+    s.queue.enqueueNDRangeKernel(eng->kernelCount, cl::NullRange, cl::NDRange(tiles * eng->group_size), cl::NDRange(eng->group_size), nullptr, &s.evtKernelCount);
+
+    eng->kernelScanTiles.setArg(0, s.dTileCounts);
+    eng->kernelScanTiles.setArg(1, static_cast<cl_uint>(tiles));
+    s.queue.enqueueNDRangeKernel(eng->kernelScanTiles, cl::NullRange, cl::NDRange(eng->group_size), cl::NDRange(eng->group_size), nullptr, &s.evtKernelScanTiles);
+
+    eng->kernelCompact.setArg(0, s.dOutput);
+    eng->kernelCompact.setArg(1, s.dTileCounts);
+    eng->kernelCompact.setArg(2, s.dCompacted);
+    eng->kernelCompact.setArg(3, static_cast<cl_uint>(s.n_slots));
+    s.queue.enqueueNDRangeKernel(eng->kernelCompact, cl::NullRange, cl::NDRange(tiles * eng->group_size), cl::NDRange(eng->group_size), nullptr, &s.evtKernelCompact);
+
+    // ends are RESULT_FAIL exactly where the output is, so they end up at the same offsets
+    if (ends) {
+        eng->kernelCompact.setArg(0, s.dEnds);
+        eng->kernelCompact.setArg(1, s.dTileCounts);
+        eng->kernelCompact.setArg(2, s.dCompactedEnds);
+        eng->kernelCompact.setArg(3, static_cast<cl_uint>(s.n_slots));
+        s.queue.enqueueNDRangeKernel(eng->kernelCompact, cl::NullRange, cl::NDRange(tiles * eng->group_size), cl::NDRange(eng->group_size), nullptr, &s.evtKernelCompactEnds);
+    }
+
+    // request output size and flags, the output itself gets downloaded when the size is known
+    s.queue.enqueueReadBuffer(s.dTileCounts, false, tiles * sizeof(cl_uint), 1 * sizeof(cl_uint), &s.hOutputSize, nullptr, &s.evtDownloadOutputSize);
+    s.queue.enqueueReadBuffer(s.dFlags, false, 0, s.hFlags.size() * sizeof(char), s.hFlags.data(), nullptr, &s.evtDownloadFlags);
+
+    // kick off work, so it runs while the host prepares the next chunk
+    s.queue.flush();
+}
+
+std::vector<match> oclrunner::complete(slot& s) {
     cl::Event evtDownloadOutput;
-    cl::Event evtDownloadFlags;
-
-    // upload data
-    std::vector<char> flags(eng->flags_n, 0);
-
-    eng->queue.enqueueWriteBuffer(dText, false, 0, chunk.size()  * sizeof(char32_t), chunk.data(), nullptr, &evtUploadText);
-    eng->queue.enqueueWriteBuffer(dFlags, false, 0, flags.size() * sizeof(char), flags.data(), nullptr, &evtUploadFlags);
-
-    // run automaton kernel
-    eng->kernelAutomaton.setArg(0, static_cast<cl_uint>(graph.n));
-    eng->kernelAutomaton.setArg(1, static_cast<cl_uint>(graph.o));
-    eng->kernelAutomaton.setArg(2, static_cast<cl_uint>(chunk.size()));
-    eng->kernelAutomaton.setArg(3, static_cast<cl_uint>(eng->multi_input_n));
-    eng->kernelAutomaton.setArg(4, dAutomatonData);
-    eng->kernelAutomaton.setArg(5, dText);
-    eng->kernelAutomaton.setArg(6, dOutput);
-    eng->kernelAutomaton.setArg(7, dFlags);
-    eng->kernelAutomaton.setArg(8, eng->oversize_cache * eng->group_size * sizeof(char32_t), nullptr);
-
-    std::size_t totalSize = chunk.size() / eng->multi_input_n;
-    if (chunk.size() % eng->multi_input_n != 0) {
-        totalSize += 1;
-    }
-    totalSize = adjust_globalsize(totalSize, eng->group_size);
-    eng->queue.enqueueNDRangeKernel(eng->kernelAutomaton, cl::NullRange, cl::NDRange(totalSize), cl::NDRange(eng->group_size), nullptr, &evtKernelAutomaton);
-
-    // run transform kernel
-    std::size_t globalsize = adjust_globalsize(chunk.size(), eng->group_size);
-    eng->kernelTransform.setArg(0, dOutput);
-    eng->kernelTransform.setArg(1, dScanbuffer0);
-    eng->kernelTransform.setArg(2, static_cast<cl_uint>(chunk.size()));
-    eng->queue.enqueueNDRangeKernel(eng->kernelTransform, cl::NullRange, cl::NDRange(globalsize), cl::NDRange(eng->group_size), nullptr, &evtKernelTransform);
-
-    // run scan kernel
-    std::size_t offset = 1;
-    while (offset < chunk.size()) {
-        evtsKernelScan.emplace_back();
-        eng->kernelScan.setArg(0, dScanbuffer0);
-        eng->kernelScan.setArg(1, dScanbuffer1);
-        eng->kernelScan.setArg(2, static_cast<cl_uint>(chunk.size()));
-        eng->kernelScan.setArg(3, static_cast<cl_uint>(offset));
-        eng->queue.enqueueNDRangeKernel(eng->kernelScan, cl::NullRange, cl::NDRange(globalsize), cl::NDRange(eng->group_size), nullptr, &evtsKernelScan[evtsKernelScan.size() - 1]);
-        std::swap(dScanbuffer0, dScanbuffer1);
-        offset = offset << 1;
-    }
-
-    // run move kernel
-    eng->kernelMove.setArg(0, dScanbuffer0);
-    eng->kernelMove.setArg(1, dOutput);
-    eng->kernelMove.setArg(2, dScanbuffer1);
-    eng->kernelMove.setArg(3, static_cast<cl_uint>(chunk.size()));
-    eng->queue.enqueueNDRangeKernel(eng->kernelMove, cl::NullRange, cl::NDRange(globalsize), cl::NDRange(eng->group_size), nullptr, &evtKernelMove);
-    std::swap(dOutput, dScanbuffer1);
-
-    // get output
+    cl::Event evtDownloadEnds;
+    bool multi = graph.n_patterns > 1;
+    bool ends = graph.mode != serial::match_mode::starts;
+
+    if (s.n_slots == 0) {
+        chunk_profile prof;
+        prof.elements = s.size;
+        record(prof);
+        if (printProfile) {
+            std::cout << "Profiling data:" << std::endl
+                << "  candidates         = 0" << std::endl;
+        }
+        return {};
+    }
+
+    // single patterns produce compacted start positions (and ends), pattern sets (startpos, pattern[, end]) entries
     std::uint32_t outputSize;
-    eng->queue.enqueueReadBuffer(dScanbuffer0, true, (chunk.size() - 1) * sizeof(cl_uint), 1 * sizeof(cl_uint), &outputSize, nullptr, &evtDownloadOutputSize);
-    sanity_assert(outputSize <= chunk.size(), "outputSize must be at max the chunk size");
+    if (multi) {
+        s.evtDownloadMatchesN.wait();
+        outputSize = match_words * std::min(s.hMatchesN, max_matches);
+    } else {
+        s.evtDownloadOutputSize.wait();
+        outputSize = s.hOutputSize;
+        sanity_assert(outputSize <= s.n_slots, "outputSize must be at max the number of start positions");
+    }
+
+    // decoded chunks report byte offsets, the device still has the index
+    cl::Event evtKernelToBytes;
+    cl::Event evtKernelToBytesEnds;
+    if (s.decode && outputSize > 0) {
+        eng->kernelToBytes.setArg(0, static_cast<cl_uint>(outputSize));
+        eng->kernelToBytes.setArg(1, static_cast<cl_uint>(multi ? match_words : 1));
+        eng->kernelToBytes.setArg(2, static_cast<cl_uint>(multi && ends ? 0x5 : 0x1)); // (startpos, pattern, end)
+        eng->kernelToBytes.setArg(3, s.dIndex);
+        eng->kernelToBytes.setArg(4, multi ? s.dMatches : s.dCompacted);
+        s.queue.enqueueNDRangeKernel(eng->kernelToBytes, cl::NullRange, cl::NDRange(adjust_globalsize(outputSize, eng->group_size)), cl::NDRange(eng->group_size), nullptr, &evtKernelToBytes);
+        if (ends && !multi) {
+            eng->kernelToBytes.setArg(4, s.dCompactedEnds);
+            s.queue.enqueueNDRangeKernel(eng->kernelToBytes, cl::NullRange, cl::NDRange(adjust_globalsize(outputSize, eng->group_size)), cl::NDRange(eng->group_size), nullptr, &evtKernelToBytesEnds);
+        }
+    }
 
-    std::vector<uint32_t> output(outputSize, 0);
+    // results are read from mapped memory, so they are not copied twice
+    const cl::Buffer& dOutputResult = multi ? s.dMatches : s.dCompacted;
+    cl_uint* output = nullptr;
     if (outputSize > 0) {
-        eng->queue.enqueueReadBuffer(dOutput, false, 0, outputSize * sizeof(cl_uint), output.data(), nullptr, &evtDownloadOutput);
+        output = static_cast<cl_uint*>(s.queue.enqueueMapBuffer(dOutputResult, false, CL_MAP_READ, 0, outputSize * sizeof(cl_uint), nullptr, &evtDownloadOutput));
+    }
+    std::size_t outputEndsSize = (ends && !multi) ? outputSize : 0;
+    cl_uint* outputEnds = nullptr;
+    if (outputEndsSize > 0) {
+        outputEnds = static_cast<cl_uint*>(s.queue.enqueueMapBuffer(s.dCompactedEnds, false, CL_MAP_READ, 0, outputEndsSize * sizeof(cl_uint), nullptr, &evtDownloadEnds));
     }
 
-    eng->queue.enqueueReadBuffer(dFlags, false, 0, flags.size() * sizeof(char), flags.data(), nullptr, &evtDownloadFlags);
+    // start positions the kernel could not finish are downloaded as well
+    cl::Event evtDownloadUnfinished;
+    s.evtDownloadUnfinishedN.wait();
+    std::vector<std::uint32_t> unfinished(s.hUnfinishedN, 0);
+    if (!unfinished.empty()) {
+        s.queue.enqueueReadBuffer(s.dUnfinished, false, 0, unfinished.size() * sizeof(cl_uint), unfinished.data(), nullptr, &evtDownloadUnfinished);
+    }
 
-    eng->queue.finish();
+    s.queue.finish();
 
-    if (printProfile) {
-        std::cout << "Profiling data:" << std::endl
-            << "  uploadText         = " << getEventTimeMS(evtUploadText) << "ms" << std::endl
-            << "  uploadFlags        = " << getEventTimeMS(evtUploadFlags) << "ms" << std::endl
-            << "  kernelAutomaton    = " << getEventTimeMS(evtKernelAutomaton) << "ms" << std::endl
-            << "  kernelTransform    = " << getEventTimeMS(evtKernelTransform) << "ms" << std::endl
-            << "  kernelScan         = " << std::endl;
-        float sumScan = 0.f;
-        for (std::size_t i = 0; i < evtsKernelScan.size(); ++i) {
-            float t = getEventTimeMS(evtsKernelScan[i]);
-            sumScan += t;
-            std::cout << "    " << t << "ms" << std::endl;
+    // stage times of this chunk (in execution order), transfer sizes and flags
+    chunk_profile prof;
+    prof.elements = s.size;
+    prof.candidates = s.n_slots;
+    prof.bytes_up = s.text_bytes + s.hFlags.size() + (s.use_starts ? s.n_slots * sizeof(cl_uint) : 0) + (multi ? 2 : 1) * sizeof(cl_uint);
+    prof.bytes_down = (outputSize + outputEndsSize + unfinished.size()) * sizeof(cl_uint) + s.hFlags.size() + 2 * sizeof(cl_uint) + (s.use_bp ? s.hSegState.size() * sizeof(cl_ulong) : 0) + (s.decode ? sizeof(cl_uint) : 0);
+    prof.flag_iter_max = s.hFlags[eng->flag_iter_max] != 0;
+    prof.flag_stack_full = s.hFlags[eng->flag_stack_full] != 0;
+    prof.flag_matches_full = s.hFlags[eng->flag_matches_full] != 0;
+
+    if (s.compressed) {
+        prof.add_stage(profile_stage::map_classes, s.map_ms);
+    }
+    prof.add_stage(profile_stage::upload_text, getEventTimeMS(s.evtUploadText));
+    prof.add_stage(profile_stage::upload_flags, getEventTimeMS(s.evtUploadFlags));
+    if (s.decode) {
+        prof.add_stage(profile_stage::kernel_decode_count, getEventTimeMS(s.evtKernelDecodeCount));
+        prof.add_stage(profile_stage::kernel_decode_scan, getEventTimeMS(s.evtKernelDecodeScan));
+        prof.add_stage(profile_stage::kernel_decode_write, getEventTimeMS(s.evtKernelDecodeWrite));
+    }
+    prof.add_stage(profile_stage::upload_unfinished_n, getEventTimeMS(s.evtUploadUnfinishedN));
+    if (s.use_starts) {
+        prof.add_stage(profile_stage::upload_starts, getEventTimeMS(s.evtUploadStarts));
+    }
+    profile_stage kernel_stage = s.use_bp ? profile_stage::kernel_bitparallel : profile_stage::kernel_automaton;
+    float t_kernel_ms = getEventTimeMS(s.use_bp ? s.evtKernelBitparallel : s.evtKernelAutomaton);
+    if (multi) {
+        prof.add_stage(profile_stage::upload_matches_n, getEventTimeMS(s.evtUploadMatchesN));
+        prof.add_stage(kernel_stage, t_kernel_ms);
+        prof.add_stage(profile_stage::download_matches_n, getEventTimeMS(s.evtDownloadMatchesN));
+    } else {
+        prof.add_stage(kernel_stage, t_kernel_ms);
+        prof.add_stage(profile_stage::kernel_count, getEventTimeMS(s.evtKernelCount));
+        prof.add_stage(profile_stage::kernel_scan_tiles, getEventTimeMS(s.evtKernelScanTiles));
+        prof.add_stage(profile_stage::kernel_compact, getEventTimeMS(s.evtKernelCompact));
+        if (ends) {
+            prof.add_stage(profile_stage::kernel_compact_ends, getEventTimeMS(s.evtKernelCompactEnds));
+        }
+        prof.add_stage(profile_stage::download_output_size, getEventTimeMS(s.evtDownloadOutputSize));
+    }
+    if (s.decode && outputSize > 0) {
+        prof.add_stage(profile_stage::kernel_to_bytes, getEventTimeMS(evtKernelToBytes));
+        if (ends && !multi) {
+            prof.add_stage(profile_stage::kernel_to_bytes_ends, getEventTimeMS(evtKernelToBytesEnds));
+        }
+    }
+    if (outputSize > 0) {
+        // only that that case the event got fired
+        prof.add_stage(profile_stage::download_output, getEventTimeMS(evtDownloadOutput));
+    }
+    if (outputEndsSize > 0) {
+        prof.add_stage(profile_stage::download_ends, getEventTimeMS(evtDownloadEnds));
+    }
+    if (s.use_bp) {
+        prof.add_stage(profile_stage::download_seg_state, getEventTimeMS(s.evtDownloadSegState));
+    }
+    prof.add_stage(profile_stage::download_unfinished_n, getEventTimeMS(s.evtDownloadUnfinishedN));
+    if (!unfinished.empty()) {
+        prof.add_stage(profile_stage::download_unfinished, getEventTimeMS(evtDownloadUnfinished));
+    }
+    prof.add_stage(profile_stage::download_flags, getEventTimeMS(s.evtDownloadFlags));
+
+    // the match buffer of a pattern set overflowed, so the device results are incomplete and every start position of the
+    // chunk is redone on the host, like the ones the kernel gave up on (the bit-parallel chunk gets scanned again below)
+    bool matches_full = s.hFlags[eng->flag_matches_full] != 0;
+    std::vector<match> result;
+    if (matches_full) {
+        if (s.use_starts) {
+            unfinished = s.hStarts;
+        } else if (!s.use_bp) {
+            unfinished.resize(s.decode ? s.hDecodedN : s.size);
+            std::iota(unfinished.begin(), unfinished.end(), 0);
+        }
+    } else if (multi) {
+        for (std::size_t i = 0; i < outputSize; i += match_words) {
+            result.push_back(match{output[i], output[i + 1], ends ? output[i + 2] : 0});
         }
-        std::cout << "    ====" << std::endl
-            << "    " << sumScan << "ms" << std::endl
-            << "  kernelMove         = " << getEventTimeMS(evtKernelMove) << "ms" << std::endl
-            << "  downloadOutputSize = " << getEventTimeMS(evtDownloadOutputSize) << "ms" << std::endl;
-        if (outputSize > 0) {
-            // only that that case the event got fired
-            std::cout << "  downloadOutput     = " << getEventTimeMS(evtDownloadOutput) << "ms" << std::endl;
+    } else {
+        for (std::size_t i = 0; i < outputSize; ++i) {
+            result.push_back(match{output[i], 0, ends ? outputEnds[i] : 0});
         }
-        std::cout
-            << "  downloadFlags      = " << getEventTimeMS(evtDownloadFlags) << "ms" << std::endl;
+    }
+    if (output) {
+        s.queue.enqueueUnmapMemObject(dOutputResult, output);
+    }
+    if (outputEnds) {
+        s.queue.enqueueUnmapMemObject(s.dCompactedEnds, outputEnds);
     }
 
-    if (flags[eng->flag_stack_full]) {
-        throw user_error("Automaton engine error: task stack was full!");
+    // retries and the bit-parallel fixup need the uploaded chunk again
+    const char* hText = nullptr;
+    if ((!unfinished.empty() && !s.decode) || s.use_bp) {
+        hText = static_cast<const char*>(s.queue.enqueueMapBuffer(s.pText, true, CL_MAP_READ, 0, s.text_bytes));
     }
-    if (flags[eng->flag_iter_max]) {
-        throw user_error("Automaton engine error: reached maximum iteration count!");
+
+    // heavy patterns exceed the stack or iteration limit at some start positions, those get finished on the host
+    // (which has no such limits) instead of failing the whole search
+    if (!unfinished.empty()) {
+        auto t_start = std::chrono::steady_clock::now();
+        std::vector<match> retried;
+        if (s.decode) {
+            // the host only has the bytes, so the decoded text and its index have to be downloaded as well
+            std::vector<std::uint32_t> index(s.hDecodedN + 1, 0);
+            s.queue.enqueueReadBuffer(s.dIndex, true, 0, index.size() * sizeof(cl_uint), index.data());
+            if (s.compressed) {
+                std::string text(s.hDecodedN, '\0');
+                s.queue.enqueueReadBuffer(s.dText, true, 0, text.size() * sizeof(char), &text[0]);
+                retried = match_positions(graph, text, unfinished);
+            } else {
+                std::u32string text(s.hDecodedN, 0);
+                s.queue.enqueueReadBuffer(s.dText, true, 0, text.size() * sizeof(char32_t), &text[0]);
+                retried = match_positions(graph, text, unfinished);
+            }
+            for (auto& m : retried) {
+                m.offset = index[m.offset];
+                if (ends) {
+                    m.end = index[m.end];
+                }
+            }
+        } else if (graph.enc == serial::encoding::utf32 && !s.compressed) {
+            std::u32string text(reinterpret_cast<const char32_t*>(hText), s.size);
+            retried = match_positions(graph, text, unfinished);
+        } else {
+            std::string text(hText, s.size);
+            retried = match_positions(graph, text, unfinished);
+        }
+        auto t_end = std::chrono::steady_clock::now();
+
+        result.insert(result.end(), retried.begin(), retried.end());
+        prof.retried = unfinished.size();
+        prof.add_stage(profile_stage::retry_host, std::chrono::duration<float, std::milli>(t_end - t_start).count());
     }
+    // paths that cross the segments of the bit-parallel kernel are followed on the host
+    if (s.use_bp) {
+        auto t_start = std::chrono::steady_clock::now();
+        std::vector<match> fixed;
+        if (matches_full) {
+            // a single scan over the whole chunk has no segment borders to fix
+            bp_scan(graph.bp, reinterpret_cast<const std::uint8_t*>(hText), 0, s.size, 0, true, fixed);
+        } else {
+            bp_fixup(graph.bp, reinterpret_cast<const std::uint8_t*>(hText), s.size, eng->bp_segment_size, s.hSegState, fixed);
+        }
+        if (!multi && unfinished.empty() && !fixed.empty()) {
+            // compacted output is sorted already, merging the few new matches is cheaper than sorting everything
+            std::sort(fixed.begin(), fixed.end());
+            std::size_t mid = result.size();
+            result.insert(result.end(), fixed.begin(), fixed.end());
+            std::inplace_merge(result.begin(), result.begin() + static_cast<std::ptrdiff_t>(mid), result.end());
+            result.erase(std::unique(result.begin(), result.end()), result.end());
+        } else {
+            result.insert(result.end(), fixed.begin(), fixed.end());
+        }
+        auto t_end = std::chrono::steady_clock::now();
+        prof.add_stage(profile_stage::fixup_host, std::chrono::duration<float, std::milli>(t_end - t_start).count());
+    }
+    if (hText) {
+        s.queue.enqueueUnmapMemObject(s.pText, const_cast<char*>(hText));
+    }
+    if (multi || !unfinished.empty()) {
+        // work-items append in any order, NFAs can reach the same accept state multiple times and retried start positions
+        // might have found some matches on the device already (or a shorter one, if the kernel gave up)
+        merge_matches(result, graph.mode);
+    }
+
+    if (printProfile) {
+        std::cout << "Profiling data:" << std::endl;
+        if (s.use_starts) {
+            std::cout << "  candidates         = " << s.n_slots << std::endl;
+        }
+        if (prof.retried > 0) {
+            std::cout << "  retried            = " << prof.retried << std::endl;
+        }
+        for (const auto& t : prof.stages) {
+            std::cout << "  " << std::left << std::setw(18) << t.first << std::right << " = " << t.second << "ms" << std::endl;
+        }
+    }
+
+    prof.matches = result.size();
+    record(prof);
 
-    return output;
+    return result;
 }
@@ -0,0 +1,334 @@
+#include <cerrno>
+#include <cstring>
+
+#include <algorithm>
+#include <fstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.hpp"
+#include "graph_file.hpp"
+
+namespace {
+
+constexpr char graph_file_magic[8] = {'O', 'C', 'L', 'G', 'R', 'A', 'P', 'H'};
+constexpr std::size_t header_size = 8 + 4 + 4 + 8 + 8;
+
+std::uint64_t fnv1a(const char* data, std::size_t size) {
+    std::uint64_t h = 0xcbf29ce484222325ull;
+    for (std::size_t i = 0; i < size; ++i) {
+        h ^= static_cast<unsigned char>(data[i]);
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+class writer {
+    public:
+        void put(std::uint64_t x) {
+            buffer.append(reinterpret_cast<const char*>(&x), sizeof(x));
+        }
+
+        template <typename C>
+        void put_array(const C& elements) {
+            put(elements.size());
+            buffer.append(reinterpret_cast<const char*>(elements.data()), elements.size() * sizeof(typename C::value_type));
+            buffer.append((8 - buffer.size() % 8) % 8, '\0');
+        }
+
+        void put(const serial::alphabet& a) {
+            put(a.n_classes);
+            put_array(a.bounds);
+            put_array(a.ids);
+        }
+
+        std::string buffer;
+};
+
+class reader {
+    public:
+        reader(const char* begin, const char* end) : begin(begin), p(begin), end(end) {}
+
+        std::uint64_t get() {
+            std::uint64_t x;
+            need(sizeof(x));
+            std::memcpy(&x, p, sizeof(x));
+            p += sizeof(x);
+            return x;
+        }
+
+        template <typename C>
+        C get_array() {
+            using T = typename C::value_type;
+            std::uint64_t n = get();
+            if (n > static_cast<std::uint64_t>(end - p) / sizeof(T)) {
+                throw user_error("graph file is truncated!");
+            }
+            C result(static_cast<std::size_t>(n), T());
+            if (!result.empty()) {
+                std::memcpy(&result[0], p, result.size() * sizeof(T));
+                p += result.size() * sizeof(T);
+            }
+            skip((8 - static_cast<std::size_t>(p - begin) % 8) % 8);
+            return result;
+        }
+
+        serial::alphabet get_alphabet() {
+            std::size_t n_classes = static_cast<std::size_t>(get());
+            auto bounds = get_array<std::vector<serial::character>>();
+            auto ids = get_array<std::vector<std::uint8_t>>();
+
+            // the table is not stored, the constructor rebuilds it
+            bool empty = n_classes == 0 && bounds.empty() && ids.empty();
+            bool valid = n_classes <= cfg::max_classes && bounds.size() == ids.size() + 1 && std::is_sorted(bounds.begin(), bounds.end());
+            for (auto id : ids) {
+                valid = valid && id < n_classes;
+            }
+            if (!empty && !valid) {
+                throw user_error("graph file contains an invalid alphabet!");
+            }
+            return serial::alphabet(n_classes, bounds, ids);
+        }
+
+        bool done() const {
+            return p == end;
+        }
+
+    private:
+        const char* begin;
+        const char* p;
+        const char* end;
+
+        void need(std::size_t n) const {
+            if (static_cast<std::size_t>(end - p) < n) {
+                throw user_error("graph file is truncated!");
+            }
+        }
+
+        void skip(std::size_t n) {
+            need(n);
+            p += n;
+        }
+};
+
+// read-only mapping of a whole file
+class mapped_file {
+    public:
+        explicit mapped_file(const std::string& fname) : data(nullptr), size(0) {
+            int fd = ::open(fname.c_str(), O_RDONLY);
+            if (fd < 0) {
+                throw user_error("cannot open graph file \"" + fname + "\": " + std::strerror(errno));
+            }
+            struct stat st;
+            if (::fstat(fd, &st) != 0) {
+                std::string error = std::strerror(errno);
+                ::close(fd);
+                throw user_error("cannot open graph file \"" + fname + "\": " + error);
+            }
+            size = static_cast<std::size_t>(st.st_size);
+            if (size > 0) {
+                void* m = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (m == MAP_FAILED) {
+                    std::string error = std::strerror(errno);
+                    ::close(fd);
+                    throw user_error("cannot map graph file \"" + fname + "\": " + error);
+                }
+                data = static_cast<const char*>(m);
+            }
+            ::close(fd);
+        }
+
+        ~mapped_file() {
+            if (data) {
+                ::munmap(const_cast<char*>(data), size);
+            }
+        }
+
+        mapped_file(const mapped_file&) = delete;
+        mapped_file& operator=(const mapped_file&) = delete;
+
+        const char* data;
+        std::size_t size;
+};
+
+// target list at offset (0 = no transition) lies within data and only holds node ids
+bool valid_list(const serial::graph& graph, std::size_t offset) {
+    if (offset == 0) {
+        return true;
+    }
+    if (offset >= graph.data.size()) {
+        return false;
+    }
+    std::size_t k = graph.data[offset];
+    if (k == 0 || k > graph.o || k > graph.data.size() - offset - 1) {
+        return false;
+    }
+    for (std::size_t i = 0; i < k; ++i) {
+        if (graph.data[offset + 1 + i] >= graph.n) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// walks every node like find_next_list does, so no lookup of the engines can leave data or reach an unknown node
+bool valid_nodes(const serial::graph& graph) {
+    const auto& data = graph.data;
+    std::vector<bool> checked(data.size(), false); // lists are shared, every one is checked once
+    for (std::size_t i = 0; i < graph.n; ++i) {
+        std::size_t base = data[i];
+        if (base < graph.n || base >= data.size()) {
+            return false;
+        }
+        serial::word kind = data[base] & serial::node_kind_mask;
+        std::size_t m = data[base] >> serial::node_kind_bits;
+
+        // all nodes are dense if the graph has an alphabet, none otherwise
+        std::size_t n_lists;
+        if (graph.classes.n_classes > 0) {
+            if (kind != serial::node_dense || (m != 0 && m != graph.classes.n_classes)) {
+                return false;
+            }
+            n_lists = m;
+        } else {
+            if (kind == serial::node_dense) {
+                return false;
+            }
+            n_lists = (m > 0) ? m - 1 : 0;
+            if (kind == serial::node_ascii) {
+                n_lists += serial::ascii_table_size;
+            }
+        }
+        std::size_t n_bounds = (kind == serial::node_dense) ? 0 : m;
+        if (1 + n_bounds + n_lists > data.size() - base) {
+            return false;
+        }
+
+        for (std::size_t j = 0; j < n_lists; ++j) {
+            std::size_t offset = data[base + 1 + n_bounds + j];
+            if (offset < checked.size() && checked[offset]) {
+                continue;
+            }
+            if (!valid_list(graph, offset)) {
+                return false;
+            }
+            if (offset != 0) {
+                checked[offset] = true;
+            }
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+void save_graph(const serial::graph& graph, const std::string& fname) {
+    writer w;
+    w.put(graph.n);
+    w.put(graph.o);
+    w.put(static_cast<std::uint64_t>(graph.enc));
+    w.put(graph.max_length);
+    w.put(graph.accept_base);
+    w.put(graph.n_patterns);
+    w.put(static_cast<std::uint64_t>(graph.mode));
+
+    w.put_array(graph.prefilter.elements);
+    w.put(graph.prefilter.min_offset);
+    w.put(graph.prefilter.max_offset);
+
+    w.put(graph.classes);
+
+    w.put(graph.bp.n_positions);
+    w.put(graph.bp.classes);
+    w.put(graph.bp.first);
+    w.put_array(graph.bp.tables);
+    w.put_array(graph.bp.masks);
+    w.put_array(graph.bp.last);
+
+    w.put_array(graph.data);
+
+    writer header;
+    header.buffer.append(graph_file_magic, sizeof(graph_file_magic));
+    std::uint32_t version_fields[2] = {graph_file_version, 0};
+    header.buffer.append(reinterpret_cast<const char*>(version_fields), sizeof(version_fields));
+    header.put(w.buffer.size());
+    header.put(fnv1a(w.buffer.data(), w.buffer.size()));
+
+    std::ofstream out(fname, std::ios::binary | std::ios::trunc);
+    out.write(header.buffer.data(), static_cast<std::streamsize>(header.buffer.size()));
+    out.write(w.buffer.data(), static_cast<std::streamsize>(w.buffer.size()));
+    out.close();
+    if (!out) {
+        throw user_error("cannot write graph file \"" + fname + "\"!");
+    }
+}
+
+serial::graph load_graph(const std::string& fname) {
+    mapped_file f(fname);
+    if (f.size < header_size || std::memcmp(f.data, graph_file_magic, sizeof(graph_file_magic)) != 0) {
+        throw user_error("\"" + fname + "\" is no graph file!");
+    }
+    std::uint32_t version;
+    std::memcpy(&version, f.data + 8, sizeof(version));
+    if (version != graph_file_version) {
+        throw user_error("graph file \"" + fname + "\" has version " + std::to_string(version) + ", but only version " + std::to_string(graph_file_version) + " is supported, please compile the patterns again!");
+    }
+
+    reader h(f.data + 16, f.data + header_size);
+    std::uint64_t payload_size = h.get();
+    std::uint64_t hash = h.get();
+    if (payload_size != f.size - header_size || fnv1a(f.data + header_size, f.size - header_size) != hash) {
+        throw user_error("graph file \"" + fname + "\" is corrupted!");
+    }
+
+    reader r(f.data + header_size, f.data + f.size);
+    std::size_t n = static_cast<std::size_t>(r.get());
+    std::size_t o = static_cast<std::size_t>(r.get());
+    if (n > f.size / sizeof(serial::word)) {
+        throw user_error("graph file \"" + fname + "\" is corrupted!");
+    }
+    serial::graph graph(n, o);
+    std::uint64_t enc = r.get();
+    graph.max_length = static_cast<std::size_t>(r.get());
+    graph.accept_base = static_cast<serial::id>(r.get());
+    graph.n_patterns = static_cast<std::size_t>(r.get());
+    std::uint64_t mode = r.get();
+    if (enc > static_cast<std::uint64_t>(serial::encoding::utf8) || mode > static_cast<std::uint64_t>(serial::match_mode::non_overlapping)) {
+        throw user_error("graph file contains an unknown encoding or match mode!");
+    }
+    graph.enc = static_cast<serial::encoding>(enc);
+    graph.mode = static_cast<serial::match_mode>(mode);
+
+    graph.prefilter.elements = r.get_array<std::u32string>();
+    graph.prefilter.min_offset = static_cast<std::size_t>(r.get());
+    graph.prefilter.max_offset = static_cast<std::size_t>(r.get());
+
+    graph.classes = r.get_alphabet();
+
+    graph.bp.n_positions = static_cast<std::size_t>(r.get());
+    graph.bp.classes = r.get_alphabet();
+    graph.bp.first = r.get();
+    graph.bp.tables = r.get_array<std::vector<std::uint64_t>>();
+    graph.bp.masks = r.get_array<std::vector<std::uint64_t>>();
+    graph.bp.last = r.get_array<std::vector<std::uint64_t>>();
+
+    graph.data = r.get_array<serial::buffer>();
+    if (!r.done()) {
+        throw user_error("graph file has trailing data!");
+    }
+
+    // the engines trust the graph, so everything they index with has to be in range
+    bool valid = n > serial::id_begin && graph.data.size() >= n && graph.n_patterns > 0 && graph.accept_base + graph.n_patterns <= n;
+    valid = valid && valid_nodes(graph);
+    if (graph.bp.n_positions > 0) {
+        valid = valid && graph.bp.n_positions <= 64 && graph.bp.classes.n_classes > 0 && graph.bp.tables.size() == graph.bp.n_tables() * 256 && graph.bp.masks.size() == graph.bp.classes.n_classes && graph.bp.last.size() == graph.n_patterns;
+    }
+    if (!valid) {
+        throw user_error("graph file \"" + fname + "\" is corrupted!");
+    }
+    return graph;
+}
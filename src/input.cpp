@@ -0,0 +1,204 @@
+#include <cerrno>
+#include <cstring>
+
+#include <algorithm>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "input.hpp"
+
+// returns the largest length <= size that does not end within an UTF8 sequence
+// (invalid data is passed through, the converter deals with it)
+std::size_t utf8_boundary(const char* data, std::size_t size) {
+    std::size_t lookback = std::min<std::size_t>(size, 3);
+    for (std::size_t i = 1; i <= lookback; ++i) {
+        auto c = static_cast<unsigned char>(data[size - i]);
+        if ((c & 0xc0) != 0x80) {
+            // found lead byte, does its sequence fit?
+            std::size_t len = 1;
+            if ((c & 0xe0) == 0xc0) {
+                len = 2;
+            } else if ((c & 0xf0) == 0xe0) {
+                len = 3;
+            } else if ((c & 0xf8) == 0xf0) {
+                len = 4;
+            }
+            return (len > i) ? size - i : size;
+        }
+    }
+    return size;
+}
+
+void walk_directory(const std::string& dname, std::vector<std::string>& result) {
+    DIR* dir = opendir(dname.c_str());
+    if (!dir) {
+        // keep it, so opening it reports the error
+        result.push_back(dname);
+        return;
+    }
+    std::vector<std::string> names;
+    while (struct dirent* entry = readdir(dir)) {
+        std::string name(entry->d_name);
+        if (name != "." && name != "..") {
+            names.push_back(name);
+        }
+    }
+    closedir(dir);
+    std::sort(names.begin(), names.end());
+
+    for (const auto& name : names) {
+        std::string path = (dname[dname.size() - 1] == '/') ? dname + name : dname + "/" + name;
+
+        // do not follow symlinks to directories, they might form loops
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            walk_directory(path, result);
+        } else if (S_ISREG(st.st_mode) || (S_ISLNK(st.st_mode) && stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))) {
+            result.push_back(path);
+        }
+    }
+}
+
+std::vector<std::string> expand_paths(const std::vector<std::string>& paths) {
+    std::vector<std::string> result;
+    for (const auto& path : paths) {
+        struct stat st;
+        if (path == "-") {
+            result.push_back(path);
+        } else if (stat(path.c_str(), &st) == 0) {
+            if (S_ISDIR(st.st_mode)) {
+                walk_directory(path, result);
+            } else {
+                result.push_back(path);
+            }
+        } else if (path.find_first_of("*?[") != std::string::npos) {
+            // pattern that was not expanded by the shell (e.g. quoted)
+            glob_t g;
+            if (glob(path.c_str(), 0, nullptr, &g) == 0) {
+                for (std::size_t i = 0; i < g.gl_pathc; ++i) {
+                    auto sub = expand_paths({g.gl_pathv[i]});
+                    result.insert(result.end(), sub.begin(), sub.end());
+                }
+            } else {
+                result.push_back(path);
+            }
+            globfree(&g);
+        } else {
+            result.push_back(path);
+        }
+    }
+    return result;
+}
+
+bool regular_file_size(const std::string& fname, std::size_t& size) {
+    struct stat st;
+    if (fname == "-" || stat(fname.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+        return false;
+    }
+    size = static_cast<std::size_t>(st.st_size);
+    return true;
+}
+
+input_file::input_file(const std::string& fname) : fd(-1), owns_fd(false), map(nullptr), map_size(0), map_pos(0), eof(false) {
+    if (fname == "-") {
+        fd = STDIN_FILENO;
+    } else {
+        fd = open(fname.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw user_error("cannot open file \"" + fname + "\": " + std::strerror(errno));
+        }
+        owns_fd = true;
+    }
+
+    // try to map regular files, everything else falls back to streaming
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* p = mmap(nullptr, static_cast<std::size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED) {
+            map = static_cast<const char*>(p);
+            map_size = static_cast<std::size_t>(st.st_size);
+            madvise(p, map_size, MADV_SEQUENTIAL);
+        }
+    }
+}
+
+input_file::~input_file() {
+    if (map) {
+        munmap(const_cast<char*>(map), map_size);
+    }
+    if (owns_fd) {
+        close(fd);
+    }
+}
+
+input_file::piece input_file::next(std::size_t max_bytes) {
+    sanity_assert(max_bytes >= 4, "pieces must be able to hold at least one codepoint");
+    if (map) {
+        return next_mapped(max_bytes);
+    } else {
+        return next_stream(max_bytes);
+    }
+}
+
+input_file::piece input_file::next_mapped(std::size_t max_bytes) {
+    std::size_t size = std::min(max_bytes, map_size - map_pos);
+    if (map_pos + size < map_size) {
+        size = utf8_boundary(map + map_pos, size);
+    }
+
+    piece result(map + map_pos, size);
+    map_pos += size;
+    return result;
+}
+
+input_file::piece input_file::next_stream(std::size_t max_bytes) {
+    buffer.swap(carry);
+    carry.clear();
+
+    // return after the first read that completes a codepoint, so pipes get searched while they are written
+    std::size_t filled = buffer.size();
+    std::size_t size = eof ? filled : 0;
+    buffer.resize(max_bytes);
+    while (size == 0 && !eof) {
+        ssize_t n = read(fd, &buffer[filled], max_bytes - filled);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw user_error(std::string("cannot read input: ") + std::strerror(errno));
+        } else if (n == 0) {
+            eof = true;
+            size = filled;
+        } else {
+            filled += static_cast<std::size_t>(n);
+            size = utf8_boundary(buffer.data(), filled);
+        }
+    }
+
+    // move incomplete codepoint to the next round
+    carry.assign(buffer, size, filled - size);
+    buffer.resize(size);
+
+    return piece(buffer.data(), buffer.size());
+}
+
+bool input_file::ready() const {
+    if (map || eof) {
+        return true;
+    }
+    pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+    p.revents = 0;
+    return ::poll(&p, 1, 0) > 0;
+}
@@ -1,62 +1,86 @@
 #include <algorithm>
+#include <chrono>
 #include <exception>
 #include <fstream>
 #include <iostream>
-#include <iterator>
 #include <locale>
+#include <memory>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 #include <boost/locale.hpp>
 #include <boost/program_options.hpp>
 
+#include "chunker.hpp"
 #include "common.hpp"
-#include "regex_parser.hpp"
+#include "cpuengine.hpp"
+#include "daemon.hpp"
 #include "engine.hpp"
+#include "graph_file.hpp"
+#include "input.hpp"
+#include "multirunner.hpp"
+#include "output.hpp"
+#include "regex_parser.hpp"
+#include "runner.hpp"
+#include "searcher.hpp"
+#include "threadpool.hpp"
+#include "transcode.hpp"
 
 namespace po = boost::program_options;
 
-std::string readfile(const std::string& fname) {
-    std::ifstream input(fname, std::ios::binary);
-    if (!input.good()) {
-        throw user_error("file does not exist!");
+void print_graph(const serial::graph& g) {
+    std::cout << "Graph (n=" << g.n << ", o=" << g.o << ", size=" << (sizeof(serial::word) * g.size()) << "byte, patterns=" << g.n_patterns << ", max_length=";
+    if (g.max_length == serial::unbounded) {
+        std::cout << "unbounded";
+    } else {
+        std::cout << g.max_length;
     }
-    return std::string(
-        (std::istreambuf_iterator<char>(input)),
-        (std::istreambuf_iterator<char>())
-    );
-}
+    std::cout << ", classes=" << g.classes.n_classes << ", bitparallel_positions=" << g.bp.n_positions << "):" << std::endl;
 
-void print_graph(const serial::graph& g) {
-    std::cout << "Graph (n=" << g.n << ", o=" << g.o << ", size=" << (sizeof(serial::word) * g.size()) << "byte):" << std::endl;
+    for (std::size_t i = 0; i < g.classes.ids.size(); ++i) {
+        std::cout << "  [" << g.classes.bounds[i] << "," << g.classes.bounds[i + 1] << ") => class" << static_cast<unsigned>(g.classes.ids[i]) << std::endl;
+    }
 
+    static const char* kind_names[] = {"linear", "binary", "ascii", "dense"};
     for (std::size_t i_node = 0; i_node < g.n; ++i_node) {
         std::size_t base_node = *reinterpret_cast<const serial::id*>(&g.data[i_node]);
-        std::size_t m = *reinterpret_cast<const serial::id*>(&g.data[base_node]);
-        std::cout << "  node" << i_node << " (m=" << m;
+        serial::word header = g.data[base_node];
+        std::size_t m = header >> serial::node_kind_bits;
+        std::cout << "  node" << i_node << " (m=" << m << ", " << kind_names[header & serial::node_kind_mask];
         if (i_node == serial::id_begin) {
             std::cout << ", BEGIN";
         } else if (i_node == serial::id_fail) {
             std::cout << ", FAIL";
-        } else if (i_node == serial::id_ok) {
-            std::cout << ", OK";
+        } else if (i_node >= g.accept_base && i_node - g.accept_base < g.n_patterns) {
+            std::cout << ", ACCEPT" << (i_node - g.accept_base);
         }
         std::cout << "):" << std::endl;
 
-        std::size_t base_node_body = base_node + 1;
-        for (std::size_t i_value_slot = 0; i_value_slot < m; ++i_value_slot) {
-            std::size_t base_value_slot = base_node_body + i_value_slot * (1 + g.o);
-            serial::character c = *reinterpret_cast<const serial::character*>(&g.data[base_value_slot]);
-            std::cout << "    " << c << " => [";
+        bool dense = (header & serial::node_kind_mask) == serial::node_dense;
+        std::size_t base_bounds = base_node + 1;
+        std::size_t base_lists = dense ? base_bounds : base_bounds + m;
+        std::size_t n_ranges = dense ? m : (m > 0 ? m - 1 : 0);
+        for (std::size_t i_range = 0; i_range < n_ranges; ++i_range) {
+            if (dense) {
+                std::cout << "    class" << i_range << " => [";
+            } else {
+                serial::character begin = *reinterpret_cast<const serial::character*>(&g.data[base_bounds + i_range]);
+                serial::character end = *reinterpret_cast<const serial::character*>(&g.data[base_bounds + i_range + 1]);
+                std::cout << "    [" << begin << "," << end << ") => [";
+            }
 
-            std::size_t base_slot = base_value_slot + 1;
-            for (std::size_t i_entry = 0; i_entry < g.o; ++i_entry) {
-                std::size_t base_entry = base_slot + i_entry;
-                serial::id id = *reinterpret_cast<const serial::id*>(&g.data[base_entry]);
+            std::size_t base_list = g.data[base_lists + i_range];
+            if (base_list != 0) {
+                for (std::size_t i_entry = 0; i_entry < g.data[base_list]; ++i_entry) {
+                    serial::id id = *reinterpret_cast<const serial::id*>(&g.data[base_list + 1 + i_entry]);
 
-                if (i_entry > 0) {
-                    std::cout << ",";
+                    if (i_entry > 0) {
+                        std::cout << ",";
+                    }
+                    std::cout << id;
                 }
-                std::cout << id;
             }
 
             std::cout << "]" << std::endl;
@@ -64,6 +88,182 @@ void print_graph(const serial::graph& g) {
     }
 }
 
+// feeds all files chunk by chunk into the runner (see chunker), returns the time it took in ms
+// files are concatenated into one stream with a separator element between them that cannot be part of any match, small
+// files are read and converted in parallel and share chunks, larger ones (and pipes) are streamed
+// convert(begin, end, text, pool, map) appends the converted bytes to text, pool is set if it may use all threads and map
+// (only set for out.byte_offsets) gets their byte offsets relative to begin
+template <typename string_t, typename Convert>
+float search(runner& r, const std::vector<std::string>& files, threadpool& pool, std::uint32_t max_chunk_size, std::size_t overlap, Convert convert, const output_options& out, std::size_t& n_bytes) {
+    using element_t = typename string_t::value_type;
+
+    const element_t separator = stream_separator<string_t>();
+
+    auto t_start = std::chrono::steady_clock::now();
+    string_t pending;
+    std::size_t offset = 0; // of the first pending element
+    bool eof = false;
+    n_bytes = 0;
+
+    // files that cannot be read are skipped, unless it is the only one
+    auto skip = [&](const std::string& error) {
+        if (files.size() == 1) {
+            throw user_error(error);
+        }
+        std::cerr << error << std::endl;
+    };
+
+    // byte offsets of all pending elements within the stream (the files without separators)
+    offset_map bytes;
+    offset_map* map = out.byte_offsets ? &bytes : nullptr;
+
+    output_writer<string_t> writer(files, out, map);
+    bool first_file = true;
+    auto begin_file = [&](std::size_t idx) {
+        if (!first_file) {
+            pending.push_back(separator);
+        }
+        first_file = false;
+        writer.begin_file(offset + pending.size(), idx, n_bytes);
+    };
+    std::size_t next_file = 0;
+    std::unique_ptr<input_file> streamed;
+
+    chunker chunks(r, max_chunk_size, overlap);
+
+    // everything in flight gets printed, used while a pipe has no new data
+    auto drain = [&]() {
+        chunks.drain();
+        writer.flush();
+    };
+
+    while (true) {
+        // 1. top up pending data
+        //    the number of elements never exceeds the number of bytes, so the pieces fit into the chunk
+        bool idle = false;
+        while (!eof && pending.size() + 4 <= max_chunk_size) {
+            if (streamed) {
+                // pipes are searched as far as they are written: without new data, the pending text is submitted (if
+                // it is longer than the lookahead) or the results so far are printed before waiting
+                if (!streamed->ready()) {
+                    if (pending.size() > overlap) {
+                        idle = true;
+                        break;
+                    }
+                    drain();
+                }
+                auto piece = streamed->next(max_chunk_size - pending.size());
+                if (piece.second == 0) {
+                    streamed.reset();
+                } else {
+                    offset_map piece_map;
+                    std::size_t piece_offset = offset + pending.size();
+                    convert(piece.first, piece.first + piece.second, pending, &pool, map ? &piece_map : nullptr);
+                    if (map) {
+                        map->append(piece_map, piece_offset, n_bytes);
+                    }
+                    n_bytes += piece.second;
+                }
+                continue;
+            }
+            if (next_file == files.size()) {
+                eof = true;
+                break;
+            }
+
+            // a) collect small files until they fill a chunk
+            std::vector<std::size_t> batch;
+            std::size_t batch_bytes = 0;
+            std::size_t size;
+            while (next_file < files.size() && regular_file_size(files[next_file], size) && batch_bytes + size <= max_chunk_size) {
+                batch.push_back(next_file);
+                batch_bytes += size;
+                next_file += 1;
+            }
+
+            // b) anything else gets streamed
+            if (batch.empty()) {
+                try {
+                    streamed.reset(new input_file(files[next_file]));
+                    begin_file(next_file);
+                } catch (user_error& e) {
+                    skip(e.what());
+                }
+                next_file += 1;
+                continue;
+            }
+
+            // c) read and convert the batch in parallel, while the runner works on the last chunks
+            std::vector<string_t> contents(batch.size());
+            std::vector<offset_map> maps(map ? batch.size() : 0);
+            std::vector<std::size_t> sizes(batch.size(), 0);
+            std::vector<std::string> errors(batch.size());
+            pool.parallel_for(batch.size(), [&](std::size_t i) {
+                try {
+                    input_file in(files[batch[i]]);
+                    for (auto piece = in.next(max_chunk_size); piece.second > 0; piece = in.next(max_chunk_size)) {
+                        // files are converted in parallel already
+                        offset_map piece_map;
+                        std::size_t piece_offset = contents[i].size();
+                        convert(piece.first, piece.first + piece.second, contents[i], nullptr, map ? &piece_map : nullptr);
+                        if (map) {
+                            maps[i].append(piece_map, piece_offset, sizes[i]);
+                        }
+                        sizes[i] += piece.second;
+                    }
+                } catch (user_error& e) {
+                    errors[i] = e.what();
+                }
+            });
+            for (std::size_t i = 0; i < batch.size(); ++i) {
+                if (!errors[i].empty()) {
+                    skip(errors[i]);
+                    continue;
+                }
+                begin_file(batch[i]);
+                if (map) {
+                    map->append(maps[i], offset + pending.size(), n_bytes);
+                }
+                n_bytes += sizes[i];
+                pending += contents[i];
+            }
+        }
+        if (pending.empty()) {
+            break;
+        }
+
+        // 2. submit chunk, line modes keep the owned text and its line breaks (indexed during submission)
+        string_t text;
+        std::vector<std::uint32_t> breaks;
+        if (writer.needs_text()) {
+            std::size_t n = chunks.owned(pending.size(), eof);
+            text = pending.substr(0, n);
+            breaks = output_writer<string_t>::index_lines(pending, n);
+        }
+        std::size_t owned = chunks.submit(pending, offset, eof, [&writer, text = std::move(text), breaks = std::move(breaks)](std::size_t chunk_offset, std::size_t chunk_owned, const std::vector<match>& matches) {
+            writer.process(chunk_offset, chunk_owned, text, breaks, matches);
+        });
+
+        // 3. print everything so far while a pipe has no new data
+        if (idle) {
+            drain();
+        }
+
+        // 4. keep lookahead for next round
+        pending.erase(0, owned);
+        offset += owned;
+    }
+    chunks.drain();
+    auto t_end = std::chrono::steady_clock::now();
+
+    if (n_bytes == 0) {
+        throw user_error("Empty files cannot be processed!");
+    }
+    writer.finish();
+
+    return std::chrono::duration<float, std::milli>(t_end - t_start).count();
+}
+
 int main(int argc, char** argv) {
     try {
         // before we start, check if we're working on an UTF8 system
@@ -75,25 +275,64 @@ int main(int argc, char** argv) {
 
         // parse command line argument
         std::string regex_utf8;
-        std::string file;
+        std::vector<std::string> regexes_utf8;
+        std::string patterns_file;
+        std::vector<std::string> paths;
+        std::string backend;
         std::uint32_t max_chunk_size;
+        std::size_t threads;
+        std::size_t pipeline_depth;
+        std::string platform_spec;
+        std::string device_spec;
+        std::string profile_output;
+        std::string profile_format;
+        std::string match_end;
+        std::string serve_path;
+        std::string save_graph_file;
+        std::string load_graph_file;
 
         po::options_description desc("Allowed options");
         desc.add_options()
-            ("regex", po::value(&regex_utf8)->required(), "regex that should be matched")
-            ("file", po::value(&file)->required(), "file where we look for the regex")
+            ("regex", po::value(&regex_utf8), "regex that should be matched")
+            ("file", po::value(&paths)->default_value({"-"}, "-"), "files or directories (searched recursively) where we look for the regex, \"-\" reads from stdin")
+            ("regexp,e", po::value(&regexes_utf8), "add a regex to the pattern set (can be repeated), all positional arguments are files then")
+            ("patterns-file,f", po::value(&patterns_file), "add all regexes from this file to the pattern set, one per line")
             ("normalize-regex", "apply NFKC normalization to regex")
             ("normalize-file", "apply NFKC normalization to data from input file")
+            ("no-dfa", "do not compile the regex to a DFA, always use the NFA")
+            ("no-prefilter", "do not skip start positions based on literals that every match contains")
+            ("no-alphabet", "do not map the text to character classes, nodes transition on raw elements")
+            ("no-bitparallel", "do not use the bit-parallel engine for small patterns")
+            ("utf8", "match directly on the UTF8 bytes of the file, reported offsets are byte offsets")
+            ("byte-offsets", "report byte offsets within the files instead of codepoint offsets (implied by --utf8)")
+            ("device-decode", "upload UTF8 and decode it on the OpenCL device instead of the host, reported offsets are byte offsets")
+            ("save-graph", po::value(&save_graph_file), "compile the patterns, write the graph to this file and exit")
+            ("load-graph", po::value(&load_graph_file), "search with the graph of this file (see --save-graph) instead of compiling patterns, all positional arguments are files then")
             ("print-graph", "print graph data to stdout")
-            ("print-profile", "print OpenCL profiling data to stdout")
+            ("print-profile", "print profiling data to stdout")
+            ("profile-output", po::value(&profile_output), "write per-chunk profiling records and an aggregate to this file")
+            ("profile-format", po::value(&profile_format)->default_value("json"), "format of --profile-output, either \"json\" or \"csv\"")
             ("no-output", "do not print actual output (for debug reasons)")
-            ("max-chunk-size", po::value(&max_chunk_size)->default_value(16 * 1024 * 1024), "max number of elements that get pushed to GPU per round, each element is 4byte")
+            ("match-end", po::value(&match_end), "also print where matches end: \"earliest\", \"longest\" or \"non-overlapping\" (leftmost-longest matches that do not overlap)")
+            ("lines", "print every line that contains a match instead of match offsets")
+            ("line-number,n", "prefix printed lines with their line number within the file (implies --lines)")
+            ("count,c", "only print the number of matching lines per file")
+            ("files-with-matches,l", "only print the names of files that contain a match")
+            ("max-chunk-size", po::value(&max_chunk_size)->default_value(16 * 1024 * 1024), "max number of elements that get pushed to GPU per round, each element is 4byte (1byte with --utf8)")
+            ("backend", po::value(&backend)->default_value("opencl"), "matching backend, either \"opencl\" or \"cpu\"")
+            ("platform", po::value(&platform_spec)->default_value("0"), "index of the OpenCL platform (see --list-devices) or \"all\"")
+            ("device", po::value(&device_spec)->default_value("0"), "index of the OpenCL device within the platform or \"all\", chunks are distributed over all selected devices")
+            ("list-devices", "list all OpenCL platforms and devices")
+            ("no-program-cache", "always build the OpenCL kernels, do not use or update the on-disk cache of built programs")
+            ("pipeline-depth", po::value(&pipeline_depth)->default_value(2), "number of chunks the OpenCL backend processes at the same time (upload, match, download)")
+            ("serve", po::value(&serve_path), "run as a daemon that compiles patterns and searches buffers on requests to this UNIX socket (see README), all other search options are ignored")
+            ("threads", po::value(&threads)->default_value(std::max(1u, std::thread::hardware_concurrency())), "number of threads used by the CPU backend and for reading files")
             ("help", "produce help message")
         ;
 
         po::positional_options_description p;
         p.add("regex", 1);
-        p.add("file", 1);
+        p.add("file", -1);
 
         po::variables_map vm;
         try {
@@ -106,72 +345,259 @@ int main(int argc, char** argv) {
         }
 
         if (vm.count("help")) {
-            std::cout << "oclgrep REGEX FILE" << std::endl
+            std::cout << "oclgrep REGEX [FILE...]" << std::endl
+                << "oclgrep -e REGEX... [-f PATTERNS_FILE] [FILE...]" << std::endl
+                << "oclgrep --load-graph GRAPH_FILE [FILE...]" << std::endl
+                << "oclgrep --serve SOCKET" << std::endl
                 << desc << std::endl;
             return 1;
         }
 
+        if (vm.count("list-devices")) {
+            oclengine::print_devices(std::cout);
+            return EXIT_SUCCESS;
+        }
+
         try {
             po::notify(vm);
         } catch(std::exception& e) {
             throw user_error(e.what());
         }
 
-        // set up OpenCL engine
-        auto eng = std::make_shared<oclengine>();
+        // the daemon keeps one warm engine, patterns and input come with the requests
+        if (vm.count("serve")) {
+            searcher_options sopts;
+            sopts.backend = backend;
+            try {
+                sopts.platform = std::stoul(platform_spec);
+                sopts.device = std::stoul(device_spec);
+            } catch (std::exception&) {
+                throw user_error("--serve requires a single --platform and --device!");
+            }
+            sopts.program_cache = !vm.count("no-program-cache");
+            sopts.threads = threads;
+            sopts.max_chunk_size = max_chunk_size;
+            sopts.pipeline_depth = pipeline_depth;
+            searcher s(sopts);
+            serve(s, serve_path);
+            return EXIT_SUCCESS;
+        }
+
+        // pattern set => the positional arguments are shifted by one
+        if (vm.count("patterns-file")) {
+            std::ifstream in_patterns(patterns_file);
+            if (!in_patterns) {
+                throw user_error("cannot open patterns file!");
+            }
+            std::string line;
+            while (std::getline(in_patterns, line)) {
+                if (!line.empty()) {
+                    regexes_utf8.push_back(line);
+                }
+            }
+        }
+        bool load = vm.count("load-graph") > 0;
+        if (load) {
+            // the graph brings its patterns, so the positional arguments are shifted by one as well
+            if (vm.count("regexp") || vm.count("patterns-file") || vm.count("save-graph")) {
+                throw user_error("--load-graph does not work with --regexp, --patterns-file or --save-graph!");
+            }
+            if (vm.count("regex")) {
+                if (vm["file"].defaulted()) {
+                    paths.clear();
+                }
+                paths.insert(paths.begin(), regex_utf8);
+            }
+        } else if (vm.count("regexp") || vm.count("patterns-file")) {
+            if (vm.count("regex")) {
+                if (vm["file"].defaulted()) {
+                    paths.clear();
+                }
+                paths.insert(paths.begin(), regex_utf8);
+            }
+            if (regexes_utf8.empty()) {
+                throw user_error("pattern set is empty!");
+            }
+        } else if (vm.count("regex")) {
+            regexes_utf8.push_back(regex_utf8);
+        } else {
+            throw user_error("the option '--regex' is required but missing");
+        }
+
+        if (backend != "opencl" && backend != "cpu") {
+            throw user_error("unknown backend, use \"opencl\" or \"cpu\"!");
+        }
+        if (threads == 0) {
+            throw user_error("at least one thread is required!");
+        }
+        if (pipeline_depth == 0) {
+            throw user_error("pipeline depth must be at least 1!");
+        }
+        serial::match_mode mode = serial::match_mode::starts;
+        if (vm.count("match-end")) {
+            if (match_end == "earliest") {
+                mode = serial::match_mode::earliest;
+            } else if (match_end == "longest") {
+                mode = serial::match_mode::longest;
+            } else if (match_end == "non-overlapping") {
+                mode = serial::match_mode::non_overlapping;
+            } else {
+                throw user_error("unknown match end, use \"earliest\", \"longest\" or \"non-overlapping\"!");
+            }
+            if (vm.count("lines") || vm.count("line-number") || vm.count("count") || vm.count("files-with-matches")) {
+                throw user_error("match ends are only printed with offset output!");
+            }
+        }
+        if (vm.count("byte-offsets") && vm.count("normalize-file")) {
+            throw user_error("--byte-offsets does not work with --normalize-file!");
+        }
+        bool device_decode = vm.count("device-decode") > 0;
+        if (device_decode && (backend != "opencl" || vm.count("utf8") || vm.count("normalize-file"))) {
+            throw user_error("--device-decode requires the opencl backend and does not work with --utf8 or --normalize-file!");
+        }
 
         // convert regex data
-        auto regex_utf32 = boost::locale::conv::utf_to_utf<char32_t>(regex_utf8);
-        if (vm.count("normalize-regex")) {
-            regex_utf32 = boost::locale::conv::utf_to_utf<char32_t>(
-                boost::locale::normalize(
-                    boost::locale::conv::utf_to_utf<wchar_t>(regex_utf32),
-                    boost::locale::norm_nfkc
-                )
-            );
+        std::vector<std::u32string> regexes_utf32;
+        for (const auto& r : regexes_utf8) {
+            auto regex_utf32 = boost::locale::conv::utf_to_utf<char32_t>(r);
+            if (vm.count("normalize-regex")) {
+                regex_utf32 = boost::locale::conv::utf_to_utf<char32_t>(
+                    boost::locale::normalize(
+                        boost::locale::conv::utf_to_utf<wchar_t>(regex_utf32),
+                        boost::locale::norm_nfkc
+                    )
+                );
+            }
+            regexes_utf32.push_back(regex_utf32);
         }
 
         // parse regex to graph
-        auto graph = string_to_graph(regex_utf32);
+        graph_options gopts;
+        gopts.determinize = !vm.count("no-dfa");
+        gopts.encoding = vm.count("utf8") ? serial::encoding::utf8 : serial::encoding::utf32;
+        gopts.prefilter = !vm.count("no-prefilter");
+        gopts.alphabet = !vm.count("no-alphabet");
+        gopts.bitparallel = !vm.count("no-bitparallel");
+        gopts.mode = mode;
+        // loaded graphs skip parsing and lowering, options that went into them have to match this run
+        auto graph = load ? load_graph(load_graph_file) : string_to_graph(regexes_utf32, gopts);
+        if (load && graph.enc != gopts.encoding) {
+            throw user_error(graph.enc == serial::encoding::utf8 ? "the graph was compiled with --utf8, so it requires --utf8!" : "the graph was compiled without --utf8, so it does not work with --utf8!");
+        }
+        if (load && graph.mode != mode) {
+            throw user_error("the graph was compiled with a different --match-end!");
+        }
         if (vm.count("print-graph")) {
             print_graph(graph);
         }
+        if (vm.count("save-graph")) {
+            save_graph(graph, save_graph_file);
+            return EXIT_SUCCESS;
+        }
 
-        // set up OpenCL runner
-        oclrunner runner(eng, max_chunk_size, graph, vm.count("print-profile"));
+        std::shared_ptr<profile_sink> sink;
+        if (vm.count("profile-output")) {
+            sink = make_profile_sink(profile_format, profile_output);
+        }
 
-        // load file
-        auto fcontent_utf8 = readfile(file);
-        if (fcontent_utf8.empty()) {
-            throw user_error("Empty files cannot be processed!");
+        // set up engine and runner
+        std::unique_ptr<runner> r;
+        if (backend == "cpu") {
+            auto eng = std::make_shared<cpuengine>(threads);
+            r.reset(new cpurunner(eng, max_chunk_size, graph, vm.count("print-profile")));
+            r->set_profile_sink(sink, "cpu");
+        } else {
+            // one engine and runner per selected device
+            auto available = oclengine::available_devices();
+            if (available.empty()) {
+                throw user_error("no OpenCL devices found!");
+            }
+            std::vector<std::unique_ptr<runner>> runners;
+            for (const auto& dev : available) {
+                if ((platform_spec == "all" || platform_spec == std::to_string(dev.first)) && (device_spec == "all" || device_spec == std::to_string(dev.second))) {
+                    auto eng = std::make_shared<oclengine>(dev.first, dev.second, !vm.count("no-program-cache"));
+                    runners.emplace_back(new oclrunner(eng, max_chunk_size, graph, vm.count("print-profile"), pipeline_depth));
+                    runners.back()->set_profile_sink(sink, "opencl" + std::to_string(dev.first) + "." + std::to_string(dev.second));
+                }
+            }
+            if (runners.empty()) {
+                throw user_error("no OpenCL device matches --platform and --device (see --list-devices)!");
+            } else if (runners.size() == 1) {
+                r = std::move(runners[0]);
+            } else {
+                r.reset(new multirunner(std::move(runners), vm.count("print-profile")));
+            }
         }
 
-        // convert input dat
-        auto fcontent_utf32 = boost::locale::conv::utf_to_utf<char32_t>(fcontent_utf8);
-        if (vm.count("normalize-file")) {
-            // XXX: we'll have a problem with indices afterwards :(
-            fcontent_utf32 = boost::locale::conv::utf_to_utf<char32_t>(
-                boost::locale::normalize(
-                    boost::locale::conv::utf_to_utf<wchar_t>(fcontent_utf32),
-                    boost::locale::norm_nfkc
-                )
-            );
+        // matches must not get lost at chunk borders, so chunks need some lookahead
+        std::size_t overlap = overlap_for(graph, max_chunk_size, device_decode);
+
+        // collect files, names are printed as soon as there could be more than one
+        auto files = expand_paths(paths);
+        if (files.empty()) {
+            throw user_error("no files found!");
         }
+        output_options out;
+        out.print_output = !vm.count("no-output");
+        out.print_pattern = graph.n_patterns > 1;
+        out.print_ends = mode != serial::match_mode::starts;
+        out.non_overlapping = mode == serial::match_mode::non_overlapping;
+        out.print_names = paths.size() > 1 || files.size() > 1 || files[0] != paths[0];
+        if (vm.count("files-with-matches")) {
+            out.mode = output_mode::files;
+        } else if (vm.count("count")) {
+            out.mode = output_mode::count;
+        } else if (vm.count("lines") || vm.count("line-number")) {
+            out.mode = output_mode::lines;
+        }
+        out.print_line_numbers = vm.count("line-number") > 0;
+        // --utf8 and --device-decode report byte offsets anyway, the map is only maintained if it is used
+        out.byte_offsets = vm.count("byte-offsets") && !vm.count("utf8") && !device_decode && out.print_output && out.mode == output_mode::offsets;
+        threadpool io_pool(threads);
 
         // tada...
-        for (std::size_t offset = 0; offset < fcontent_utf32.size(); offset += max_chunk_size) {
-            std::size_t end = std::min(offset + max_chunk_size, fcontent_utf32.size());
-            std::u32string chunk(
-                std::next(fcontent_utf32.begin(), static_cast<long>(offset)),
-                std::next(fcontent_utf32.begin(), static_cast<long>(end))
-            );
-            auto result =  runner.run(chunk);
-
-            if (!vm.count("no-output")) {
-                for (const auto& idx : result) {
-                    std::cout << (offset + idx) << std::endl;
+        float t_ms;
+        std::size_t n_bytes;
+        if (vm.count("utf8") || device_decode) {
+            // bytes go straight to the engine
+            t_ms = search<std::string>(*r, files, io_pool, max_chunk_size, overlap, [&vm](const char* begin, const char* end, std::string& text, threadpool* /*pool*/, offset_map* /*map*/) {
+                if (vm.count("normalize-file")) {
+                    // XXX: we'll have a problem with indices afterwards :(
+                    text += boost::locale::conv::utf_to_utf<char>(
+                        boost::locale::normalize(
+                            boost::locale::conv::utf_to_utf<wchar_t>(begin, end),
+                            boost::locale::norm_nfkc
+                        )
+                    );
+                } else {
+                    text.append(begin, end);
                 }
-            }
+            }, out, n_bytes);
+        } else {
+            // convert input data
+            t_ms = search<std::u32string>(*r, files, io_pool, max_chunk_size, overlap, [&vm](const char* begin, const char* end, std::u32string& text, threadpool* pool, offset_map* map) {
+                if (vm.count("normalize-file")) {
+                    // XXX: we'll have a problem with indices afterwards :(
+                    text += boost::locale::conv::utf_to_utf<char32_t>(
+                        boost::locale::normalize(
+                            boost::locale::conv::utf_to_utf<wchar_t>(begin, end),
+                            boost::locale::norm_nfkc
+                        )
+                    );
+                    return;
+                }
+                append_utf32(text, begin, end, pool, map);
+            }, out, n_bytes);
+        }
+
+        if (sink) {
+            sink->finish(t_ms, n_bytes);
+        }
+        if (vm.count("print-profile")) {
+            // throughput including reading and converting the input, so backends can be compared
+            std::cout << "Total (backend=" << backend << "):" << std::endl
+                << "  time               = " << t_ms << "ms" << std::endl
+                << "  throughput         = " << (static_cast<float>(n_bytes) / (t_ms * 1000.f)) << "MB/s (input)" << std::endl;
         }
     } catch (user_error& e) {
         std::cerr << e.what() << std::endl;
@@ -0,0 +1,127 @@
+#include <algorithm>
+#include <iostream>
+
+#include "common.hpp"
+#include "multirunner.hpp"
+
+multirunner::multirunner(std::vector<std::unique_ptr<runner>> runners, bool printProfile) : printProfile(printProfile) {
+    sanity_assert(!runners.empty(), "at least one runner is required");
+    for (auto& r : runners) {
+        workers.push_back(worker{std::move(r), 0, 0.0, clock::now(), 0, 0});
+    }
+}
+
+multirunner::~multirunner() {
+    if (printProfile) {
+        std::cout << "Scheduler:" << std::endl;
+        for (std::size_t i = 0; i < workers.size(); ++i) {
+            const auto& w = workers[i];
+            std::cout << "  runner" << i << "            = " << w.n_chunks << " chunks, " << w.n_elements << " elements, " << (w.throughput / (1000.0 * 1000.0)) << "M elements/s" << std::endl;
+        }
+    }
+}
+
+std::vector<match> multirunner::run(const std::u32string& chunk) {
+    sanity_assert(pending() == 0, "cannot mix run and enqueue");
+    enqueue(chunk);
+    return wait();
+}
+
+std::vector<match> multirunner::run(const std::string& chunk) {
+    sanity_assert(pending() == 0, "cannot mix run and enqueue");
+    enqueue(chunk);
+    return wait();
+}
+
+void multirunner::enqueue(const std::u32string& chunk) {
+    auto idx = pick(chunk.size());
+    workers[idx].r->enqueue(chunk);
+    submitted(idx, chunk.size());
+}
+
+void multirunner::enqueue(const std::string& chunk) {
+    auto idx = pick(chunk.size());
+    workers[idx].r->enqueue(chunk);
+    submitted(idx, chunk.size());
+}
+
+std::vector<match> multirunner::wait() {
+    sanity_assert(!inflight.empty(), "no chunk was submitted");
+    auto sub = inflight.front();
+    inflight.pop_front();
+
+    // every runner returns its results in order, so the next result of this runner belongs to the oldest chunk
+    auto& w = workers[sub.worker];
+    auto result = w.r->wait();
+    auto t_done = clock::now();
+
+    // the runner started on this chunk when it was submitted or when the previous one was done, whatever was later
+    auto t_begin = std::max(sub.t_enqueue, w.busy_until);
+    double seconds = std::chrono::duration<double>(t_done - t_begin).count();
+    if (seconds > 0.0) {
+        double sample = static_cast<double>(sub.size) / seconds;
+        w.throughput = (w.throughput == 0.0) ? sample : 0.5 * w.throughput + 0.5 * sample;
+    }
+    w.busy_until = t_done;
+    w.queued_elements -= sub.size;
+
+    return result;
+}
+
+std::size_t multirunner::pending() const {
+    return inflight.size();
+}
+
+std::size_t multirunner::depth() const {
+    std::size_t result = 0;
+    for (const auto& w : workers) {
+        result += w.r->depth();
+    }
+    return result;
+}
+
+stage_times multirunner::stages() const {
+    // devices work in parallel, so this is the summed up device time
+    stage_times result;
+    for (const auto& w : workers) {
+        for (const auto& kv : w.r->stages()) {
+            result[kv.first] += kv.second;
+        }
+    }
+    return result;
+}
+
+std::size_t multirunner::pick(std::size_t size) const {
+    // runners without measurements are assumed to be average (or all equal if nothing was measured yet)
+    double sum = 0.0;
+    std::size_t n_measured = 0;
+    for (const auto& w : workers) {
+        if (w.throughput > 0.0) {
+            sum += w.throughput;
+            n_measured += 1;
+        }
+    }
+    double fallback = (n_measured > 0) ? sum / static_cast<double>(n_measured) : 1.0;
+
+    // pick the earliest expected completion
+    std::size_t best = 0;
+    double best_time = 0.0;
+    for (std::size_t i = 0; i < workers.size(); ++i) {
+        const auto& w = workers[i];
+        double throughput = (w.throughput > 0.0) ? w.throughput : fallback;
+        double t = static_cast<double>(w.queued_elements + size) / throughput;
+        if (i == 0 || t < best_time) {
+            best = i;
+            best_time = t;
+        }
+    }
+    return best;
+}
+
+void multirunner::submitted(std::size_t idx, std::size_t size) {
+    auto& w = workers[idx];
+    w.queued_elements += size;
+    w.n_chunks += 1;
+    w.n_elements += size;
+    inflight.push_back(submission{idx, size, clock::now()});
+}
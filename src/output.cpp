@@ -0,0 +1,241 @@
+#include <iostream>
+
+#include <boost/locale.hpp>
+
+#include "common.hpp"
+#include "config.hpp"
+#include "output.hpp"
+
+// flush threshold of the output buffer
+constexpr std::size_t output_buffer_size = 64 * 1024;
+
+void append_utf8(std::string& out, const std::string& text, std::size_t begin, std::size_t end) {
+    out.append(text, begin, end - begin);
+}
+
+void append_utf8(std::string& out, const std::u32string& text, std::size_t begin, std::size_t end) {
+    out += boost::locale::conv::utf_to_utf<char>(text.data() + begin, text.data() + end);
+}
+
+// first element at or after pos that starts a codepoint
+std::size_t codepoint_start(const std::string& text, std::size_t pos) {
+    while (pos < text.size() && (static_cast<unsigned char>(text[pos]) & 0xc0) == 0x80) {
+        ++pos;
+    }
+    return pos;
+}
+
+std::size_t codepoint_start(const std::u32string& /*text*/, std::size_t pos) {
+    return pos;
+}
+
+template <typename S>
+output_writer<S>::output_writer(const std::vector<std::string>& files, const output_options& opts, offset_map* bytes) : files(files), opts(opts), bytes(bytes), next_free(0), line_matched(false), line_cut(false), line_number(1), matched_lines(0) {}
+
+template <typename S>
+void output_writer<S>::begin_file(std::size_t offset, std::size_t idx, std::size_t byte) {
+    boundaries.push_back(file_start{offset, byte, idx});
+}
+
+template <typename S>
+bool output_writer<S>::needs_text() const {
+    return opts.print_output && opts.mode != output_mode::offsets;
+}
+
+template <typename S>
+std::vector<std::uint32_t> output_writer<S>::index_lines(const S& text, std::size_t size) {
+    std::vector<std::uint32_t> result;
+    const auto separator = stream_separator<S>();
+    for (std::size_t i = 0; i < size; ++i) {
+        if (text[i] == '\n' || text[i] == separator) {
+            result.push_back(static_cast<std::uint32_t>(i));
+        }
+    }
+    return result;
+}
+
+template <typename S>
+void output_writer<S>::process(std::size_t offset, std::size_t size, const S& text, const std::vector<std::uint32_t>& breaks, const std::vector<match>& matches) {
+    if (!opts.print_output) {
+        return;
+    }
+
+    if (opts.mode == output_mode::offsets) {
+        auto report = [&](const match& m) {
+            // matches are sorted, so passed files are not required anymore
+            std::size_t global = offset + m.offset;
+            while (boundaries.size() > 1 && boundaries[1].offset <= global) {
+                boundaries.pop_front();
+            }
+            write_prefix();
+            buffer += std::to_string(file_offset(global));
+            if (opts.print_ends) {
+                buffer += ' ';
+                buffer += std::to_string(file_offset(offset + m.end));
+            }
+            if (opts.print_pattern) {
+                buffer += ' ';
+                buffer += std::to_string(m.pattern);
+            }
+            buffer += '\n';
+            flush_if_full();
+        };
+        if (opts.non_overlapping) {
+            // regions come in stream order, so the matches a pick overlaps are dropped across chunks as well
+            pick_non_overlapping(matches, offset, size, next_free, report);
+        } else {
+            for (std::size_t i = 0; i < matches.size() && matches[i].offset < size; ++i) {
+                report(matches[i]);
+            }
+        }
+
+        // later regions only report matches that start behind this one
+        if (opts.byte_offsets) {
+            bytes->drop_before(offset + size);
+        }
+        return;
+    }
+
+    // walk over all line breaks, a line matches if a match starts within it (or at its newline)
+    const auto separator = stream_separator<S>();
+    std::size_t pos = 0;
+    auto it = matches.begin();
+    for (auto b : breaks) {
+        bool matched = false;
+        for (; it != matches.end() && it->offset <= b && it->offset < size; ++it) {
+            matched = true;
+        }
+        if (matched) {
+            match_line();
+        }
+        if (opts.mode == output_mode::lines) {
+            append_line(text, pos, b);
+        }
+        end_line();
+        if (text[b] == separator) {
+            end_file();
+        }
+        pos = b + 1;
+    }
+    if (it != matches.end() && it->offset < size) {
+        match_line();
+    }
+
+    // the rest of the line continues in the next region
+    if (opts.mode == output_mode::lines) {
+        append_line(text, pos, size);
+    }
+}
+
+template <typename S>
+void output_writer<S>::finish() {
+    if (opts.print_output && !boundaries.empty()) {
+        if (opts.mode != output_mode::offsets) {
+            end_line();
+            end_file();
+        }
+    }
+    flush();
+}
+
+template <typename S>
+void output_writer<S>::flush() {
+    std::cout.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    std::cout.flush();
+    buffer.clear();
+}
+
+template <typename S>
+void output_writer<S>::match_line() {
+    if (line_matched) {
+        return;
+    }
+    line_matched = true;
+    if (opts.mode == output_mode::lines) {
+        write_prefix();
+        if (opts.print_line_numbers) {
+            buffer += std::to_string(line_number);
+            buffer += ':';
+        }
+        if (line_cut) {
+            buffer += "...";
+        }
+        append_utf8(buffer, line, 0, line.size());
+        line.clear();
+        flush_if_full();
+    }
+}
+
+template <typename S>
+void output_writer<S>::append_line(const S& text, std::size_t begin, std::size_t end) {
+    if (line_matched) {
+        append_utf8(buffer, text, begin, end);
+        flush_if_full();
+        return;
+    }
+    line.append(text, begin, end - begin);
+    if (line.size() > 2 * cfg::max_line_length) {
+        line.erase(0, codepoint_start(line, line.size() - cfg::max_line_length));
+        line_cut = true;
+    }
+}
+
+template <typename S>
+void output_writer<S>::end_line() {
+    if (line_matched) {
+        matched_lines += 1;
+        if (opts.mode == output_mode::lines) {
+            buffer += '\n';
+            flush_if_full();
+        }
+    }
+    line.clear();
+    line_matched = false;
+    line_cut = false;
+    line_number += 1;
+}
+
+template <typename S>
+void output_writer<S>::end_file() {
+    sanity_assert(!boundaries.empty(), "file ends before it began");
+    if (opts.mode == output_mode::count) {
+        write_prefix();
+        buffer += std::to_string(matched_lines);
+        buffer += '\n';
+    } else if (opts.mode == output_mode::files && matched_lines > 0) {
+        buffer += files[boundaries.front().idx];
+        buffer += '\n';
+    }
+    flush_if_full();
+
+    boundaries.pop_front();
+    line_number = 1;
+    matched_lines = 0;
+}
+
+template <typename S>
+std::size_t output_writer<S>::file_offset(std::size_t global) const {
+    if (opts.byte_offsets) {
+        return bytes->byte_offset(global) - boundaries.front().byte;
+    }
+    return global - boundaries.front().offset;
+}
+
+template <typename S>
+void output_writer<S>::write_prefix() {
+    if (opts.print_names) {
+        buffer += files[boundaries.front().idx];
+        buffer += ':';
+    }
+}
+
+template <typename S>
+void output_writer<S>::flush_if_full() {
+    if (buffer.size() >= output_buffer_size) {
+        std::cout.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        buffer.clear();
+    }
+}
+
+template class output_writer<std::string>;
+template class output_writer<std::u32string>;
@@ -0,0 +1,74 @@
+#include <cstring>
+#include <cwchar>
+
+#include <algorithm>
+
+#include "config.hpp"
+#include "prefilter.hpp"
+
+const char* find_element(const char* begin, const char* end, char c) {
+    auto result = static_cast<const char*>(std::memchr(begin, c, static_cast<std::size_t>(end - begin)));
+    return result ? result : end;
+}
+
+const char32_t* find_element(const char32_t* begin, const char32_t* end, char32_t c) {
+    // wchar_t is UTF32 (see common.hpp)
+    auto result = std::wmemchr(reinterpret_cast<const wchar_t*>(begin), static_cast<wchar_t>(c), static_cast<std::size_t>(end - begin));
+    return result ? reinterpret_cast<const char32_t*>(result) : end;
+}
+
+template <typename S>
+bool find_candidates_impl(const serial::graph& graph, const S& text, std::vector<std::uint32_t>& candidates) {
+    using element_t = typename S::value_type;
+    const auto& lit = graph.prefilter;
+    if (lit.elements.empty()) {
+        return false;
+    }
+
+    // literal in the element type of the text
+    S needle;
+    for (auto c : lit.elements) {
+        needle.push_back(static_cast<element_t>(c));
+    }
+
+    const std::size_t max_candidates = text.size() / cfg::min_selectivity;
+    const element_t* begin = text.data();
+    const element_t* end = text.data() + text.size();
+    std::size_t next_free = 0; // first position that is not a candidate yet
+
+    candidates.clear();
+    for (const element_t* p = find_element(begin, end, needle[0]); p != end; p = find_element(p + 1, end, needle[0])) {
+        if (static_cast<std::size_t>(end - p) < needle.size()) {
+            break;
+        }
+        if (std::memcmp(p, needle.data(), needle.size() * sizeof(element_t)) != 0) {
+            continue;
+        }
+
+        // every position in this window could start a match that contains this occurrence
+        std::size_t occurrence = static_cast<std::size_t>(p - begin);
+        if (occurrence < lit.min_offset) {
+            continue;
+        }
+        std::size_t hi = occurrence - lit.min_offset;
+        std::size_t lo = (lit.max_offset == serial::unbounded || lit.max_offset > occurrence) ? 0 : occurrence - lit.max_offset;
+        for (std::size_t pos = std::max(lo, next_free); pos <= hi; ++pos) {
+            candidates.push_back(static_cast<std::uint32_t>(pos));
+        }
+        next_free = std::max(next_free, hi + 1);
+
+        if (candidates.size() > max_candidates) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool find_candidates(const serial::graph& graph, const std::u32string& text, std::vector<std::uint32_t>& candidates) {
+    return find_candidates_impl(graph, text, candidates);
+}
+
+bool find_candidates(const serial::graph& graph, const std::string& text, std::vector<std::uint32_t>& candidates) {
+    return find_candidates_impl(graph, text, candidates);
+}
@@ -0,0 +1,174 @@
+#include <algorithm>
+
+#include "common.hpp"
+#include "profile.hpp"
+
+const char* stage_name(profile_stage s) {
+    switch (s) {
+        case profile_stage::prefilter: return "prefilter";
+        case profile_stage::map_classes: return "mapClasses";
+        case profile_stage::upload_text: return "uploadText";
+        case profile_stage::upload_flags: return "uploadFlags";
+        case profile_stage::kernel_decode_count: return "kernelDecodeCount";
+        case profile_stage::kernel_decode_scan: return "kernelDecodeScan";
+        case profile_stage::kernel_decode_write: return "kernelDecodeWrite";
+        case profile_stage::upload_unfinished_n: return "uploadUnfinishedN";
+        case profile_stage::upload_starts: return "uploadStarts";
+        case profile_stage::upload_matches_n: return "uploadMatchesN";
+        case profile_stage::kernel_automaton: return "kernelAutomaton";
+        case profile_stage::kernel_bitparallel: return "kernelBitparallel";
+        case profile_stage::kernel_count: return "kernelCount";
+        case profile_stage::kernel_scan_tiles: return "kernelScanTiles";
+        case profile_stage::kernel_compact: return "kernelCompact";
+        case profile_stage::kernel_compact_ends: return "kernelCompactEnds";
+        case profile_stage::kernel_to_bytes: return "kernelToBytes";
+        case profile_stage::kernel_to_bytes_ends: return "kernelToBytesEnds";
+        case profile_stage::match_text: return "matchText";
+        case profile_stage::match_bitparallel: return "matchBitparallel";
+        case profile_stage::download_output_size: return "downloadOutputSize";
+        case profile_stage::download_matches_n: return "downloadMatchesN";
+        case profile_stage::download_output: return "downloadOutput";
+        case profile_stage::download_ends: return "downloadEnds";
+        case profile_stage::download_unfinished_n: return "downloadUnfinishedN";
+        case profile_stage::download_unfinished: return "downloadUnfinished";
+        case profile_stage::download_seg_state: return "downloadSegState";
+        case profile_stage::download_flags: return "downloadFlags";
+        case profile_stage::retry_host: return "retryHost";
+        case profile_stage::fixup_host: return "fixupHost";
+    }
+    return "unknown";
+}
+
+void profile_sink::record(const chunk_profile& p) {
+    std::lock_guard<std::mutex> lock(m);
+
+    total.elements += p.elements;
+    total.candidates += p.candidates;
+    total.matches += p.matches;
+    total.retried += p.retried;
+    total.bytes_up += p.bytes_up;
+    total.bytes_down += p.bytes_down;
+    total.flag_iter_max = total.flag_iter_max || p.flag_iter_max;
+    total.flag_stack_full = total.flag_stack_full || p.flag_stack_full;
+    total.flag_matches_full = total.flag_matches_full || p.flag_matches_full;
+    for (const auto& s : p.stages) {
+        auto it = std::find_if(total.stages.begin(), total.stages.end(), [&](const std::pair<std::string, float>& t) {
+            return t.first == s.first;
+        });
+        if (it == total.stages.end()) {
+            total.stages.push_back(s);
+        } else {
+            it->second += s.second;
+        }
+    }
+
+    write_chunk(n_chunks, p);
+    n_chunks += 1;
+}
+
+void profile_sink::finish(float t_ms, std::size_t n_bytes) {
+    std::lock_guard<std::mutex> lock(m);
+    write_total(t_ms, n_bytes);
+    finished = true;
+}
+
+// runner names and stage names are plain identifiers, so no escaping is required
+class json_sink : public profile_sink {
+    public:
+        explicit json_sink(const std::string& fname) : out(fname) {
+            if (!out) {
+                throw user_error("cannot open profile output " + fname);
+            }
+            out << "{\"chunks\":[";
+        }
+
+        ~json_sink() override {
+            // the search failed, the document stays valid, but has no aggregate
+            if (!finished) {
+                out << "\n],\"total\":null}" << std::endl;
+            }
+        }
+
+    protected:
+        void write_chunk(std::size_t idx, const chunk_profile& p) override {
+            out << (idx == 0 ? "\n" : ",\n") << "  {\"chunk\":" << idx << ",";
+            write_fields(p);
+            out << "}";
+        }
+
+        void write_total(float t_ms, std::size_t n_bytes) override {
+            out << "\n],\"total\":{\"chunks\":" << n_chunks << ",\"time_ms\":" << t_ms << ",\"input_bytes\":" << n_bytes
+                << ",\"throughput_mbps\":" << (static_cast<float>(n_bytes) / (t_ms * 1000.f)) << ",";
+            write_fields(total);
+            out << "}}" << std::endl;
+        }
+
+    private:
+        std::ofstream out;
+
+        void write_fields(const chunk_profile& p) {
+            out << "\"runner\":\"" << p.runner << "\",\"elements\":" << p.elements << ",\"candidates\":" << p.candidates
+                << ",\"matches\":" << p.matches << ",\"retried\":" << p.retried << ",\"bytes_up\":" << p.bytes_up << ",\"bytes_down\":" << p.bytes_down
+                << ",\"flag_iter_max\":" << (p.flag_iter_max ? "true" : "false")
+                << ",\"flag_stack_full\":" << (p.flag_stack_full ? "true" : "false")
+                << ",\"flag_matches_full\":" << (p.flag_matches_full ? "true" : "false")
+                << ",\"stages_ms\":{";
+            for (std::size_t i = 0; i < p.stages.size(); ++i) {
+                out << (i == 0 ? "" : ",") << "\"" << p.stages[i].first << "\":" << p.stages[i].second;
+            }
+            out << "}";
+        }
+};
+
+class csv_sink : public profile_sink {
+    public:
+        explicit csv_sink(const std::string& fname) : out(fname) {
+            if (!out) {
+                throw user_error("cannot open profile output " + fname);
+            }
+            out << "chunk,runner,elements,candidates,matches,retried,bytes_up,bytes_down,flag_iter_max,flag_stack_full,flag_matches_full";
+            for (std::size_t i = 0; i < n_profile_stages; ++i) {
+                out << "," << stage_name(static_cast<profile_stage>(i)) << "_ms";
+            }
+            out << ",time_ms,input_bytes,throughput_mbps" << std::endl;
+        }
+
+    protected:
+        void write_chunk(std::size_t idx, const chunk_profile& p) override {
+            out << idx << ",";
+            write_fields(p);
+            out << ",,," << "\n";
+        }
+
+        void write_total(float t_ms, std::size_t n_bytes) override {
+            out << "total,";
+            write_fields(total);
+            out << "," << t_ms << "," << n_bytes << "," << (static_cast<float>(n_bytes) / (t_ms * 1000.f)) << std::endl;
+        }
+
+    private:
+        std::ofstream out;
+
+        void write_fields(const chunk_profile& p) {
+            out << p.runner << "," << p.elements << "," << p.candidates << "," << p.matches << "," << p.retried << "," << p.bytes_up << "," << p.bytes_down
+                << "," << p.flag_iter_max << "," << p.flag_stack_full << "," << p.flag_matches_full;
+            for (std::size_t i = 0; i < n_profile_stages; ++i) {
+                out << ",";
+                for (const auto& s : p.stages) {
+                    if (s.first == stage_name(static_cast<profile_stage>(i))) {
+                        out << s.second;
+                    }
+                }
+            }
+        }
+};
+
+std::unique_ptr<profile_sink> make_profile_sink(const std::string& format, const std::string& fname) {
+    if (format == "json") {
+        return std::unique_ptr<profile_sink>(new json_sink(fname));
+    } else if (format == "csv") {
+        return std::unique_ptr<profile_sink>(new csv_sink(fname));
+    } else {
+        throw user_error("unknown profile format, use \"json\" or \"csv\"!");
+    }
+}
@@ -2,6 +2,9 @@
 
 #include <algorithm>
 #include <exception>
+#include <functional>
+#include <limits>
+#include <map>
 #include <set>
 #include <sstream>
 #include <string>
@@ -170,6 +173,85 @@ namespace graph {
     };
     using node_t = std::shared_ptr<node>;
     using graph_t = std::vector<node_t>;
+
+    // ids of the accept nodes, a single pattern uses OK, multiple patterns get their own nodes right after BEGIN
+    struct accept_range {
+        std::uint32_t base;
+        std::uint32_t n;
+
+        explicit accept_range(std::size_t n_patterns) : base(n_patterns == 1 ? serial::id_ok : serial::id_begin + 1), n(static_cast<std::uint32_t>(n_patterns)) {}
+
+        bool contains(std::uint32_t x) const {
+            return x >= base && x - base < n;
+        }
+    };
+
+    // inclusive character range and the states it leads to
+    struct transition {
+        char32_t begin;
+        char32_t end;
+        std::vector<std::uint32_t> targets;
+    };
+
+    // returns all ranges of a node that lead to at least one state (FAIL entries are dropped)
+    std::vector<transition> get_transitions(const node& n) {
+        std::vector<transition> result;
+        for (std::size_t i = 0; i + 1 < n.next.size(); ++i) {
+            transition t{std::get<0>(n.next[i]), std::get<0>(n.next[i + 1]) - 1, {}};
+            for (auto target : *std::get<1>(n.next[i])) {
+                if (target != serial::id_fail) {
+                    t.targets.push_back(target);
+                }
+            }
+            if (!t.targets.empty()) {
+                result.push_back(t);
+            }
+        }
+        return result;
+    }
+
+    // splits (potentially overlapping) transitions into the sorted, disjoint layout nodes use
+    void set_transitions(node& n, const std::vector<transition>& transitions) {
+        n.next.clear();
+        if (transitions.empty()) {
+            return;
+        }
+
+        // 1. collect range boundaries
+        std::vector<std::uint64_t> boundaries;
+        for (const auto& t : transitions) {
+            boundaries.push_back(t.begin);
+            boundaries.push_back(static_cast<std::uint64_t>(t.end) + 1);
+        }
+        std::sort(boundaries.begin(), boundaries.end());
+        boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+
+        // 2. emit one slot per interval, merge neighbors that lead to the same states
+        if (boundaries[0] > 0) {
+            n.next.push_back(std::make_pair(0, make_slot({serial::id_fail})));
+        }
+        for (std::size_t i = 0; i + 1 < boundaries.size(); ++i) {
+            std::vector<std::uint32_t> targets;
+            for (const auto& t : transitions) {
+                if (t.begin <= boundaries[i] && boundaries[i] <= t.end) {
+                    targets.insert(targets.end(), t.targets.begin(), t.targets.end());
+                }
+            }
+            std::sort(targets.begin(), targets.end());
+            targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+            if (targets.empty()) {
+                targets.push_back(serial::id_fail);
+            }
+
+            if (!n.next.empty() && *std::get<1>(n.next[n.next.size() - 1]) == targets) {
+                continue;
+            }
+            n.next.push_back(std::make_pair(static_cast<char32_t>(boundaries[i]), std::make_shared<slot_inner_t>(targets)));
+        }
+        if (boundaries[boundaries.size() - 1] <= std::numeric_limits<char32_t>::max()) {
+            n.next.push_back(std::make_pair(static_cast<char32_t>(boundaries[boundaries.size() - 1]), make_slot({serial::id_fail})));
+        }
+    }
 }
 
 
@@ -425,6 +507,523 @@ graph::graph_t ast_to_graph(const ast::regex& r) {
 }
 
 
+graph::graph_t merge_patterns(const std::vector<graph::graph_t>& patterns) {
+    // layout: FAIL, OK (unused), BEGIN, one accept node per pattern, nodes of all patterns
+    // the original BEGIN nodes are kept since they might be loop targets, the new BEGIN gets a copy of their transitions
+    graph::accept_range accepts(patterns.size());
+    std::uint32_t id = 0;
+    graph::graph_t nodes;
+    while (id < accepts.base + accepts.n) {
+        nodes.push_back(std::make_shared<graph::node>(id));
+    }
+
+    std::vector<graph::transition> transitions_begin;
+    for (std::uint32_t i_pattern = 0; i_pattern < patterns.size(); ++i_pattern) {
+        const auto& pattern = patterns[i_pattern];
+        std::uint32_t base = id;
+        auto remap = [&](std::uint32_t x) {
+            if (x == serial::id_ok) {
+                return accepts.base + i_pattern;
+            } else {
+                return base + x - serial::id_begin;
+            }
+        };
+
+        for (std::size_t i_node = serial::id_begin; i_node < pattern.size(); ++i_node) {
+            nodes.push_back(std::make_shared<graph::node>(id));
+        }
+        for (std::size_t i_node = serial::id_begin; i_node < pattern.size(); ++i_node) {
+            auto transitions = graph::get_transitions(*pattern[i_node]);
+            for (auto& t : transitions) {
+                std::transform(t.targets.begin(), t.targets.end(), t.targets.begin(), remap);
+            }
+            graph::set_transitions(*nodes[remap(static_cast<std::uint32_t>(i_node))], transitions);
+            if (i_node == serial::id_begin) {
+                transitions_begin.insert(transitions_begin.end(), transitions.begin(), transitions.end());
+            }
+        }
+    }
+    graph::set_transitions(*nodes[serial::id_begin], transitions_begin);
+
+    sanity_assert(id == nodes.size(), "Some nodes are lost :(");
+    return nodes;
+}
+
+
+namespace utf8 {
+    using byte_range = std::pair<std::uint8_t, std::uint8_t>;
+    using sequence = std::vector<byte_range>;
+
+    constexpr char32_t max_codepoint = 0x10ffff;
+
+    std::size_t encoded_length(char32_t c) {
+        if (c <= 0x7f) {
+            return 1;
+        } else if (c <= 0x7ff) {
+            return 2;
+        } else if (c <= 0xffff) {
+            return 3;
+        } else {
+            return 4;
+        }
+    }
+
+    std::vector<std::uint8_t> encode(char32_t c) {
+        switch (encoded_length(c)) {
+            case 1:
+                return {static_cast<std::uint8_t>(c)};
+            case 2:
+                return {
+                    static_cast<std::uint8_t>(0xc0 | (c >> 6)),
+                    static_cast<std::uint8_t>(0x80 | (c & 0x3f))
+                };
+            case 3:
+                return {
+                    static_cast<std::uint8_t>(0xe0 | (c >> 12)),
+                    static_cast<std::uint8_t>(0x80 | ((c >> 6) & 0x3f)),
+                    static_cast<std::uint8_t>(0x80 | (c & 0x3f))
+                };
+            default:
+                return {
+                    static_cast<std::uint8_t>(0xf0 | (c >> 18)),
+                    static_cast<std::uint8_t>(0x80 | ((c >> 12) & 0x3f)),
+                    static_cast<std::uint8_t>(0x80 | ((c >> 6) & 0x3f)),
+                    static_cast<std::uint8_t>(0x80 | (c & 0x3f))
+                };
+        }
+    }
+
+    // splits a codepoint range into byte sequences where every byte position is a simple range
+    // (same algorithm as RE2 and Rust's utf8-ranges)
+    void sequences(char32_t begin, char32_t end, std::vector<sequence>& result) {
+        end = std::min(end, max_codepoint);
+        if (begin > end) {
+            return;
+        }
+
+        // surrogates are no valid codepoints
+        if (begin <= 0xdfff && end >= 0xd800) {
+            if (begin < 0xd800) {
+                sequences(begin, 0xd7ff, result);
+            }
+            if (end > 0xdfff) {
+                sequences(0xe000, end, result);
+            }
+            return;
+        }
+
+        // split at encoding length boundaries
+        for (char32_t max_n : {0x7fu, 0x7ffu, 0xffffu}) {
+            if (begin <= max_n && max_n < end) {
+                sequences(begin, max_n, result);
+                sequences(max_n + 1, end, result);
+                return;
+            }
+        }
+
+        // split until all continuation bytes cover complete ranges
+        std::size_t len = encoded_length(begin);
+        for (std::size_t i = 1; i < len; ++i) {
+            char32_t m = (static_cast<char32_t>(1) << (6 * i)) - 1;
+            if ((begin & ~m) != (end & ~m)) {
+                if ((begin & m) != 0) {
+                    sequences(begin, begin | m, result);
+                    sequences((begin | m) + 1, end, result);
+                    return;
+                }
+                if ((end & m) != m) {
+                    sequences(begin, (end & ~m) - 1, result);
+                    sequences(end & ~m, end, result);
+                    return;
+                }
+            }
+        }
+
+        auto enc_begin = encode(begin);
+        auto enc_end = encode(end);
+        sequence seq;
+        for (std::size_t i = 0; i < len; ++i) {
+            seq.push_back(std::make_pair(enc_begin[i], enc_end[i]));
+        }
+        result.push_back(seq);
+    }
+}
+
+
+namespace literals {
+    using repetition = std::pair<std::size_t, std::size_t>; // min, max (can be unbounded)
+
+    class multiplier_visitor : public boost::static_visitor<repetition> {
+        public:
+            repetition operator()(const ast::multiplier_amount& amount) const {
+                return {amount, amount};
+            }
+
+            repetition operator()(const ast::multiplier_range& range) const {
+                return {range.min ? *range.min : 0, range.max ? *range.max : serial::unbounded};
+            }
+
+            repetition operator()(const ast::multiplier_plus& /*plus*/) const {
+                return {1, serial::unbounded};
+            }
+
+            repetition operator()(const ast::multiplier_question& /*question*/) const {
+                return {0, 1};
+            }
+
+            repetition operator()(const ast::multiplier_star& /*star*/) const {
+                return {0, serial::unbounded};
+            }
+    };
+
+    std::size_t element_count(char32_t c, serial::encoding enc) {
+        return (enc == serial::encoding::utf8) ? utf8::encoded_length(std::min(c, utf8::max_codepoint)) : 1;
+    }
+
+    // minimum and maximum number of elements a single repetition of the chunk content spans
+    class length_visitor : public boost::static_visitor<repetition> {
+        public:
+            length_visitor(serial::encoding enc) : enc(enc) {}
+
+            repetition operator()(const ast::word& word) const {
+                std::size_t n = 0;
+                for (auto c : word) {
+                    n += element_count(c, enc);
+                }
+                return {n, n};
+            }
+
+            repetition operator()(const ast::characterclass& characterclass) const {
+                repetition result{serial::unbounded, 0};
+                for (const auto& x : characterclass) {
+                    auto r = boost::apply_visitor(transformers::characterclass_element_visitor(), x);
+                    result.first = std::min(result.first, element_count(r.begin, enc));
+                    result.second = std::max(result.second, element_count(r.end, enc));
+                }
+                return result;
+            }
+
+        private:
+            serial::encoding enc;
+    };
+
+    std::size_t add(std::size_t a, std::size_t b) {
+        return (a == serial::unbounded || b == serial::unbounded) ? serial::unbounded : a + b;
+    }
+
+    std::size_t mul(std::size_t a, std::size_t b) {
+        return (a == serial::unbounded || b == serial::unbounded) ? serial::unbounded : a * b;
+    }
+
+    // finds the best literal that every match must contain (prefers bounded offsets, then longer literals)
+    serial::literal find_required(const ast::regex& r, serial::encoding enc) {
+        serial::literal best;
+        serial::literal current;
+        bool current_open = false; // can the next chunk extend the current literal?
+        std::size_t min_offset = 0;
+        std::size_t max_offset = 0;
+
+        for (const auto& chunk : r) {
+            repetition rep{1, 1};
+            if (chunk.amount) {
+                rep = boost::apply_visitor(multiplier_visitor(), *chunk.amount);
+            }
+            auto len = boost::apply_visitor(length_visitor(enc), chunk.content);
+
+            const auto* word = boost::get<ast::word>(&chunk.content);
+            if (word && rep.first >= 1) {
+                // the first repetition of the word starts directly at the current offset
+                if (!current_open) {
+                    current = serial::literal();
+                    current.min_offset = min_offset;
+                    current.max_offset = max_offset;
+                }
+                for (auto c : *word) {
+                    if (enc == serial::encoding::utf8) {
+                        for (auto b : utf8::encode(std::min(c, utf8::max_codepoint))) {
+                            current.elements.push_back(b);
+                        }
+                    } else {
+                        current.elements.push_back(c);
+                    }
+                }
+
+                bool current_bounded = current.max_offset != serial::unbounded;
+                bool best_bounded = best.max_offset != serial::unbounded;
+                if (best.elements.empty()
+                        || (current_bounded && !best_bounded)
+                        || (current_bounded == best_bounded && current.elements.size() > best.elements.size())) {
+                    best = current;
+                }
+
+                current_open = (rep.first == 1 && rep.second == 1);
+            } else {
+                current_open = false;
+            }
+
+            min_offset = add(min_offset, mul(rep.first, len.first));
+            max_offset = add(max_offset, mul(rep.second, len.second));
+        }
+
+        return best;
+    }
+}
+
+
+graph::graph_t lower_to_utf8(const graph::graph_t& g) {
+    // every node keeps its id and transitions on the first byte of each codepoint, continuation bytes get new nodes
+    // that are shared between all sequences with the same tail
+    graph::graph_t nodes;
+    for (std::uint32_t i = 0; i < g.size(); ++i) {
+        std::uint32_t id_i = i;
+        nodes.push_back(std::make_shared<graph::node>(id_i));
+    }
+    std::uint32_t id = static_cast<std::uint32_t>(g.size());
+
+    std::map<std::pair<utf8::byte_range, std::vector<std::uint32_t>>, std::uint32_t> tails;
+    auto get_tail = [&](const utf8::byte_range& r, const std::vector<std::uint32_t>& targets) {
+        auto key = std::make_pair(r, targets);
+        auto it = tails.find(key);
+        if (it != tails.end()) {
+            return it->second;
+        }
+        auto tail = std::make_shared<graph::node>(id);
+        graph::set_transitions(*tail, {graph::transition{r.first, r.second, targets}});
+        nodes.push_back(tail);
+        tails[key] = tail->id;
+        return tail->id;
+    };
+
+    for (std::size_t i_node = 0; i_node < g.size(); ++i_node) {
+        std::vector<graph::transition> transitions;
+        for (const auto& t : graph::get_transitions(*g[i_node])) {
+            std::vector<utf8::sequence> seqs;
+            utf8::sequences(t.begin, t.end, seqs);
+            for (const auto& seq : seqs) {
+                // build chain backwards
+                std::vector<std::uint32_t> targets = t.targets;
+                for (std::size_t i = seq.size() - 1; i > 0; --i) {
+                    targets = {get_tail(seq[i], targets)};
+                }
+                transitions.push_back(graph::transition{seq[0].first, seq[0].second, targets});
+            }
+        }
+        graph::set_transitions(*nodes[i_node], transitions);
+    }
+
+    sanity_assert(id == nodes.size(), "Some nodes are lost :(");
+    return nodes;
+}
+
+
+// patterns whose accept node can be reached from every node (sorted)
+std::vector<std::vector<std::uint32_t>> reachable_patterns(const graph::graph_t& g, const graph::accept_range& accepts) {
+    std::vector<std::vector<std::uint32_t>> predecessors(g.size());
+    for (const auto& node : g) {
+        for (const auto& t : graph::get_transitions(*node)) {
+            for (auto target : t.targets) {
+                predecessors[target].push_back(node->id);
+            }
+        }
+    }
+
+    std::vector<std::vector<std::uint32_t>> result(g.size());
+    for (std::uint32_t i_pattern = 0; i_pattern < accepts.n; ++i_pattern) {
+        std::vector<std::uint32_t> todo{accepts.base + i_pattern};
+        while (!todo.empty()) {
+            auto x = todo[todo.size() - 1];
+            todo.pop_back();
+            for (auto pre : predecessors[x]) {
+                if (result[pre].empty() || result[pre][result[pre].size() - 1] != i_pattern) {
+                    result[pre].push_back(i_pattern);
+                    todo.push_back(pre);
+                }
+            }
+        }
+    }
+    return result;
+}
+
+
+boost::optional<graph::graph_t> nfa_to_dfa(const graph::graph_t& nfa, const graph::accept_range& accepts, std::size_t max_states, bool report_all) {
+    // subset construction, every DFA state is a sorted set of NFA states plus the patterns that already matched
+    // FAIL and the accept nodes are kept as-is, BEGIN is the set that only contains the NFA BEGIN
+    // report_all keeps every path alive after its pattern matched, so longer matches get reported as well
+    using subset_t = std::vector<std::uint32_t>;
+    using state_t = std::pair<subset_t, subset_t>;
+
+    auto reachable = reachable_patterns(nfa, accepts);
+
+    std::uint32_t id = 0;
+    graph::graph_t nodes;
+    nodes.push_back(std::make_shared<graph::node>(id)); // FAIL node
+    nodes.push_back(std::make_shared<graph::node>(id)); // OK node
+
+    std::map<state_t, std::uint32_t> known;
+    std::vector<state_t> todo;
+    auto get_state = [&](const state_t& state) -> boost::optional<std::uint32_t> {
+        auto it = known.find(state);
+        if (it != known.end()) {
+            return it->second;
+        }
+        if (nodes.size() >= max_states) {
+            return boost::none;
+        }
+        nodes.push_back(std::make_shared<graph::node>(id));
+        known[state] = nodes[nodes.size() - 1]->id;
+        todo.push_back(state);
+        return nodes[nodes.size() - 1]->id;
+    };
+    get_state(state_t{{serial::id_begin}, {}});
+    while (id < accepts.base + accepts.n) {
+        nodes.push_back(std::make_shared<graph::node>(id));
+    }
+
+    while (!todo.empty()) {
+        state_t state = todo[todo.size() - 1];
+        todo.pop_back();
+        const auto& subset = std::get<0>(state);
+        const auto& matched = std::get<1>(state);
+        auto& n = *nodes[known[state]];
+
+        // 1. merge ranges of all members, so we get disjoint intervals with their target subsets
+        std::uint32_t id_tmp = 0;
+        graph::node merged(id_tmp); // only a helper, not a real state
+        std::vector<graph::transition> transitions;
+        for (auto member : subset) {
+            auto member_transitions = graph::get_transitions(*nfa[member]);
+            transitions.insert(transitions.end(), member_transitions.begin(), member_transitions.end());
+        }
+        graph::set_transitions(merged, transitions);
+
+        // 2. map target subsets to DFA states
+        //    every pattern is reported once, so members that can only lead to patterns that already matched are dropped
+        //    (for a single pattern that means reaching OK ends the search)
+        std::vector<graph::transition> transitions_dfa;
+        for (std::size_t i = 0; i + 1 < merged.next.size(); ++i) {
+            const auto& targets = *std::get<1>(merged.next[i]);
+            graph::transition t{std::get<0>(merged.next[i]), std::get<0>(merged.next[i + 1]) - 1, {}};
+
+            subset_t matched_next = matched;
+            for (auto target : targets) {
+                if (accepts.contains(target) && !std::binary_search(matched.begin(), matched.end(), target - accepts.base)) {
+                    t.targets.push_back(target);
+                    if (!report_all) {
+                        matched_next.push_back(target - accepts.base);
+                    }
+                }
+            }
+            std::sort(matched_next.begin(), matched_next.end());
+
+            subset_t subset_next;
+            subset_t matched_relevant;
+            for (auto target : targets) {
+                if (target == serial::id_fail || accepts.contains(target)) {
+                    continue;
+                }
+                bool useful = false;
+                for (auto i_pattern : reachable[target]) {
+                    if (!std::binary_search(matched_next.begin(), matched_next.end(), i_pattern)) {
+                        useful = true;
+                    } else {
+                        matched_relevant.push_back(i_pattern);
+                    }
+                }
+                if (useful) {
+                    subset_next.push_back(target);
+                }
+            }
+
+            if (!subset_next.empty()) {
+                std::sort(matched_relevant.begin(), matched_relevant.end());
+                matched_relevant.erase(std::unique(matched_relevant.begin(), matched_relevant.end()), matched_relevant.end());
+                auto next = get_state(state_t{subset_next, matched_relevant});
+                if (!next) {
+                    return boost::none;
+                }
+                t.targets.push_back(*next);
+            }
+
+            if (!t.targets.empty()) {
+                transitions_dfa.push_back(t);
+            }
+        }
+        graph::set_transitions(n, transitions_dfa);
+    }
+
+    sanity_assert(id == nodes.size(), "Some nodes are lost :(");
+    return nodes;
+}
+
+
+std::size_t longest_match(const graph::graph_t& g, const graph::accept_range& accepts) {
+    // 1. find all nodes that can reach an accept node, everything else cannot contribute to a match
+    std::vector<std::vector<std::uint32_t>> predecessors(g.size());
+    for (const auto& node : g) {
+        for (const auto& t : graph::get_transitions(*node)) {
+            for (auto target : t.targets) {
+                predecessors[target].push_back(node->id);
+            }
+        }
+    }
+    std::vector<bool> alive(g.size(), false);
+    std::vector<std::uint32_t> todo;
+    for (std::uint32_t i_pattern = 0; i_pattern < accepts.n; ++i_pattern) {
+        todo.push_back(accepts.base + i_pattern);
+        alive[accepts.base + i_pattern] = true;
+    }
+    while (!todo.empty()) {
+        auto x = todo[todo.size() - 1];
+        todo.pop_back();
+        for (auto pre : predecessors[x]) {
+            if (!alive[pre]) {
+                alive[pre] = true;
+                todo.push_back(pre);
+            }
+        }
+    }
+
+    // 2. longest path from BEGIN to any accept node, a cycle on the way means there is no limit
+    constexpr std::size_t unknown = serial::unbounded - 1;
+    std::vector<std::size_t> length(g.size(), unknown);
+    std::vector<bool> visiting(g.size(), false);
+    for (std::uint32_t i_pattern = 0; i_pattern < accepts.n; ++i_pattern) {
+        length[accepts.base + i_pattern] = 0;
+    }
+
+    std::function<std::size_t(std::uint32_t)> visit = [&](std::uint32_t x) -> std::size_t {
+        if (length[x] != unknown) {
+            return length[x];
+        }
+        if (visiting[x]) {
+            return serial::unbounded;
+        }
+        visiting[x] = true;
+
+        std::size_t result = 0;
+        for (const auto& t : graph::get_transitions(*g[x])) {
+            for (auto target : t.targets) {
+                if (!alive[target]) {
+                    continue;
+                }
+                auto sub = visit(target);
+                if (sub == serial::unbounded) {
+                    result = serial::unbounded;
+                } else if (result != serial::unbounded) {
+                    result = std::max(result, sub + 1);
+                }
+            }
+        }
+
+        visiting[x] = false;
+        length[x] = result;
+        return result;
+    };
+
+    return alive[serial::id_begin] ? visit(serial::id_begin) : 0;
+}
+
+
 template <typename T>
 void write_to_buffer(serial::buffer& b, std::size_t base, T element) {
     static_assert(sizeof(serial::word) == 4, "ups, need to rewrite the serializer!");
@@ -437,74 +1036,484 @@ void write_to_buffer(serial::buffer& b, std::size_t base, T element) {
 }
 
 
-serial::graph serialize(const graph::graph_t& g) {
-    // 1. calculate maximum numbers for allocations
-    std::size_t n = g.size();
-    std::size_t m = 0;
-    std::size_t o = 0;
+// target lists of all ranges of all nodes, identical ones (within and across nodes) are stored once
+struct target_lists {
+    std::vector<std::vector<serial::id>> lists;         // sorted, without FAIL
+    std::vector<std::vector<std::size_t>> node_lists;   // list index + 1 for every range, 0 = no transition
+};
+
+target_lists collect_target_lists(const graph::graph_t& g) {
+    target_lists result;
+    std::map<std::vector<serial::id>, std::size_t> list_idx;
+    result.node_lists.resize(g.size());
+    for (std::size_t i_node = 0; i_node < g.size(); ++i_node) {
+        const auto& next = g[i_node]->next;
+        for (std::size_t i_range = 0; i_range + 1 < next.size(); ++i_range) {
+            std::vector<serial::id> entries(std::get<1>(next[i_range])->begin(), std::get<1>(next[i_range])->end());
+            std::sort(entries.begin(), entries.end());
+            entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+            entries.erase(std::remove(entries.begin(), entries.end(), serial::id_fail), entries.end());
+
+            if (entries.empty()) {
+                result.node_lists[i_node].push_back(0);
+                continue;
+            }
+            auto it = list_idx.find(entries);
+            if (it == list_idx.end()) {
+                it = list_idx.emplace(entries, result.lists.size()).first;
+                result.lists.push_back(entries);
+            }
+            result.node_lists[i_node].push_back(it->second + 1);
+        }
+    }
+    return result;
+}
+
+
+// list index + 1 of the range of node_next that contains c (0 = no transition)
+std::size_t list_at(const std::vector<std::pair<char32_t, graph::slot_t>>& next, const std::vector<std::size_t>& lists, serial::character c) {
+    auto it = std::upper_bound(next.begin(), next.end(), c, [](serial::character c, const auto& value_slot) {
+        return c < std::get<0>(value_slot);
+    });
+    if (it == next.begin() || it == next.end()) {
+        return 0;
+    }
+    return lists[static_cast<std::size_t>(it - next.begin()) - 1];
+}
+
+
+// splits the element space at every range boundary of every node and merges everything that leads to the same target
+// lists in all nodes, returns an empty alphabet if that needs more than cfg::max_classes classes
+serial::alphabet find_classes(const graph::graph_t& g, const std::vector<std::vector<std::size_t>>& node_lists) {
+    std::vector<serial::character> bounds;
     for (const auto& node : g) {
-        m = std::max(m, node->next.size());
         for (const auto& value_slot : node->next) {
-            o = std::max(o, std::get<1>(value_slot)->size());
+            bounds.push_back(std::get<0>(value_slot));
+        }
+    }
+    std::sort(bounds.begin(), bounds.end());
+    bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+    if (bounds.size() < 2) {
+        return serial::alphabet();
+    }
+
+    // refine node by node, intervals that have no transition anywhere stay in class 0
+    std::vector<std::size_t> cls(bounds.size() - 1, 0);
+    std::size_t n_classes = 1;
+    for (std::size_t i_node = 0; i_node < g.size(); ++i_node) {
+        const auto& next = g[i_node]->next;
+        if (next.size() < 2) {
+            continue;
+        }
+
+        // both the intervals and the ranges of the node are sorted
+        std::map<std::pair<std::size_t, std::size_t>, std::size_t> split{{{0, 0}, 0}};
+        std::size_t r = 0;
+        for (std::size_t i = 0; i < cls.size(); ++i) {
+            while (r < next.size() && std::get<0>(next[r]) <= bounds[i]) {
+                r += 1;
+            }
+            std::size_t list = (r == 0 || r == next.size()) ? 0 : node_lists[i_node][r - 1];
+            auto it = split.emplace(std::make_pair(cls[i], list), split.size()).first;
+            cls[i] = it->second;
+        }
+        n_classes = split.size();
+        if (n_classes > cfg::max_classes) {
+            return serial::alphabet();
+        }
+    }
+
+    // neighbours of the same class share one interval
+    std::vector<serial::character> merged_bounds{bounds[0]};
+    std::vector<std::uint8_t> merged_ids{static_cast<std::uint8_t>(cls[0])};
+    for (std::size_t i = 1; i < cls.size(); ++i) {
+        if (cls[i] != merged_ids.back()) {
+            merged_bounds.push_back(bounds[i]);
+            merged_ids.push_back(static_cast<std::uint8_t>(cls[i]));
+        }
+    }
+    merged_bounds.push_back(bounds.back());
+
+    // class 0 is the default outside of the bounds anyway
+    while (!merged_ids.empty() && merged_ids.back() == 0) {
+        merged_ids.pop_back();
+        merged_bounds.pop_back();
+    }
+    while (!merged_ids.empty() && merged_ids.front() == 0) {
+        merged_ids.erase(merged_ids.begin());
+        merged_bounds.erase(merged_bounds.begin());
+    }
+
+    return serial::alphabet(n_classes, merged_bounds, merged_ids);
+}
+
+
+// graph files store the result as is, so any change to the node or list layout requires a new graph_file_version
+serial::graph serialize(const graph::graph_t& g, bool compress) {
+    // 1. collect target lists
+    std::size_t n = g.size();
+    target_lists tl = collect_target_lists(g);
+    const auto& lists = tl.lists;
+    const auto& node_lists = tl.node_lists;
+    std::size_t o = 0;
+    for (const auto& entries : lists) {
+        o = std::max(o, entries.size());
+    }
+
+    // 2. dense nodes are used if the alphabet is small enough and they do not blow up the graph (lists are shared either way)
+    serial::alphabet classes;
+    if (compress) {
+        classes = find_classes(g, node_lists);
+    }
+    if (classes.n_classes > 0) {
+        std::size_t size_ranges = 0;
+        std::size_t size_dense = 0;
+        for (const auto& node : g) {
+            std::size_t m = node->next.size();
+            size_ranges += (m > 0) ? 2 * m : 1;
+            size_dense += (m > 0) ? 1 + classes.n_classes : 1;
+        }
+        if (size_dense > cfg::max_dense_growth * size_ranges) {
+            classes = serial::alphabet();
         }
     }
 
-    // 2. create buffer
+    // 3. create buffer
     serial::graph result(n, o);
+    result.classes = classes;
     // at this point, the dispatch table exists
 
-    // 3. write data
+    // 4. write nodes, list offsets get patched once the lists are placed
+    std::vector<std::pair<std::size_t, std::size_t>> fixups; // (word offset, list index + 1)
     for (std::size_t i_node = 0; i_node < n; ++i_node) {
-        const auto& node = g[i_node];
+        const auto& next = g[i_node]->next;
+        std::size_t m = next.size();
         std::size_t base_node = result.size();
-
-        // write current size to dispatch table
         write_to_buffer(result.data, i_node, static_cast<serial::id>(base_node));
 
-        // start node by writing its size
-        result.grow(1);
-        write_to_buffer(result.data, base_node, static_cast<serial::id>(node->next.size()));
+        if (classes.n_classes > 0) {
+            // one offset per class, looked up at the first element of the class
+            std::size_t k = (m > 0) ? classes.n_classes : 0;
+            result.grow(1 + k);
+            write_to_buffer(result.data, base_node, static_cast<serial::word>((k << serial::node_kind_bits) | serial::node_dense));
+            std::vector<bool> done(k, false);
+            for (std::size_t i = 0; i < classes.ids.size() && m > 0; ++i) {
+                std::size_t c = classes.ids[i];
+                if (c != 0 && !done[c]) {
+                    done[c] = true;
+                    fixups.emplace_back(base_node + 1 + c, list_at(next, node_lists[i_node], classes.bounds[i]));
+                }
+            }
+            continue;
+        }
+
+        // pick the lookup strategy
+        std::size_t n_ascii_ranges = 0;
+        for (std::size_t i_range = 0; i_range + 1 < m; ++i_range) {
+            if (std::get<0>(next[i_range]) < serial::ascii_table_size) {
+                n_ascii_ranges += 1;
+            }
+        }
+        serial::word kind = serial::node_linear;
+        if (n_ascii_ranges >= cfg::min_ascii_ranges) {
+            kind = serial::node_ascii;
+        } else if (m > cfg::max_linear_ranges + 1) {
+            kind = serial::node_binary;
+        }
+
+        // header and boundaries
+        result.grow(1 + m);
+        write_to_buffer(result.data, base_node, static_cast<serial::word>((m << serial::node_kind_bits) | kind));
+        for (std::size_t i = 0; i < m; ++i) {
+            write_to_buffer(result.data, base_node + 1 + i, std::get<0>(next[i]));
+        }
+
+        // one list offset per range
+        std::size_t base_lists = result.size();
+        if (m > 0) {
+            result.grow(m - 1);
+            for (std::size_t i_range = 0; i_range + 1 < m; ++i_range) {
+                fixups.emplace_back(base_lists + i_range, node_lists[i_node][i_range]);
+            }
+        }
+
+        // direct table, elements outside of all ranges have no transition
+        if (kind == serial::node_ascii) {
+            std::size_t base_table = result.size();
+            result.grow(serial::ascii_table_size);
+            for (std::size_t i_range = 0; i_range + 1 < m; ++i_range) {
+                std::size_t begin = std::get<0>(next[i_range]);
+                std::size_t end = std::min<std::size_t>(std::get<0>(next[i_range + 1]), serial::ascii_table_size);
+                for (std::size_t c = begin; c < end; ++c) {
+                    fixups.emplace_back(base_table + c, node_lists[i_node][i_range]);
+                }
+            }
+        }
+    }
+
+    // 5. write target lists
+    std::vector<std::size_t> list_offsets;
+    for (const auto& entries : lists) {
+        std::size_t base_list = result.size();
+        list_offsets.push_back(base_list);
+        result.grow(1 + entries.size());
+        write_to_buffer(result.data, base_list, static_cast<serial::word>(entries.size()));
+        for (std::size_t i = 0; i < entries.size(); ++i) {
+            write_to_buffer(result.data, base_list + 1 + i, entries[i]);
+        }
+    }
+    for (const auto& f : fixups) {
+        if (f.second != 0) {
+            write_to_buffer(result.data, f.first, static_cast<serial::word>(list_offsets[f.second - 1]));
+        }
+    }
+
+    // 6. done
+    return result;
+}
+
+
+// builds the bit-parallel program (see serial::bitparallel) from the edges of g, returns an empty program if more than
+// 64 positions are required or a BEGIN position could belong to multiple patterns
+serial::bitparallel to_bitparallel(const graph::graph_t& g, const graph::accept_range& accepts) {
+    constexpr std::size_t max_positions = 64;
+    std::size_t n = g.size();
+    if (accepts.n > max_positions) {
+        return serial::bitparallel();
+    }
+
+    target_lists tl = collect_target_lists(g);
+    std::vector<std::vector<serial::id>> successors(n);
+    for (std::size_t u = 0; u < n; ++u) {
+        for (auto list : tl.node_lists[u]) {
+            if (list != 0) {
+                const auto& entries = tl.lists[list - 1];
+                successors[u].insert(successors[u].end(), entries.begin(), entries.end());
+            }
+        }
+        std::sort(successors[u].begin(), successors[u].end());
+        successors[u].erase(std::unique(successors[u].begin(), successors[u].end()), successors[u].end());
+    }
+
+    // only nodes on a path from BEGIN to an accept node matter
+    std::vector<bool> reachable(n, false);
+    std::vector<serial::id> todo{serial::id_begin};
+    reachable[serial::id_begin] = true;
+    while (!todo.empty()) {
+        auto u = todo.back();
+        todo.pop_back();
+        for (auto v : successors[u]) {
+            if (!reachable[v]) {
+                reachable[v] = true;
+                todo.push_back(v);
+            }
+        }
+    }
+
+    std::vector<std::vector<serial::id>> predecessors(n);
+    for (std::size_t u = 0; u < n; ++u) {
+        for (auto v : successors[u]) {
+            predecessors[v].push_back(static_cast<serial::id>(u));
+        }
+    }
+    std::vector<std::uint64_t> patterns(n, 0); // patterns that can still be reached from a node
+    for (std::uint32_t i = 0; i < accepts.n; ++i) {
+        std::uint64_t bit = static_cast<std::uint64_t>(1) << i;
+        todo.assign(1, accepts.base + i);
+        patterns[accepts.base + i] |= bit;
+        while (!todo.empty()) {
+            auto v = todo.back();
+            todo.pop_back();
+            for (auto u : predecessors[v]) {
+                if (!(patterns[u] & bit)) {
+                    patterns[u] |= bit;
+                    todo.push_back(u);
+                }
+            }
+        }
+    }
+
+    // every useful node needs at least one position
+    std::size_t n_useful = 0;
+    for (std::size_t u = 0; u < n; ++u) {
+        if (reachable[u] && patterns[u] && !accepts.contains(static_cast<std::uint32_t>(u))) {
+            n_useful += 1;
+        }
+    }
+    if (n_useful > max_positions) {
+        return serial::bitparallel();
+    }
+
+    auto classes = find_classes(g, tl.node_lists);
+    if (classes.n_classes == 0) {
+        return serial::bitparallel();
+    }
+    std::vector<serial::character> first_element(classes.n_classes, 0);
+    std::vector<bool> seen(classes.n_classes, false);
+    for (std::size_t i = 0; i < classes.ids.size(); ++i) {
+        if (!seen[classes.ids[i]]) {
+            seen[classes.ids[i]] = true;
+            first_element[classes.ids[i]] = classes.bounds[i];
+        }
+    }
 
-        // write node body
-        std::size_t base_node_body = base_node + 1;
-        for (std::size_t i_value_slot = 0; i_value_slot < node->next.size(); ++i_value_slot) {
-            const auto& value_slot = node->next[i_value_slot];
+    // classes of every useful edge u -> v
+    std::map<std::pair<serial::id, serial::id>, std::vector<bool>> edges;
+    for (std::size_t u = 0; u < n; ++u) {
+        if (!reachable[u] || !patterns[u]) {
+            continue;
+        }
+        for (std::size_t c = 1; c < classes.n_classes; ++c) {
+            std::size_t list = list_at(g[u]->next, tl.node_lists[u], first_element[c]);
+            if (list == 0) {
+                continue;
+            }
+            for (auto v : tl.lists[list - 1]) {
+                if (patterns[v]) {
+                    auto& label = edges[std::make_pair(static_cast<serial::id>(u), v)];
+                    label.resize(classes.n_classes, false);
+                    label[c] = true;
+                }
+            }
+        }
+    }
 
-            std::size_t base_value_slot = base_node_body + i_value_slot * (1 + o);
-            serial::character c = std::get<0>(value_slot);
+    // positions: (u, classes, patterns of v), edges that share all three can be taken interchangeably
+    std::map<std::tuple<serial::id, std::uint64_t, std::vector<bool>>, std::size_t> position_idx;
+    std::vector<std::size_t> edge_positions;
+    std::vector<serial::id> position_node;
+    std::vector<const std::vector<bool>*> position_label;
+    for (const auto& e : edges) {
+        auto key = std::make_tuple(e.first.first, patterns[e.first.second], e.second);
+        auto it = position_idx.find(key);
+        if (it == position_idx.end()) {
+            if (position_idx.size() == max_positions) {
+                return serial::bitparallel();
+            }
+            it = position_idx.emplace(key, position_idx.size()).first;
+            position_node.push_back(e.first.first);
+            position_label.push_back(&std::get<2>(it->first));
+        }
+        edge_positions.push_back(it->second);
+    }
+
+    serial::bitparallel result;
+    result.n_positions = position_idx.size();
+    result.classes = classes;
+    result.masks.assign(classes.n_classes, 0);
+    result.last.assign(accepts.n, 0);
+
+    // follow sets depend on the node only: all positions of the edges that lead into it
+    std::vector<std::uint64_t> follow_node(n, 0);
+    std::size_t i_edge = 0;
+    for (const auto& e : edges) {
+        follow_node[e.first.second] |= static_cast<std::uint64_t>(1) << edge_positions[i_edge];
+        i_edge += 1;
+    }
+    for (std::uint32_t i = 0; i < accepts.n; ++i) {
+        result.first |= follow_node[accepts.base + i];
+    }
+
+    result.tables.assign(result.n_tables() * 256, 0);
+    for (std::size_t p = 0; p < result.n_positions; ++p) {
+        std::uint64_t bit = static_cast<std::uint64_t>(1) << p;
+        std::uint64_t follow = follow_node[position_node[p]];
+        for (std::size_t b = 0; b < 256; ++b) {
+            if (b & (1 << (p % 8))) {
+                result.tables[(p / 8) * 256 + b] |= follow;
+            }
+        }
 
-            // write character that belongs to slot
-            result.grow(1);
-            write_to_buffer(result.data, base_value_slot, c);
+        for (std::size_t c = 0; c < classes.n_classes; ++c) {
+            if ((*position_label[p])[c]) {
+                result.masks[c] |= bit;
+            }
+        }
+    }
 
-            // write fixed size, sorted, dedup data to slot
-            std::size_t base_value_slot_payload = base_value_slot + 1;
-            std::vector<std::uint32_t> entries_sorted(std::get<1>(value_slot)->begin(), std::get<1>(value_slot)->end());
-            std::sort(entries_sorted.begin(), entries_sorted.end());
-            entries_sorted.erase(std::unique(entries_sorted.begin(), entries_sorted.end()), entries_sorted.end());
-            for (std::size_t i_slot_entry = 0; i_slot_entry < o; ++i_slot_entry) {
-                result.grow(1);
-                if (i_slot_entry < entries_sorted.size()) {
-                    std::size_t base_slot_entry = base_value_slot_payload + i_slot_entry;
-                    serial::id id = entries_sorted[i_slot_entry];
-                    write_to_buffer(result.data, base_slot_entry, id);
-                } // else => data is 0
+    // BEGIN positions tell which pattern matched
+    for (const auto& entry : position_idx) {
+        if (std::get<0>(entry.first) != serial::id_begin) {
+            continue;
+        }
+        std::uint64_t owners = std::get<1>(entry.first);
+        if (owners & (owners - 1)) {
+            // reaching it would not tell which one
+            return serial::bitparallel();
+        }
+        for (std::uint32_t i = 0; i < accepts.n; ++i) {
+            if (owners & (static_cast<std::uint64_t>(1) << i)) {
+                result.last[i] |= static_cast<std::uint64_t>(1) << entry.second;
             }
         }
     }
 
-    // 4. done
     return result;
 }
 
 
-serial::graph string_to_graph(const std::u32string& input) {
-    auto r = parse_ast(input);
-    if (r.empty()) {
-        throw user_error("Empty regex is not allowed!");
+serial::graph string_to_graph(const std::u32string& input, const graph_options& opts) {
+    return string_to_graph(std::vector<std::u32string>{input}, opts);
+}
+
+
+serial::graph string_to_graph(const std::vector<std::u32string>& inputs, const graph_options& opts) {
+    if (inputs.empty()) {
+        throw user_error("At least one regex is required!");
     }
 
-    auto g = ast_to_graph(r);
+    std::vector<ast::regex> asts;
+    for (const auto& input : inputs) {
+        asts.push_back(parse_ast(input));
+        if (asts[asts.size() - 1].empty()) {
+            throw user_error("Empty regex is not allowed!");
+        }
+    }
+
+    graph::graph_t g;
+    if (asts.size() == 1) {
+        g = ast_to_graph(asts[0]);
+    } else {
+        std::vector<graph::graph_t> patterns;
+        for (const auto& r : asts) {
+            patterns.push_back(ast_to_graph(r));
+        }
+        g = merge_patterns(patterns);
+    }
+    graph::accept_range accepts(asts.size());
 
-    return serialize(g);
+    if (opts.encoding == serial::encoding::utf8) {
+        g = lower_to_utf8(g);
+    }
+
+    // the NFA usually needs fewer positions than the DFA, match ends require the automaton
+    bool use_bp = opts.bitparallel && opts.mode == serial::match_mode::starts;
+    serial::bitparallel bp;
+    if (use_bp) {
+        bp = to_bitparallel(g, accepts);
+    }
+
+    if (opts.determinize) {
+        // fall back to the NFA if the DFA explodes
+        auto dfa = nfa_to_dfa(g, accepts, cfg::max_dfa_states, serial::engine_mode(opts.mode) == serial::match_mode::longest);
+        if (dfa) {
+            g = *dfa;
+            if (use_bp && bp.n_positions == 0) {
+                bp = to_bitparallel(g, accepts);
+            }
+        }
+    }
+
+    auto result = serialize(g, opts.alphabet);
+    result.bp = bp;
+    result.enc = opts.encoding;
+    result.max_length = longest_match(g, accepts);
+    result.accept_base = accepts.base;
+    result.n_patterns = accepts.n;
+    result.mode = opts.mode;
+    if (opts.prefilter && asts.size() == 1) {
+        // only single patterns get a prefilter, a set would need one literal per pattern (and their union of candidates)
+        result.prefilter = literals::find_required(asts[0], opts.encoding);
+    }
+    return result;
 }
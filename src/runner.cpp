@@ -0,0 +1,67 @@
+#include <algorithm>
+
+#include "common.hpp"
+#include "runner.hpp"
+
+void merge_matches(std::vector<match>& matches, serial::match_mode mode) {
+    std::sort(matches.begin(), matches.end());
+    if (mode == serial::match_mode::starts) {
+        matches.erase(std::unique(matches.begin(), matches.end()), matches.end());
+        return;
+    }
+
+    bool longest = serial::engine_mode(mode) == serial::match_mode::longest;
+    std::size_t n = 0;
+    for (std::size_t i = 0; i < matches.size(); ++i) {
+        if (n > 0 && matches[n - 1] == matches[i]) {
+            auto& kept = matches[n - 1];
+            kept.end = longest ? std::max(kept.end, matches[i].end) : std::min(kept.end, matches[i].end);
+        } else {
+            matches[n] = matches[i];
+            n += 1;
+        }
+    }
+    matches.resize(n);
+}
+
+void runner::enqueue(const std::u32string& chunk) {
+    finished.push_back(run(chunk));
+}
+
+void runner::enqueue(const std::string& chunk) {
+    finished.push_back(run(chunk));
+}
+
+std::vector<match> runner::wait() {
+    sanity_assert(!finished.empty(), "no chunk was submitted");
+    auto result = std::move(finished.front());
+    finished.pop_front();
+    return result;
+}
+
+std::size_t runner::pending() const {
+    return finished.size();
+}
+
+std::size_t runner::depth() const {
+    return 1;
+}
+
+stage_times runner::stages() const {
+    return stage_ms;
+}
+
+void runner::set_profile_sink(const std::shared_ptr<profile_sink>& sink, const std::string& name) {
+    this->sink = sink;
+    sink_name = name;
+}
+
+void runner::record(chunk_profile p) {
+    for (const auto& s : p.stages) {
+        stage_ms[s.first] += s.second;
+    }
+    if (sink) {
+        p.runner = sink_name;
+        sink->record(p);
+    }
+}
@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <exception>
+#include <utility>
+
+#include <boost/locale.hpp>
+
+#include "chunker.hpp"
+#include "cpuengine.hpp"
+#include "engine.hpp"
+#include "searcher.hpp"
+#include "transcode.hpp"
+
+searcher::searcher(const searcher_options& opts) : opts(opts), pool(std::max<std::size_t>(opts.threads, 1)), next_handle(1), shutdown(false) {
+    if (opts.pipeline_depth == 0) {
+        throw user_error("pipeline depth must be at least 1!");
+    }
+    if (opts.backend == "cpu") {
+        cpu_eng = std::make_shared<cpuengine>(std::max<std::size_t>(opts.threads, 1));
+    } else if (opts.backend == "opencl") {
+        ocl_eng = std::make_shared<oclengine>(opts.platform, opts.device, opts.program_cache);
+    } else {
+        throw user_error("unknown backend, use \"opencl\" or \"cpu\"!");
+    }
+
+    worker = std::thread(&searcher::worker_loop, this);
+}
+
+searcher::~searcher() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        shutdown = true;
+    }
+    cv_jobs.notify_all();
+    worker.join();
+}
+
+searcher::handle searcher::compile(const std::vector<std::string>& regexes, const graph_options& gopts) {
+    if (regexes.empty()) {
+        throw user_error("pattern set is empty!");
+    }
+
+    // graphs are built on the calling thread, so compiling does not hold up searches
+    std::vector<std::u32string> regexes_utf32;
+    for (const auto& r : regexes) {
+        regexes_utf32.push_back(boost::locale::conv::utf_to_utf<char32_t>(r));
+    }
+    auto c = std::make_shared<compiled>(compiled{string_to_graph(regexes_utf32, gopts), nullptr, 0});
+
+    c->overlap = overlap_for(c->graph, opts.max_chunk_size);
+
+    // the runner (and the automaton upload) belongs to the worker
+    auto done = std::make_shared<std::promise<void>>();
+    post([this, c, done]() {
+        try {
+            if (cpu_eng) {
+                c->r.reset(new cpurunner(cpu_eng, opts.max_chunk_size, c->graph, false));
+            } else {
+                c->r.reset(new oclrunner(ocl_eng, opts.max_chunk_size, c->graph, false, opts.pipeline_depth));
+            }
+            done->set_value();
+        } catch (...) {
+            done->set_exception(std::current_exception());
+        }
+    });
+    done->get_future().get();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    handle h = next_handle++;
+    patterns[h] = c;
+    return h;
+}
+
+void searcher::release(handle h) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (patterns.erase(h) == 0) {
+        throw user_error("unknown pattern handle " + std::to_string(h) + "!");
+    }
+}
+
+std::future<std::vector<search_match>> searcher::submit(handle h, std::string buffer) {
+    auto c = lookup(h);
+    auto result = std::make_shared<std::promise<std::vector<search_match>>>();
+    auto data = std::make_shared<std::string>(std::move(buffer));
+    post([this, c, result, data]() {
+        try {
+            result->set_value(search(*c, *data));
+        } catch (...) {
+            result->set_exception(std::current_exception());
+        }
+    });
+    return result->get_future();
+}
+
+void searcher::worker_loop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cv_jobs.wait(lock, [this]() {
+            return shutdown || !jobs.empty();
+        });
+        if (jobs.empty()) {
+            // shutdown, but everything that was submitted is finished first
+            return;
+        }
+
+        auto job = std::move(jobs.front());
+        jobs.pop_front();
+        lock.unlock();
+        job();
+        lock.lock();
+    }
+}
+
+void searcher::post(std::function<void()> job) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push_back(std::move(job));
+    }
+    cv_jobs.notify_one();
+}
+
+std::shared_ptr<searcher::compiled> searcher::lookup(handle h) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = patterns.find(h);
+    if (it == patterns.end()) {
+        throw user_error("unknown pattern handle " + std::to_string(h) + "!");
+    }
+    return it->second;
+}
+
+std::vector<search_match> searcher::search(compiled& c, const std::string& buffer) {
+    bool ends = c.graph.mode != serial::match_mode::starts;
+    std::vector<search_match> result;
+    std::size_t next_free = 0;
+    auto done = [&](std::size_t offset, std::size_t owned, const std::vector<match>& matches) {
+        auto add = [&](const match& m) {
+            result.push_back(search_match{offset + m.offset, ends ? offset + m.end : 0, m.pattern});
+        };
+        if (c.graph.mode == serial::match_mode::non_overlapping) {
+            pick_non_overlapping(matches, offset, owned, next_free, add);
+        } else {
+            for (std::size_t i = 0; i < matches.size() && matches[i].offset < owned; ++i) {
+                add(matches[i]);
+            }
+        }
+    };
+
+    chunker chunks(*c.r, opts.max_chunk_size, c.overlap);
+    if (c.graph.enc == serial::encoding::utf8) {
+        // bytes go straight to the engine, offsets are byte offsets already
+        chunks.run(buffer, done);
+    } else {
+        offset_map bytes;
+        std::u32string text;
+        append_utf32(text, buffer.data(), buffer.data() + buffer.size(), &pool, &bytes);
+        chunks.run(text, done);
+        for (auto& m : result) {
+            m.offset = bytes.byte_offset(m.offset);
+            if (ends) {
+                m.end = bytes.byte_offset(m.end);
+            }
+        }
+    }
+    return result;
+}
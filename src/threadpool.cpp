@@ -0,0 +1,92 @@
+#include "threadpool.hpp"
+
+threadpool::threadpool(std::size_t n_threads) : job(nullptr), job_n(0), job_next(0), job_running(0), generation(0), shutdown(false) {
+    // the calling thread helps out during parallel_for, so spawn one thread less
+    for (std::size_t i = 1; i < n_threads; ++i) {
+        workers.emplace_back(&threadpool::worker_loop, this);
+    }
+}
+
+threadpool::~threadpool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        shutdown = true;
+    }
+    cv_work.notify_all();
+    for (auto& w : workers) {
+        w.join();
+    }
+}
+
+std::size_t threadpool::size() const {
+    return workers.size() + 1;
+}
+
+void threadpool::parallel_for(std::size_t n, const std::function<void(std::size_t)>& f) {
+    if (n == 0) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    job = &f;
+    job_n = n;
+    job_next = 0;
+    job_running = 0;
+    job_error = nullptr;
+    generation += 1;
+    cv_work.notify_all();
+
+    // help out
+    work_on_job(lock);
+
+    // wait for stragglers
+    cv_done.wait(lock, [this]() {
+        return job_next >= job_n && job_running == 0;
+    });
+    job = nullptr;
+
+    if (job_error) {
+        std::rethrow_exception(job_error);
+    }
+}
+
+void threadpool::worker_loop() {
+    std::size_t seen_generation = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        cv_work.wait(lock, [this, &seen_generation]() {
+            return shutdown || (generation != seen_generation && job != nullptr);
+        });
+        if (shutdown) {
+            return;
+        }
+        seen_generation = generation;
+        work_on_job(lock);
+    }
+}
+
+void threadpool::work_on_job(std::unique_lock<std::mutex>& lock) {
+    while (job_next < job_n) {
+        std::size_t i = job_next++;
+        job_running += 1;
+        const auto* f = job;
+
+        lock.unlock();
+        try {
+            (*f)(i);
+        } catch (...) {
+            lock.lock();
+            if (!job_error) {
+                job_error = std::current_exception();
+            }
+            job_next = job_n; // skip remaining tasks
+            lock.unlock();
+        }
+        lock.lock();
+
+        job_running -= 1;
+    }
+    if (job_running == 0) {
+        cv_done.notify_all();
+    }
+}
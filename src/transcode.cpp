@@ -0,0 +1,299 @@
+#include <cstdint>
+#include <cstring>
+
+#include <algorithm>
+#include <vector>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define TRANSCODE_X86 1
+#endif
+
+#include "common.hpp"
+#include "config.hpp"
+#include "transcode.hpp"
+
+void offset_map::push(std::size_t codepoint, std::size_t byte, std::size_t width) {
+    if (!runs.empty()) {
+        const auto& last = runs.back();
+        if (last.width == width && last.byte + (codepoint - last.codepoint) * width == byte) {
+            return;
+        }
+    }
+    runs.push_back(run{codepoint, byte, width});
+}
+
+void offset_map::append(const offset_map& other, std::size_t codepoint, std::size_t byte) {
+    for (const auto& r : other.runs) {
+        push(codepoint + r.codepoint, byte + r.byte, r.width);
+    }
+}
+
+std::size_t offset_map::byte_offset(std::size_t codepoint) const {
+    sanity_assert(!runs.empty() && runs.front().codepoint <= codepoint, "codepoint is not covered by the offset map");
+    auto it = std::upper_bound(runs.begin(), runs.end(), codepoint, [](std::size_t c, const run& r) {
+        return c < r.codepoint;
+    });
+    --it;
+    return it->byte + (codepoint - it->codepoint) * it->width;
+}
+
+void offset_map::drop_before(std::size_t codepoint) {
+    // the run that contains codepoint has to stay
+    while (runs.size() > 1 && runs[1].codepoint <= codepoint) {
+        runs.pop_front();
+    }
+}
+
+namespace {
+
+// number of trail bytes of a lead byte, -1 if it cannot start a sequence (see boost::locale::utf::utf_traits<char>)
+int trail_length(unsigned char c) {
+    if (c < 0x80) {
+        return 0;
+    } else if (c < 0xc2) {
+        return -1;
+    } else if (c < 0xe0) {
+        return 1;
+    } else if (c < 0xf0) {
+        return 2;
+    } else if (c <= 0xf4) {
+        return 3;
+    } else {
+        return -1;
+    }
+}
+
+bool is_trail(unsigned char c) {
+    return (c & 0xc0) == 0x80;
+}
+
+int utf8_width(std::uint32_t c) {
+    if (c < 0x80) {
+        return 1;
+    } else if (c < 0x800) {
+        return 2;
+    } else if (c < 0x10000) {
+        return 3;
+    } else {
+        return 4;
+    }
+}
+
+// decodes the sequence at p and advances p the same way boost does (a byte that should have been a trail byte is consumed
+// as well), returns false for illegal and incomplete sequences
+bool decode_one(const unsigned char*& p, const unsigned char* end, char32_t& c) {
+    unsigned char lead = *p++;
+    int n = trail_length(lead);
+    if (n < 0) {
+        return false;
+    }
+
+    std::uint32_t x = lead & ((1u << (6 - n)) - 1);
+    for (int i = 0; i < n; ++i) {
+        if (p == end) {
+            return false;
+        }
+        unsigned char t = *p++;
+        if (!is_trail(t)) {
+            return false;
+        }
+        x = (x << 6) | (t & 0x3fu);
+    }
+
+    // no surrogates, nothing beyond the last codepoint and no overlong encodings
+    if (x > 0x10ffff || (x >= 0xd800 && x <= 0xdfff) || utf8_width(x) != n + 1) {
+        return false;
+    }
+    c = x;
+    return true;
+}
+
+// widens the ASCII prefix of [p, end) block by block, returns the number of bytes that were consumed
+// blocks are written in full (the non-ASCII tail gets overwritten later), only the last few bytes are left to the caller
+using widen_fn = std::size_t (*)(const unsigned char* p, const unsigned char* end, char32_t* out);
+
+#ifdef TRANSCODE_X86
+std::size_t widen_ascii_sse2(const unsigned char* p, const unsigned char* end, char32_t* out) {
+    const unsigned char* start = p;
+    const __m128i zero = _mm_setzero_si128();
+    while (end - p >= 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i lo = _mm_unpacklo_epi8(v, zero);
+        __m128i hi = _mm_unpackhi_epi8(v, zero);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_unpacklo_epi16(lo, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 4), _mm_unpackhi_epi16(lo, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 8), _mm_unpacklo_epi16(hi, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 12), _mm_unpackhi_epi16(hi, zero));
+        int mask = _mm_movemask_epi8(v);
+        if (mask != 0) {
+            p += __builtin_ctz(static_cast<unsigned>(mask));
+            break;
+        }
+        p += 16;
+        out += 16;
+    }
+    return static_cast<std::size_t>(p - start);
+}
+
+__attribute__((target("avx2")))
+std::size_t widen_ascii_avx2(const unsigned char* p, const unsigned char* end, char32_t* out) {
+    const unsigned char* start = p;
+    while (end - p >= 32) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m128i lo = _mm256_castsi256_si128(v);
+        __m128i hi = _mm256_extracti128_si256(v, 1);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), _mm256_cvtepu8_epi32(lo));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 8), _mm256_cvtepu8_epi32(_mm_srli_si128(lo, 8)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 16), _mm256_cvtepu8_epi32(hi));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + 24), _mm256_cvtepu8_epi32(_mm_srli_si128(hi, 8)));
+        int mask = _mm256_movemask_epi8(v);
+        if (mask != 0) {
+            return static_cast<std::size_t>(p - start) + static_cast<std::size_t>(__builtin_ctz(static_cast<unsigned>(mask)));
+        }
+        p += 32;
+        out += 32;
+    }
+    std::size_t n = static_cast<std::size_t>(p - start);
+    return n + widen_ascii_sse2(p, end, out);
+}
+#else
+std::size_t widen_ascii_none(const unsigned char* /*p*/, const unsigned char* /*end*/, char32_t* /*out*/) {
+    return 0;
+}
+#endif
+
+widen_fn pick_widen() {
+#ifdef TRANSCODE_X86
+    // SSE2 is part of x86-64
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return widen_ascii_avx2;
+    }
+    return widen_ascii_sse2;
+#else
+    return widen_ascii_none;
+#endif
+}
+
+template <bool Track>
+std::size_t decode(const unsigned char* begin, const unsigned char* end, char32_t* out, offset_map* map) {
+    static const widen_fn widen = pick_widen();
+
+    const unsigned char* p = begin;
+    char32_t* o = out;
+    while (p < end) {
+        if (*p < 0x80) {
+            // ASCII run, wide blocks first, the last few bytes one by one
+            std::size_t n = widen(p, end, o);
+            if (Track && n > 0) {
+                map->push(static_cast<std::size_t>(o - out), static_cast<std::size_t>(p - begin), 1);
+            }
+            p += n;
+            o += n;
+            for (; p < end && *p < 0x80; ++p, ++o) {
+                if (Track) {
+                    map->push(static_cast<std::size_t>(o - out), static_cast<std::size_t>(p - begin), 1);
+                }
+                *o = *p;
+            }
+            continue;
+        }
+
+        const unsigned char* seq = p;
+        char32_t c;
+        if (decode_one(p, end, c)) {
+            if (Track) {
+                map->push(static_cast<std::size_t>(o - out), static_cast<std::size_t>(seq - begin), static_cast<std::size_t>(p - seq));
+            }
+            *o = c;
+            o += 1;
+        }
+    }
+    return static_cast<std::size_t>(o - out);
+}
+
+// first position at or after p where decoding can start without changing the result, i.e. no sequence that starts before
+// it reaches it (always the case right after an ASCII byte, see decode_one)
+const unsigned char* next_split(const unsigned char* begin, const unsigned char* p, const unsigned char* end) {
+    for (; p < end; ++p) {
+        // only the closest byte that is no trail byte can start a sequence that still reaches p
+        bool safe = true;
+        for (int k = 1; k <= 3 && p - k >= begin; ++k) {
+            if (!is_trail(p[-k])) {
+                safe = trail_length(p[-k]) < k;
+                break;
+            }
+        }
+        if (safe) {
+            return p;
+        }
+    }
+    return end;
+}
+
+} // namespace
+
+std::size_t utf8_to_utf32(const char* begin, const char* end, char32_t* out, offset_map* map) {
+    auto b = reinterpret_cast<const unsigned char*>(begin);
+    auto e = reinterpret_cast<const unsigned char*>(end);
+    if (map) {
+        return decode<true>(b, e, out, map);
+    } else {
+        return decode<false>(b, e, out, nullptr);
+    }
+}
+
+std::size_t utf8_to_utf32(const char* begin, const char* end, char32_t* out, threadpool& pool, offset_map* map) {
+    auto b = reinterpret_cast<const unsigned char*>(begin);
+    auto e = reinterpret_cast<const unsigned char*>(end);
+    std::size_t size = static_cast<std::size_t>(e - b);
+    std::size_t n_blocks = size / cfg::transcode_block_size;
+    if (n_blocks < 2 || pool.size() < 2) {
+        return utf8_to_utf32(begin, end, out, map);
+    }
+
+    std::vector<const unsigned char*> bounds{b};
+    for (std::size_t i = 1; i < n_blocks; ++i) {
+        auto p = next_split(b, b + i * cfg::transcode_block_size, e);
+        if (p > bounds.back() && p < e) {
+            bounds.push_back(p);
+        }
+    }
+    bounds.push_back(e);
+
+    // every block writes to its byte offset, the codepoints before it never need more room than that
+    std::size_t n = bounds.size() - 1;
+    std::vector<std::size_t> counts(n, 0);
+    std::vector<offset_map> maps(map ? n : 0);
+    pool.parallel_for(n, [&](std::size_t i) {
+        std::size_t first = static_cast<std::size_t>(bounds[i] - b);
+        if (map) {
+            counts[i] = decode<true>(bounds[i], bounds[i + 1], out + first, &maps[i]);
+        } else {
+            counts[i] = decode<false>(bounds[i], bounds[i + 1], out + first, nullptr);
+        }
+    });
+
+    // close the gaps, blocks only move towards the front
+    std::size_t total = 0;
+    for (std::size_t i = 0; i < n; ++i) {
+        std::size_t first = static_cast<std::size_t>(bounds[i] - b);
+        if (total != first) {
+            std::memmove(out + total, out + first, counts[i] * sizeof(char32_t));
+        }
+        if (map) {
+            map->append(maps[i], total, first);
+        }
+        total += counts[i];
+    }
+    return total;
+}
+
+void append_utf32(std::u32string& text, const char* begin, const char* end, threadpool* pool, offset_map* map) {
+    // decode straight into the text, there are never more codepoints than bytes
+    std::size_t size = text.size();
+    text.resize(size + static_cast<std::size_t>(end - begin));
+    std::size_t n = pool ? utf8_to_utf32(begin, end, &text[size], *pool, map) : utf8_to_utf32(begin, end, &text[size], map);
+    text.resize(size + n);
+}